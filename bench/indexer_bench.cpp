@@ -0,0 +1,142 @@
+// g++ -std=c++14 -O2 -pthread -I.. indexer_bench.cpp ../indexer.cpp
+
+// the wrap is reached by moving the counter from the inside
+#define private public
+#include "../indexer.h"
+#undef private
+#include <stdio.h>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+using namespace utility;
+
+// The Indexer before the bitmaps, a std::set of live indices and a linear
+// probe from 1 once the counter reached max_index
+class SetIndexer {
+ public:
+  explicit SetIndexer(unsigned long max_index = kMaxIndexNumber) : max_index_(max_index), index_count_(0) {}
+
+  Index CreateIndex() {
+    std::lock_guard<std::mutex> lock(index_pool_lock_);
+    if (index_pool_.size() == max_index_) {
+      return kInvalidIndex;
+    }
+    Index index = 0;
+    if (index_count_ != max_index_) {
+      index = ++index_count_;
+    } else {
+      index = 1;
+      while (index_pool_.find(index) != index_pool_.end()) {
+        ++index;
+      }
+    }
+    index_pool_.insert(index);
+    return index;
+  }
+
+  void DestroyIndex(Index index) {
+    std::lock_guard<std::mutex> lock(index_pool_lock_);
+    index_pool_.erase(index);
+  }
+
+ private:
+  unsigned long max_index_;
+  unsigned long index_count_;
+  std::set<Index> index_pool_;
+  std::mutex index_pool_lock_;
+};
+
+// 1M indices live, destroy the oldest and create a new one, ns per pair
+template <typename IndexerType>
+static void BenchSteadyState(const char* name) {
+  const long kLive = 1000000;
+  const long kOperations = 4000000;
+  IndexerType indexer;
+  std::deque<Index> live;
+  for (long i = 0; i < kLive; ++i) {
+    live.push_back(indexer.CreateIndex());
+  }
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < kOperations; ++i) {
+    indexer.DestroyIndex(live.front());
+    live.pop_front();
+    live.push_back(indexer.CreateIndex());
+  }
+  auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  printf("%-14s 1M live %10.1f ns per destroy+create\n", name, elapsed / kOperations);
+}
+
+// After the counter wrapped with the 100k lowest indices still live, keep
+// destroying and creating one more index, ns per pair
+template <typename IndexerType>
+static double TimeChurn(IndexerType& indexer, Index index, long operations) {
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < operations; ++i) {
+    indexer.DestroyIndex(index);
+    index = indexer.CreateIndex();
+  }
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / operations;
+}
+
+static void BenchAfterWrap() {
+  const unsigned long kLongLived = 100000;
+  // the set is at its limit after kLongLived + 1 indices
+  SetIndexer set_indexer(kLongLived + 1);
+  for (unsigned long i = 0; i <= kLongLived; ++i) {
+    set_indexer.CreateIndex();
+  }
+  auto set_time = TimeChurn(set_indexer, kLongLived + 1, 200);
+  printf("%-14s wrapped %10.1f ns per destroy+create\n", "std::set", set_time);
+  Indexer indexer;
+  for (unsigned long i = 0; i <= kLongLived; ++i) {
+    indexer.CreateIndex();
+  }
+  // as if the rest of the 32 bit range had been used and freed
+  indexer.index_count_ = kMaxIndexNumber;
+  indexer.next_index_ = 1;
+  auto bitmap_time = TimeChurn(indexer, kLongLived + 1, 4000000);
+  printf("%-14s wrapped %10.1f ns per destroy+create\n", "Indexer", bitmap_time);
+}
+
+// Every thread keeps 1000 indices live, destroys its oldest and creates a
+// new one, ns per destroy+create over all threads
+template <typename IndexerType>
+static void BenchDestroyCreate(const char* name) {
+  const long kOperations = 8000000;
+  for (int thread_number : {1, 4, 16, 64}) {
+    IndexerType indexer;
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < thread_number; ++t) {
+      threads.emplace_back([&indexer, thread_number] {
+        std::deque<Index> live;
+        for (int i = 0; i < 1000; ++i) {
+          live.push_back(indexer.CreateIndex());
+        }
+        for (long i = 0; i < kOperations / thread_number; ++i) {
+          indexer.DestroyIndex(live.front());
+          live.pop_front();
+          live.push_back(indexer.CreateIndex());
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    printf("%-14s %2d threads %6.1f ns per destroy+create\n", name, thread_number, elapsed / kOperations);
+  }
+}
+
+int main() {
+  BenchSteadyState<SetIndexer>("std::set");
+  BenchSteadyState<Indexer>("Indexer");
+  BenchAfterWrap();
+  BenchDestroyCreate<SetIndexer>("std::set");
+  BenchDestroyCreate<Indexer>("Indexer");
+  return 0;
+}
@@ -0,0 +1,34 @@
+// g++ -std=c++14 -O2 -pthread -I.. log_bench.cpp ../log.cpp ../log_format.cpp ../mapped_file.cpp ../event_loop.cpp ../timer.cpp ../utility.cpp -lz
+
+#include "../log.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+// ns per LOG(kInfo, ...) line on the calling thread, written to the day
+// file only. The async time is the caller side, the writer catches up in
+// FlushLog which is not counted. Results go to stderr, so a logger that also
+// prints to stdout can be run with it thrown away. One run per process, as
+// older loggers could not be initialized twice: log_bench [sync|async]
+static void BenchLogLines(const char* name, bool async) {
+  const int kLines = 50000;
+  LogConfig config;
+  config.async = async;
+  config.buffer_size = 65536;
+  config.sinks.emplace_back(kSinkFile);
+  InitLog("log bench", config);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kLines; ++i) {
+    LOG(kInfo, "bench line %d of %s with value %f", i, name, i * 0.5);
+  }
+  auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  FlushLog();
+  UninitLog();
+  fprintf(stderr, "%-6s %7.1f ns per line\n", name, elapsed / kLines);
+}
+
+int main(int argc, char* argv[]) {
+  auto async = argc > 1 && strcmp(argv[1], "async") == 0;
+  BenchLogLines(async ? "async" : "sync", async);
+  return 0;
+}
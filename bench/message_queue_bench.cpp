@@ -0,0 +1,115 @@
+// g++ -std=c++14 -O2 -pthread -I.. message_queue_bench.cpp ../message_queue.cpp ../message_journal.cpp ../thread_pool.cpp ../event_loop.cpp ../indexer.cpp ../log.cpp ../log_format.cpp ../mapped_file.cpp ../timer.cpp ../utility.cpp -lz
+
+#include "../message_queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+#include <vector>
+
+using namespace utility;
+
+static std::atomic<bool> counting_allocations(false);
+static std::atomic<size_t> allocations(0);
+
+void* operator new(size_t size) {
+  if (counting_allocations.load(std::memory_order_relaxed)) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  auto memory = malloc(size != 0 ? size : 1);
+  if (memory == nullptr) {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+void operator delete(void* memory) noexcept {
+  free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+  free(memory);
+}
+
+// senders of a small and a large capture
+struct Capture8 {
+  Index* pushed_index;
+};
+
+struct Capture40 {
+  Index* pushed_index;
+  char data[32];
+};
+
+// 1M push+pop after a warm up, with 1000 messages left queued, allocations
+// and ns per push+pop on one thread
+template <typename Capture>
+static void BenchPushPop(const char* name) {
+  const int kQueued = 1000;
+  const int kOperations = 1000000;
+  MessageQueue queue;
+  queue.Init(60);
+  Index pushed_index = kInvalidIndex;
+  Capture capture = {};
+  capture.pushed_index = &pushed_index;
+  auto sender = [capture](Index index, bool) {
+    *capture.pushed_index = index;
+    return true;
+  };
+  for (int i = 0; i < kQueued; ++i) {
+    queue.Push(sender);
+  }
+  for (int i = 0; i < kQueued; ++i) {
+    queue.Push(sender);
+    queue.Pop(pushed_index);
+  }
+  allocations = 0;
+  counting_allocations = true;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kOperations; ++i) {
+    queue.Push(sender);
+    queue.Pop(pushed_index);
+  }
+  auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  counting_allocations = false;
+  printf("%-18s %5.2f allocs per op %7.1f ns per push+pop\n", name, static_cast<double>(allocations) / kOperations, elapsed / kOperations);
+  queue.Uninit();
+}
+
+// 32 threads each pushing and popping, push+pop pairs per second
+static void BenchThroughput() {
+  const int kThreads = 32;
+  const int kOperations = 100000;
+  MessageQueue queue;
+  queue.Init(60);
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&queue] {
+      Index pushed_index = kInvalidIndex;
+      auto sender = [&pushed_index](Index index, bool) {
+        pushed_index = index;
+        return true;
+      };
+      for (int i = 0; i < kOperations; ++i) {
+        queue.Push(sender);
+        queue.Pop(pushed_index);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%d threads %.2fM push+pop per second\n", kThreads, kThreads * kOperations / elapsed / 1e6);
+  queue.Uninit();
+}
+
+int main() {
+  BenchPushPop<Capture40>("40 byte capture");
+  BenchPushPop<Capture8>("8 byte capture");
+  BenchThroughput();
+  return 0;
+}
@@ -0,0 +1,71 @@
+// g++ -std=c++14 -O2 -pthread -I.. singleton_bench.cpp
+
+#include "../singleton.h"
+#include <stdio.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace utility;
+
+// The Singleton before it became lock-free, every call takes the lock
+template <typename T>
+class MutexSingleton {
+ public:
+  static T* GetInstance() {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (instance_ == nullptr) {
+      instance_ = new T;
+    }
+    return instance_;
+  }
+
+ private:
+  static T* instance_;
+  static std::mutex lock_;
+};
+
+template <typename T>
+T* MutexSingleton<T>::instance_ = nullptr;
+
+template <typename T>
+std::mutex MutexSingleton<T>::lock_;
+
+struct Counter {
+  int value = 0;
+};
+
+// 32M GetInstance calls split over the threads, ns per call over all threads
+template <typename SingletonType>
+static double BenchGetInstance(int thread_number) {
+  const long kCalls = 32 * 1024 * 1024;
+  SingletonType::GetInstance();
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < thread_number; ++t) {
+    threads.emplace_back([thread_number] {
+      // every call is stored, so the loop cannot drop it
+      Counter* volatile instance = nullptr;
+      for (long i = 0; i < kCalls / thread_number; ++i) {
+        instance = SingletonType::GetInstance();
+      }
+      (void)instance;
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / kCalls;
+}
+
+int main() {
+  printf("threads    mutex     atomic\n");
+  for (int thread_number : {1, 8, 64}) {
+    auto mutex_time = BenchGetInstance<MutexSingleton<Counter>>(thread_number);
+    auto atomic_time = BenchGetInstance<Singleton<Counter>>(thread_number);
+    printf("%-10d %5.2f ns  %5.2f ns\n", thread_number, mutex_time, atomic_time);
+  }
+  ReleaseSingletons();
+  return 0;
+}
@@ -0,0 +1,180 @@
+// g++ -std=c++14 -O2 -pthread -I.. timer_wheel_bench.cpp ../timer_wheel.cpp ../timer.cpp
+
+// the ticks are run from the inside instead of waiting for them
+#define private public
+#include "../timer_wheel.h"
+#undef private
+#include <stdio.h>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <vector>
+
+using namespace utility;
+
+// Indexed binary min heap of timers by expire tick, a node knows its heap
+// position so Cancel is a removal in place
+class TimerHeap {
+ public:
+  TimerId Schedule(uint64_t expire_tick, std::function<void ()>&& callback) {
+    auto position = static_cast<uint32_t>(nodes_.size());
+    nodes_.push_back(TimerNode{expire_tick, heap_.size(), std::move(callback)});
+    heap_.push_back(position);
+    SiftUp(heap_.size() - 1);
+    return position + 1;
+  }
+
+  bool Cancel(TimerId timer_id) {
+    auto& node = nodes_[timer_id - 1];
+    if (node.heap_position == kNotInHeap) {
+      return false;
+    }
+    Remove(node.heap_position);
+    node.callback = nullptr;
+    return true;
+  }
+
+  // Run every timer expired at tick
+  size_t Advance(uint64_t tick) {
+    size_t expired = 0;
+    while (!heap_.empty() && nodes_[heap_.front()].expire_tick <= tick) {
+      auto& node = nodes_[heap_.front()];
+      Remove(0);
+      node.callback();
+      node.callback = nullptr;
+      ++expired;
+    }
+    return expired;
+  }
+
+ private:
+  static const size_t kNotInHeap = static_cast<size_t>(-1);
+
+  struct TimerNode {
+    uint64_t expire_tick;
+    size_t heap_position;
+    std::function<void ()> callback;
+  };
+
+  void Remove(size_t position) {
+    nodes_[heap_[position]].heap_position = kNotInHeap;
+    auto last = heap_.back();
+    heap_.pop_back();
+    if (position == heap_.size()) {
+      return;
+    }
+    heap_[position] = last;
+    nodes_[last].heap_position = position;
+    SiftUp(position);
+    SiftDown(nodes_[last].heap_position);
+  }
+
+  bool Less(size_t left, size_t right) const {
+    return nodes_[heap_[left]].expire_tick < nodes_[heap_[right]].expire_tick;
+  }
+
+  void Swap(size_t left, size_t right) {
+    std::swap(heap_[left], heap_[right]);
+    nodes_[heap_[left]].heap_position = left;
+    nodes_[heap_[right]].heap_position = right;
+  }
+
+  void SiftUp(size_t position) {
+    while (position != 0 && Less(position, (position - 1) / 2)) {
+      Swap(position, (position - 1) / 2);
+      position = (position - 1) / 2;
+    }
+  }
+
+  void SiftDown(size_t position) {
+    while (true) {
+      auto smallest = position;
+      for (auto child = position * 2 + 1; child <= position * 2 + 2 && child < heap_.size(); ++child) {
+        if (Less(child, smallest)) {
+          smallest = child;
+        }
+      }
+      if (smallest == position) {
+        return;
+      }
+      Swap(position, smallest);
+      position = smallest;
+    }
+  }
+
+ private:
+  std::vector<TimerNode> nodes_;
+  std::vector<uint32_t> heap_;
+};
+
+static const size_t kTimerNumber = 1000000;
+static const uint64_t kMaxTicks = 3600;
+
+static double NanosecondsSince(const std::chrono::steady_clock::time_point& start, size_t operations) {
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / operations;
+}
+
+// 10^6 timers 1..3600 ticks out, every other one cancelled, then the rest
+// expire, ns per operation on one thread
+static void BenchWheel(const std::vector<uint64_t>& ticks) {
+  TimerWheel wheel;
+  // an hour a tick, so the wheel thread never runs a tick by itself
+  const std::chrono::hours kTick(1);
+  wheel.Init(nullptr, kTick);
+  size_t ran = 0;
+  std::vector<TimerId> timer_ids(kTimerNumber);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < kTimerNumber; ++i) {
+    timer_ids[i] = wheel.Schedule(kTick * ticks[i], [&ran] { ++ran; });
+  }
+  auto schedule_time = NanosecondsSince(start, kTimerNumber);
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < kTimerNumber; i += 2) {
+    wheel.Cancel(timer_ids[i]);
+  }
+  auto cancel_time = NanosecondsSince(start, kTimerNumber / 2);
+  start = std::chrono::steady_clock::now();
+  std::vector<std::function<void ()>> callbacks;
+  wheel.wheel_lock_.lock();
+  wheel.Advance(wheel.current_tick_ + kMaxTicks + 1, callbacks);
+  wheel.wheel_lock_.unlock();
+  for (auto& callback : callbacks) {
+    callback();
+  }
+  auto expire_time = NanosecondsSince(start, kTimerNumber / 2);
+  wheel.Uninit();
+  printf("wheel  %8.1f %8.1f %8.1f %s\n", schedule_time, cancel_time, expire_time, ran == kTimerNumber / 2 ? "" : "(missed timers)");
+}
+
+static void BenchHeap(const std::vector<uint64_t>& ticks) {
+  TimerHeap heap;
+  size_t ran = 0;
+  std::vector<TimerId> timer_ids(kTimerNumber);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < kTimerNumber; ++i) {
+    timer_ids[i] = heap.Schedule(ticks[i], [&ran] { ++ran; });
+  }
+  auto schedule_time = NanosecondsSince(start, kTimerNumber);
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < kTimerNumber; i += 2) {
+    heap.Cancel(timer_ids[i]);
+  }
+  auto cancel_time = NanosecondsSince(start, kTimerNumber / 2);
+  start = std::chrono::steady_clock::now();
+  heap.Advance(kMaxTicks + 1);
+  auto expire_time = NanosecondsSince(start, kTimerNumber / 2);
+  printf("heap   %8.1f %8.1f %8.1f %s\n", schedule_time, cancel_time, expire_time, ran == kTimerNumber / 2 ? "" : "(missed timers)");
+}
+
+int main() {
+  std::mt19937_64 random(1);
+  std::uniform_int_distribution<uint64_t> distribution(1, kMaxTicks);
+  std::vector<uint64_t> ticks(kTimerNumber);
+  for (auto& tick : ticks) {
+    tick = distribution(random);
+  }
+  printf("       schedule   cancel   expire\n");
+  BenchWheel(ticks);
+  BenchHeap(ticks);
+  return 0;
+}
@@ -0,0 +1,415 @@
+#include "event_loop.h"
+#include "log.h"
+#include <future>
+#ifdef WIN32
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+namespace utility {
+
+// the wakeup event, watches count from 1
+const uint64_t kWakeWatchId = 0;
+#ifndef WIN32
+const int kMaxEpollEvents = 64;
+#endif
+
+EventLoop::EventLoop() {
+#ifdef WIN32
+  wake_event_ = NULL;
+  watches_changed_ = false;
+#else
+  epoll_ = -1;
+  wake_event_ = -1;
+#endif
+  running_ = false;
+  next_watch_id_ = kWakeWatchId + 1;
+}
+
+EventLoop::~EventLoop() {
+  Uninit();
+}
+
+#ifdef WIN32
+bool EventLoop::Init() {
+  if (loop_thread_ != nullptr) {
+    return true;
+  }
+  wake_event_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (wake_event_ == NULL) {
+    return false;
+  }
+  watches_changed_ = true;
+  running_ = true;
+  auto thread_proc = std::bind(&EventLoop::Loop, this);
+  loop_thread_.reset(new std::thread(thread_proc));
+  loop_thread_id_ = loop_thread_->get_id();
+  return true;
+}
+#else
+bool EventLoop::Init() {
+  if (loop_thread_ != nullptr) {
+    return true;
+  }
+  epoll_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_ == -1) {
+    return false;
+  }
+  wake_event_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  epoll_event wake_event = {0};
+  wake_event.events = EPOLLIN;
+  wake_event.data.u64 = kWakeWatchId;
+  if (wake_event_ == -1 || epoll_ctl(epoll_, EPOLL_CTL_ADD, wake_event_, &wake_event) == -1) {
+    if (wake_event_ != -1) {
+      close(wake_event_);
+      wake_event_ = -1;
+    }
+    close(epoll_);
+    epoll_ = -1;
+    return false;
+  }
+  running_ = true;
+  auto thread_proc = std::bind(&EventLoop::Loop, this);
+  loop_thread_.reset(new std::thread(thread_proc));
+  loop_thread_id_ = loop_thread_->get_id();
+  return true;
+}
+#endif
+
+#ifdef WIN32
+bool EventLoop::AddWatch(EventHandle handle, unsigned int events, EventHandler&& handler) {
+  {
+    std::lock_guard<std::mutex> lock(watch_lock_);
+    if (!running_ || watch_ids_.count(handle) != 0 || watches_.size() >= MAXIMUM_WAIT_OBJECTS - 1) {
+      return false;
+    }
+    auto watch_id = next_watch_id_++;
+    std::shared_ptr<Watch> watch(new Watch{handle, events, std::move(handler)});
+    watches_.insert(std::make_pair(watch_id, watch));
+    watch_ids_.insert(std::make_pair(handle, watch_id));
+    watches_changed_ = true;
+  }
+  // wait on the new handle from now on
+  return Wake();
+}
+
+bool EventLoop::ModifyWatch(EventHandle handle, unsigned int events) {
+  std::lock_guard<std::mutex> lock(watch_lock_);
+  auto find_id = watch_ids_.find(handle);
+  if (find_id == watch_ids_.end()) {
+    return false;
+  }
+  watches_[find_id->second]->events = events;
+  return true;
+}
+
+bool EventLoop::RemoveWatch(EventHandle handle) {
+  {
+    std::lock_guard<std::mutex> lock(watch_lock_);
+    auto find_id = watch_ids_.find(handle);
+    if (find_id == watch_ids_.end()) {
+      return false;
+    }
+    watches_.erase(find_id->second);
+    watch_ids_.erase(find_id);
+    watches_changed_ = true;
+  }
+  // the handle may be closed once the loop stopped waiting on it
+  WaitLoop();
+  return true;
+}
+#else
+static uint32_t ToEpollEvents(unsigned int events) {
+  uint32_t epoll_events = 0;
+  if ((events & kEventRead) != 0) {
+    epoll_events |= EPOLLIN;
+  }
+  if ((events & kEventWrite) != 0) {
+    epoll_events |= EPOLLOUT;
+  }
+  return epoll_events;
+}
+
+static unsigned int FromEpollEvents(uint32_t epoll_events) {
+  unsigned int events = 0;
+  if ((epoll_events & (EPOLLIN | EPOLLPRI)) != 0) {
+    events |= kEventRead;
+  }
+  if ((epoll_events & EPOLLOUT) != 0) {
+    events |= kEventWrite;
+  }
+  if ((epoll_events & (EPOLLERR | EPOLLHUP)) != 0) {
+    events |= kEventError;
+  }
+  return events;
+}
+
+bool EventLoop::AddWatch(EventHandle handle, unsigned int events, EventHandler&& handler) {
+  std::lock_guard<std::mutex> lock(watch_lock_);
+  if (!running_ || watch_ids_.count(handle) != 0) {
+    return false;
+  }
+  auto watch_id = next_watch_id_++;
+  epoll_event watch_event = {0};
+  watch_event.events = ToEpollEvents(events);
+  watch_event.data.u64 = watch_id;
+  if (epoll_ctl(epoll_, EPOLL_CTL_ADD, handle, &watch_event) == -1) {
+    return false;
+  }
+  std::shared_ptr<Watch> watch(new Watch{handle, events, std::move(handler)});
+  watches_.insert(std::make_pair(watch_id, watch));
+  watch_ids_.insert(std::make_pair(handle, watch_id));
+  return true;
+}
+
+bool EventLoop::ModifyWatch(EventHandle handle, unsigned int events) {
+  std::lock_guard<std::mutex> lock(watch_lock_);
+  auto find_id = watch_ids_.find(handle);
+  if (find_id == watch_ids_.end()) {
+    return false;
+  }
+  epoll_event watch_event = {0};
+  watch_event.events = ToEpollEvents(events);
+  watch_event.data.u64 = find_id->second;
+  if (epoll_ctl(epoll_, EPOLL_CTL_MOD, handle, &watch_event) == -1) {
+    return false;
+  }
+  watches_[find_id->second]->events = events;
+  return true;
+}
+
+bool EventLoop::RemoveWatch(EventHandle handle) {
+  {
+    std::lock_guard<std::mutex> lock(watch_lock_);
+    auto find_id = watch_ids_.find(handle);
+    if (find_id == watch_ids_.end()) {
+      return false;
+    }
+    // fails when the fd is closed already, epoll dropped it then
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, handle, nullptr);
+    watches_.erase(find_id->second);
+    watch_ids_.erase(find_id);
+  }
+  WaitLoop();
+  return true;
+}
+#endif
+
+#ifdef WIN32
+bool EventLoop::AddTimer(Timer& timer, std::function<void ()>&& handler) {
+  // the waitable timer resets when the wait returns
+  auto timer_handler = std::move(handler);
+  return AddWatch(timer.handle(), kEventRead, [timer_handler](unsigned int) { timer_handler(); });
+}
+
+bool EventLoop::RemoveTimer(Timer& timer) {
+  return RemoveWatch(timer.handle());
+}
+#else
+bool EventLoop::AddTimer(Timer& timer, std::function<void ()>&& handler) {
+  auto timer_fd = timer.handle();
+  auto flags = fcntl(timer_fd, F_GETFL);
+  // rearming from another thread empties a ready timer, the read must not block then
+  if (flags == -1 || fcntl(timer_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    return false;
+  }
+  auto timer_handler = std::move(handler);
+  auto result = AddWatch(timer_fd, kEventRead, [timer_fd, timer_handler](unsigned int) {
+    uint64_t expirations = 0;
+    if (read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+      timer_handler();
+    }
+  });
+  if (!result) {
+    fcntl(timer_fd, F_SETFL, flags);
+  }
+  return result;
+}
+
+bool EventLoop::RemoveTimer(Timer& timer) {
+  auto timer_fd = timer.handle();
+  if (!RemoveWatch(timer_fd)) {
+    return false;
+  }
+  // Timer::Wait blocks again
+  auto flags = fcntl(timer_fd, F_GETFL);
+  if (flags != -1) {
+    fcntl(timer_fd, F_SETFL, flags & ~O_NONBLOCK);
+  }
+  return true;
+}
+#endif
+
+bool EventLoop::Post(std::function<void ()>&& task) {
+  {
+    std::lock_guard<std::mutex> lock(task_lock_);
+    if (!running_) {
+      return false;
+    }
+    tasks_.push_back(std::move(task));
+  }
+  return Wake();
+}
+
+bool EventLoop::IsInLoopThread() const {
+  return std::this_thread::get_id() == loop_thread_id_;
+}
+
+#ifdef WIN32
+void EventLoop::Uninit() {
+  if (loop_thread_ == nullptr) {
+    return;
+  }
+  task_lock_.lock();
+  running_ = false;
+  task_lock_.unlock();
+  Wake();
+  loop_thread_->join();
+  loop_thread_ = nullptr;
+  loop_thread_id_ = std::thread::id();
+  // what was posted before the loop stopped still runs
+  RunTasks();
+  CloseHandle(wake_event_);
+  wake_event_ = NULL;
+  std::lock_guard<std::mutex> lock(watch_lock_);
+  watches_.clear();
+  watch_ids_.clear();
+}
+#else
+void EventLoop::Uninit() {
+  if (loop_thread_ == nullptr) {
+    return;
+  }
+  task_lock_.lock();
+  running_ = false;
+  task_lock_.unlock();
+  Wake();
+  loop_thread_->join();
+  loop_thread_ = nullptr;
+  loop_thread_id_ = std::thread::id();
+  // what was posted before the loop stopped still runs
+  RunTasks();
+  close(wake_event_);
+  wake_event_ = -1;
+  close(epoll_);
+  epoll_ = -1;
+  std::lock_guard<std::mutex> lock(watch_lock_);
+  watches_.clear();
+  watch_ids_.clear();
+}
+#endif
+
+#ifdef WIN32
+bool EventLoop::Loop() {
+  std::vector<HANDLE> handles;
+  std::vector<uint64_t> watch_ids;
+  while (running_) {
+    watch_lock_.lock();
+    if (watches_changed_) {
+      handles.assign(1, wake_event_);
+      watch_ids.assign(1, kWakeWatchId);
+      for (const auto& i : watches_) {
+        handles.push_back(i.second->handle);
+        watch_ids.push_back(i.first);
+      }
+      watches_changed_ = false;
+    }
+    watch_lock_.unlock();
+    auto wait_result = WaitForMultipleObjects(static_cast<DWORD>(handles.size()), handles.data(), FALSE, INFINITE);
+    if (wait_result == WAIT_FAILED) {
+      LOG(kError, "fail to wait event loop handles.");
+      return false;
+    }
+    if (wait_result >= WAIT_OBJECT_0 + handles.size()) {
+      continue;
+    }
+    auto watch_id = watch_ids[wait_result - WAIT_OBJECT_0];
+    if (watch_id == kWakeWatchId) {
+      RunTasks();
+      continue;
+    }
+    auto watch = FindWatch(watch_id);
+    if (watch != nullptr) {
+      watch->handler(kEventRead);
+    }
+  }
+  return true;
+}
+#else
+bool EventLoop::Loop() {
+  epoll_event events[kMaxEpollEvents];
+  while (running_) {
+    auto event_count = epoll_wait(epoll_, events, kMaxEpollEvents, -1);
+    if (event_count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG(kError, "fail to wait event loop epoll, error %d.", errno);
+      return false;
+    }
+    for (auto i = 0; i < event_count; ++i) {
+      auto watch_id = events[i].data.u64;
+      if (watch_id == kWakeWatchId) {
+        uint64_t wake_count = 0;
+        read(wake_event_, &wake_count, sizeof(wake_count));
+        RunTasks();
+        continue;
+      }
+      // removed by a handler before in this batch
+      auto watch = FindWatch(watch_id);
+      if (watch != nullptr) {
+        watch->handler(FromEpollEvents(events[i].events));
+      }
+    }
+  }
+  return true;
+}
+#endif
+
+#ifdef WIN32
+bool EventLoop::Wake() {
+  return SetEvent(wake_event_) != FALSE;
+}
+#else
+bool EventLoop::Wake() {
+  uint64_t wake_count = 1;
+  return write(wake_event_, &wake_count, sizeof(wake_count)) == sizeof(wake_count);
+}
+#endif
+
+void EventLoop::RunTasks() {
+  std::vector<std::function<void ()>> tasks;
+  task_lock_.lock();
+  tasks.swap(tasks_);
+  task_lock_.unlock();
+  for (auto& task : tasks) {
+    task();
+  }
+}
+
+// a task posted now runs after the handler that may be running
+void EventLoop::WaitLoop() {
+  if (IsInLoopThread()) {
+    return;
+  }
+  std::promise<void> loop_done;
+  auto wait_done = loop_done.get_future();
+  if (Post([&loop_done]() { loop_done.set_value(); })) {
+    wait_done.wait();
+  }
+}
+
+std::shared_ptr<EventLoop::Watch> EventLoop::FindWatch(uint64_t watch_id) {
+  std::lock_guard<std::mutex> lock(watch_lock_);
+  auto find_watch = watches_.find(watch_id);
+  if (find_watch == watches_.end()) {
+    return nullptr;
+  }
+  return find_watch->second;
+}
+
+} // namespace utility
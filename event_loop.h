@@ -0,0 +1,103 @@
+/************************************************************************/
+/*  Event Loop                                                          */
+/*  THREAD: safe                                                        */
+/*  AUTHOR: chen_lu@outlook.com                                         */
+/************************************************************************/
+
+#ifndef UTILITY_EVENT_LOOP_H_
+#define UTILITY_EVENT_LOOP_H_
+
+#include "timer.h"
+#include "uncopyable.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#ifdef WIN32
+#include <Windows.h>
+#else
+#endif
+
+namespace utility {
+
+#ifdef WIN32
+typedef HANDLE EventHandle;
+#else
+typedef int EventHandle;
+#endif
+
+enum EventType {
+  kEventRead = 1,
+  kEventWrite = 2,
+  kEventError = 4   // error or hang up, reported whether asked for or not
+};
+
+// events is the mask of EventType that happened
+typedef std::function<void (unsigned int events)> EventHandler;
+
+// One thread waits on timers, sockets and wakeups from other threads and
+// runs every handler, so a handler must not block it for long. Linux uses
+// epoll and an eventfd. Windows waits on at most 63 handles and reports them
+// as readable when signaled, watch a socket through its WSAEventSelect event.
+class EventLoop : public Uncopyable {
+ public:
+  EventLoop();
+  ~EventLoop();
+
+  bool Init();
+  // events is a mask of EventType, level triggered
+  bool AddWatch(EventHandle handle, unsigned int events, EventHandler&& handler);
+  bool ModifyWatch(EventHandle handle, unsigned int events);
+  // Once it returns the handler is not running and never runs again,
+  // called from a handler it only stops the later calls
+  bool RemoveWatch(EventHandle handle);
+  // handler runs after each expiration, the timer must not be waited on
+  // elsewhere while it is added
+  bool AddTimer(Timer& timer, std::function<void ()>&& handler);
+  bool RemoveTimer(Timer& timer);
+  // Run task on the loop thread, in the order posted
+  bool Post(std::function<void ()>&& task);
+  bool IsInLoopThread() const;
+  void Uninit();
+
+ private:
+  struct Watch {
+    EventHandle handle;
+    unsigned int events;
+    EventHandler handler;
+  };
+
+  bool Loop();
+  bool Wake();
+  void RunTasks();
+  // Return once the loop finished what it was running
+  void WaitLoop();
+  std::shared_ptr<Watch> FindWatch(uint64_t watch_id);
+
+ private:
+#ifdef WIN32
+  HANDLE wake_event_;
+  bool watches_changed_;
+#else
+  int epoll_;
+  int wake_event_;
+#endif
+  std::atomic<bool> running_;
+  // ids are never reused, an event of a removed watch finds nothing
+  uint64_t next_watch_id_;
+  std::unordered_map<uint64_t, std::shared_ptr<Watch>> watches_;
+  std::unordered_map<EventHandle, uint64_t> watch_ids_;
+  std::vector<std::function<void ()>> tasks_;
+  std::mutex watch_lock_;
+  std::mutex task_lock_;
+  std::thread::id loop_thread_id_;
+  std::unique_ptr<std::thread> loop_thread_;
+};
+
+} // namespace utility
+
+#endif // UTILITY_EVENT_LOOP_H_
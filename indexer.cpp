@@ -1,12 +1,52 @@
 #include "indexer.h"
 #include <algorithm>
+#ifdef WIN32
+#include <intrin.h>
+#else
+#endif
 
 namespace utility {
 
-const unsigned long kMaxIndexNumber = 0xFFFFFFFF;
+#ifdef WIN32
+static size_t CountTrailingZeros(uint64_t bits) {
+  unsigned long position = 0;
+  _BitScanForward64(&position, bits);
+  return position;
+}
+#else
+static size_t CountTrailingZeros(uint64_t bits) {
+  return __builtin_ctzll(bits);
+}
+#endif
+
+// Extend the last range when index follows it
+static void AddIndexRange(std::vector<IndexRange>& ranges, Index first, unsigned long count) {
+  if (!ranges.empty() && ranges.back().first + ranges.back().count == first) {
+    ranges.back().count += count;
+    return;
+  }
+  IndexRange range = {first, count};
+  ranges.push_back(range);
+}
+
+// First clear bit at or after from in count words, bits past the words are clear
+static size_t FindClearBit(const uint64_t* bits, size_t count, size_t from) {
+  for (auto word = from / 64; word < count; ++word) {
+    auto clear_bits = ~bits[word];
+    if (word == from / 64) {
+      clear_bits &= ~0ULL << (from % 64);
+    }
+    if (clear_bits != 0) {
+      return word * 64 + CountTrailingZeros(clear_bits);
+    }
+  }
+  return std::max(from, count * 64);
+}
 
 Indexer::Indexer() {
   index_count_ = 0;
+  live_count_ = 0;
+  next_index_ = 1;
 }
 
 Indexer::~Indexer(){
@@ -14,7 +54,7 @@ Indexer::~Indexer(){
 
 Index Indexer::CreateIndex() {
   std::lock_guard<std::mutex> lock(index_pool_lock);
-  if (index_pool_.size() == kMaxIndexNumber) {
+  if (live_count_ == kMaxIndexNumber) {
     return kInvalidIndex;
   }
   unsigned long ret_index = 0;
@@ -22,32 +62,167 @@ Index Indexer::CreateIndex() {
     ++index_count_;
     ret_index = index_count_;
   } else {
-    unsigned long min_index = 1;
-    auto find_index = index_pool_.find(min_index);
-    while (find_index != index_pool_.end()) {
-      ++min_index;
-      find_index = index_pool_.find(min_index);
+    ret_index = FindFreeIndex();
+    if (ret_index == kInvalidIndex) {
+      return kInvalidIndex;
     }
-    ret_index = min_index;
   }
-  index_pool_.insert(ret_index);
+  SetLive(ret_index);
+  next_index_ = ret_index == kMaxIndexNumber ? 1 : ret_index + 1;
   return ret_index;
 }
 
+bool Indexer::CreateIndices(unsigned long count, std::vector<IndexRange>& ranges) {
+  std::lock_guard<std::mutex> lock(index_pool_lock);
+  if (count > kMaxIndexNumber - live_count_) {
+    return false;
+  }
+  while (count != 0) {
+    Index first = kInvalidIndex;
+    unsigned long range_count = 1;
+    if (index_count_ != kMaxIndexNumber) {
+      first = index_count_ + 1;
+      range_count = std::min(count, kMaxIndexNumber - index_count_);
+      index_count_ += range_count;
+    } else {
+      // there are enough free indices, checked above
+      first = FindFreeIndex();
+    }
+    for (unsigned long i = 0; i < range_count; ++i) {
+      SetLive(first + i);
+    }
+    auto last_index = first + range_count - 1;
+    next_index_ = last_index == kMaxIndexNumber ? 1 : last_index + 1;
+    AddIndexRange(ranges, first, range_count);
+    count -= range_count;
+  }
+  return true;
+}
+
 void Indexer::DestroyIndex(Index index) {
   std::lock_guard<std::mutex> lock(index_pool_lock);
-  index_pool_.erase(index);
+  ClearLive(index);
+}
+
+void Indexer::DestroyIndex(const IndexRange& range) {
+  std::lock_guard<std::mutex> lock(index_pool_lock);
+  for (unsigned long i = 0; i < range.count; ++i) {
+    ClearLive(range.first + i);
+  }
+}
+
+void Indexer::DestroyIndex(const std::vector<IndexRange>& ranges) {
+  std::lock_guard<std::mutex> lock(index_pool_lock);
+  for (const auto& range : ranges) {
+    for (unsigned long i = 0; i < range.count; ++i) {
+      ClearLive(range.first + i);
+    }
+  }
 }
 
 void Indexer::DestroyIndex(const std::vector<Index>& multi_index) {
   std::lock_guard<std::mutex> lock(index_pool_lock);
-  std::for_each(multi_index.begin(), multi_index.end(), [this](Index index) { index_pool_.erase(index); });
+  std::for_each(multi_index.begin(), multi_index.end(), [this](Index index) { ClearLive(index); });
 }
 
 void Indexer::Clear() {
   std::lock_guard<std::mutex> lock(index_pool_lock);
-  index_pool_.clear();
+  index_pages_.clear();
+  full_pages_.clear();
   index_count_ = 0;
+  live_count_ = 0;
+  next_index_ = 1;
+}
+
+// Bit position of an index is index - 1, the pages cover positions below kMaxIndexNumber
+void Indexer::SetLive(Index index) {
+  auto position = static_cast<size_t>(index - 1);
+  auto page_number = position >> kPageBits;
+  if (page_number >= index_pages_.size()) {
+    index_pages_.resize(page_number + 1);
+    full_pages_.resize(index_pages_.size() / 64 + 1);
+  }
+  auto& page = index_pages_[page_number];
+  if (page == nullptr) {
+    page = spare_page_ != nullptr ? std::move(spare_page_) : std::unique_ptr<IndexPage>(new IndexPage());
+  }
+  auto offset = position & (kPageIndexNumber - 1);
+  auto& word = page->words[offset / 64];
+  word |= 1ULL << (offset % 64);
+  if (~word == 0) {
+    page->full_words[offset / 64 / 64] |= 1ULL << (offset / 64 % 64);
+  }
+  if (++page->live_count == kPageIndexNumber) {
+    full_pages_[page_number / 64] |= 1ULL << (page_number % 64);
+  }
+  ++live_count_;
+}
+
+bool Indexer::ClearLive(Index index) {
+  if (index == kInvalidIndex || index > kMaxIndexNumber) {
+    return false;
+  }
+  auto position = static_cast<size_t>(index - 1);
+  auto page_number = position >> kPageBits;
+  if (page_number >= index_pages_.size() || index_pages_[page_number] == nullptr) {
+    return false;
+  }
+  auto& page = index_pages_[page_number];
+  auto offset = position & (kPageIndexNumber - 1);
+  auto bit = 1ULL << (offset % 64);
+  auto& word = page->words[offset / 64];
+  if ((word & bit) == 0) {
+    return false;
+  }
+  word &= ~bit;
+  page->full_words[offset / 64 / 64] &= ~(1ULL << (offset / 64 % 64));
+  full_pages_[page_number / 64] &= ~(1ULL << (page_number % 64));
+  --live_count_;
+  if (--page->live_count == 0) {
+    // an empty page is all zero, keep one to reuse without allocating
+    spare_page_ = std::move(page);
+  }
+  return true;
+}
+
+// Next fit from next_index_, wraps around to 1 once
+Index Indexer::FindFreeIndex() const {
+  const auto page_count = (static_cast<size_t>(kMaxIndexNumber) >> kPageBits) + 1;
+  auto start = static_cast<size_t>(next_index_ - 1);
+  for (auto round = 0; round < 2; ++round) {
+    auto page_number = start >> kPageBits;
+    while (true) {
+      page_number = FindClearBit(full_pages_.data(), full_pages_.size(), page_number);
+      if (page_number >= page_count) {
+        break;
+      }
+      auto offset = page_number == start >> kPageBits ? start & (kPageIndexNumber - 1) : 0;
+      auto found = offset;
+      if (page_number < index_pages_.size() && index_pages_[page_number] != nullptr) {
+        found = FindFreeInPage(*index_pages_[page_number], offset);
+      }
+      auto position = (page_number << kPageBits) + found;
+      if (found < kPageIndexNumber && position < kMaxIndexNumber) {
+        return static_cast<Index>(position + 1);
+      }
+      ++page_number;
+    }
+    start = 0;
+  }
+  return kInvalidIndex;
+}
+
+size_t Indexer::FindFreeInPage(const IndexPage& page, size_t offset) {
+  auto word = offset / 64;
+  auto clear_bits = ~page.words[word] & (~0ULL << (offset % 64));
+  if (clear_bits != 0) {
+    return word * 64 + CountTrailingZeros(clear_bits);
+  }
+  auto free_word = FindClearBit(page.full_words, kPageWordNumber / 64, word + 1);
+  if (free_word >= kPageWordNumber) {
+    return kPageIndexNumber;
+  }
+  return free_word * 64 + CountTrailingZeros(~page.words[free_word]);
 }
 
 } // namespace utility
\ No newline at end of file
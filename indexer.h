@@ -8,28 +8,68 @@
 #define UTILITY_INDEXER_H_
 
 #include "uncopyable.h"
+#include <memory>
 #include <mutex>
-#include <set>
+#include <stddef.h>
+#include <stdint.h>
 #include <vector>
 
 namespace utility {
 
 typedef unsigned long Index;
 const Index kInvalidIndex = 0;
+const unsigned long kMaxIndexNumber = 0xFFFFFFFF;
 
+// count indices from first
+struct IndexRange {
+  Index first;
+  unsigned long count;
+};
+
+// Indices count up until the 32 bit range is used up, then the next free
+// index after the last one is reused. Live indices are kept in bitmap pages
+// that are only allocated while they hold a live index, so creating and
+// destroying an index are O(1).
 class Indexer : public Uncopyable {
  public:
   Indexer();
   ~Indexer();
 
   Index CreateIndex();
+  // Append count indices to ranges under one lock, contiguous until the
+  // counter wraps, false creates none
+  bool CreateIndices(unsigned long count, std::vector<IndexRange>& ranges);
   void DestroyIndex(Index index);
   void DestroyIndex(const std::vector<Index>& multi_index);
+  void DestroyIndex(const IndexRange& range);
+  void DestroyIndex(const std::vector<IndexRange>& ranges);
   void Clear();
 
+ private:
+  static const size_t kPageBits = 16;
+  static const size_t kPageIndexNumber = 1 << kPageBits;
+  static const size_t kPageWordNumber = kPageIndexNumber / 64;
+
+  // Live bits of kPageIndexNumber indices and a bit for every full word
+  struct IndexPage {
+    size_t live_count;
+    uint64_t full_words[kPageWordNumber / 64];
+    uint64_t words[kPageWordNumber];
+  };
+
+ private:
+  void SetLive(Index index);
+  bool ClearLive(Index index);
+  Index FindFreeIndex() const;
+  static size_t FindFreeInPage(const IndexPage& page, size_t offset);
+
  private:
   unsigned long index_count_;
-  std::set<Index> index_pool_;
+  unsigned long live_count_;
+  unsigned long next_index_;
+  std::vector<std::unique_ptr<IndexPage>> index_pages_;
+  std::vector<uint64_t> full_pages_;
+  std::unique_ptr<IndexPage> spare_page_;
   std::mutex index_pool_lock;
 };
 
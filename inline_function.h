@@ -0,0 +1,213 @@
+/************************************************************************/
+/*  Inline Function                                                     */
+/*  THREAD: unsafe                                                      */
+/*  AUTHOR: chen_lu@outlook.com                                         */
+/************************************************************************/
+
+#ifndef UTILITY_INLINE_FUNCTION_H_
+#define UTILITY_INLINE_FUNCTION_H_
+
+#include "uncopyable.h"
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace utility {
+
+template <typename Signature, size_t Capacity = 64, bool Copyable = false>
+class InlineFunction;
+
+// What a move-only InlineFunction takes in place of a copy
+struct InlineFunctionNoCopy {};
+
+// Move-only std::function that keeps a callable of up to Capacity bytes in
+// storage of its own without allocating, a larger or over aligned one is
+// allocated and only its pointer is kept. A Copyable one copies the
+// callable too, which must be copyable then.
+template <typename R, typename... Args, size_t Capacity, bool Copyable>
+class InlineFunction<R (Args...), Capacity, Copyable> : public Uncopyable {
+  typedef typename std::conditional<Copyable, InlineFunction, InlineFunctionNoCopy>::type CopySource;
+
+ public:
+  InlineFunction() : invoke_(nullptr), manage_(nullptr) {}
+  InlineFunction(std::nullptr_t) : invoke_(nullptr), manage_(nullptr) {}
+
+  template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InlineFunction>::value>::type>
+  InlineFunction(F&& callable) : invoke_(nullptr), manage_(nullptr) {
+    Assign(std::forward<F>(callable));
+  }
+
+  InlineFunction(InlineFunction&& other) : invoke_(nullptr), manage_(nullptr) {
+    MoveFrom(other);
+  }
+
+  InlineFunction(const CopySource& other) : invoke_(nullptr), manage_(nullptr) {
+    CopyFrom(other);
+  }
+
+  ~InlineFunction() {
+    Reset();
+  }
+
+  InlineFunction& operator=(InlineFunction&& other) {
+    if (this != &other) {
+      Reset();
+      MoveFrom(other);
+    }
+    return *this;
+  }
+
+  InlineFunction& operator=(const CopySource& other) {
+    if (this != &other) {
+      Reset();
+      CopyFrom(other);
+    }
+    return *this;
+  }
+
+  InlineFunction& operator=(std::nullptr_t) {
+    Reset();
+    return *this;
+  }
+
+  template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InlineFunction>::value>::type>
+  InlineFunction& operator=(F&& callable) {
+    Reset();
+    Assign(std::forward<F>(callable));
+    return *this;
+  }
+
+  R operator()(Args... args) {
+    return invoke_(&storage_, std::forward<Args>(args)...);
+  }
+
+  bool operator==(std::nullptr_t) const { return invoke_ == nullptr; }
+  bool operator!=(std::nullptr_t) const { return invoke_ != nullptr; }
+
+ private:
+  enum Operation {
+    kMove,
+    kCopy,
+    kDestroy
+  };
+
+  typedef R (*Invoker)(void* storage, Args&&... args);
+  typedef void (*Manager)(Operation operation, void* storage, void* other_storage);
+
+  template <typename Callable>
+  struct IsInline : std::integral_constant<bool, sizeof(Callable) <= Capacity && alignof(Callable) <= alignof(std::max_align_t)> {};
+
+  template <typename F>
+  void Assign(F&& callable) {
+    typedef typename std::decay<F>::type Callable;
+    static_assert(!Copyable || std::is_copy_constructible<Callable>::value, "callable is not copyable");
+    Assign(std::forward<F>(callable), IsInline<Callable>());
+  }
+
+  template <typename F>
+  void Assign(F&& callable, std::true_type) {
+    typedef typename std::decay<F>::type Callable;
+    new (&storage_) Callable(std::forward<F>(callable));
+    invoke_ = &Invoke<Callable>;
+    manage_ = &Manage<Callable>;
+  }
+
+  template <typename F>
+  void Assign(F&& callable, std::false_type) {
+    typedef typename std::decay<F>::type Callable;
+    *static_cast<Callable**>(static_cast<void*>(&storage_)) = new Callable(std::forward<F>(callable));
+    invoke_ = &InvokeHeap<Callable>;
+    manage_ = &ManageHeap<Callable>;
+  }
+
+  void MoveFrom(InlineFunction& other) {
+    if (other.manage_ == nullptr) {
+      return;
+    }
+    other.manage_(kMove, &other.storage_, &storage_);
+    invoke_ = other.invoke_;
+    manage_ = other.manage_;
+    other.Reset();
+  }
+
+  void CopyFrom(const InlineFunction& other) {
+    if (other.manage_ == nullptr) {
+      return;
+    }
+    other.manage_(kCopy, const_cast<void*>(static_cast<const void*>(&other.storage_)), &storage_);
+    invoke_ = other.invoke_;
+    manage_ = other.manage_;
+  }
+
+  void Reset() {
+    if (manage_ != nullptr) {
+      manage_(kDestroy, &storage_, nullptr);
+    }
+    invoke_ = nullptr;
+    manage_ = nullptr;
+  }
+
+  template <typename Callable>
+  static R Invoke(void* storage, Args&&... args) {
+    return (*static_cast<Callable*>(storage))(std::forward<Args>(args)...);
+  }
+
+  // kMove and kCopy construct the callable of storage in other_storage
+  template <typename Callable>
+  static void Manage(Operation operation, void* storage, void* other_storage) {
+    auto callable = static_cast<Callable*>(storage);
+    if (operation == kMove) {
+      new (other_storage) Callable(std::move(*callable));
+    } else if (operation == kCopy) {
+      Copy(*callable, other_storage, std::integral_constant<bool, Copyable>());
+    } else {
+      callable->~Callable();
+    }
+  }
+
+  template <typename Callable>
+  static R InvokeHeap(void* storage, Args&&... args) {
+    return (**static_cast<Callable**>(storage))(std::forward<Args>(args)...);
+  }
+
+  // storage only holds the pointer, a move hands it over
+  template <typename Callable>
+  static void ManageHeap(Operation operation, void* storage, void* other_storage) {
+    auto callable = static_cast<Callable**>(storage);
+    if (operation == kMove) {
+      *static_cast<Callable**>(other_storage) = *callable;
+      *callable = nullptr;
+    } else if (operation == kCopy) {
+      CopyHeap(**callable, other_storage, std::integral_constant<bool, Copyable>());
+    } else {
+      delete *callable;
+    }
+  }
+
+  // a move-only callable is never asked for a copy
+  template <typename Callable>
+  static void Copy(const Callable& callable, void* other_storage, std::true_type) {
+    new (other_storage) Callable(callable);
+  }
+
+  template <typename Callable>
+  static void Copy(const Callable&, void*, std::false_type) {}
+
+  template <typename Callable>
+  static void CopyHeap(const Callable& callable, void* other_storage, std::true_type) {
+    *static_cast<Callable**>(other_storage) = new Callable(callable);
+  }
+
+  template <typename Callable>
+  static void CopyHeap(const Callable&, void*, std::false_type) {}
+
+ private:
+  Invoker invoke_;
+  Manager manage_;
+  typename std::aligned_storage<Capacity, alignof(std::max_align_t)>::type storage_;
+};
+
+} // namespace utility
+
+#endif // UTILITY_INLINE_FUNCTION_H_
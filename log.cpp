@@ -1,159 +1,957 @@
 ﻿#include "log.h"
+#include "event_loop.h"
+#include "log_format.h"
+#include "mapped_file.h"
+#include "ring_buffer.h"
 #include "singleton.h"
 #include "timer.h"
 #include "uncopyable.h"
 #include "utility.h"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
+#include <functional>
 #include <memory>
+#include <signal.h>
 #include <thread>
+#include <unordered_set>
 #include <vector>
+#include <zlib.h>
 #ifdef WIN32
+#include <WinSock2.h>
 #include <Windows.h>
+#include <afunix.h>
 #else
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 #endif
 
 namespace utility {
 
+std::atomic<int> enabled_log_level(kStartup | kShutdown | kInfo | kWarning | kError);
+
+const unsigned int kMaxLogLength = 2048;
+const size_t kMaxBatchSize = 64 * 1024;
+const size_t kCompressBufferSize = 64 * 1024;
+const int kMaintainPeriod = 60;
+const int kSinkFlushInterval = 100;
+const int kSinkReconnectPeriod = 1;
+const int kOneDaySeconds = 24 * 60 * 60;
+
+#ifdef WIN32
+#define LOG_PATH_TEXT(text) L##text
+typedef std::wstring LogPath;
+#else
+#define LOG_PATH_TEXT(text) text
+typedef std::string LogPath;
+#endif
+
+struct LogFileInfo {
+  LogPath path;
+  unsigned long long size;
+  long long modify_time;
+};
+
+// The system call behind GetCurrentThreadId is too slow for every log line
+static unsigned int GetLogThreadId() {
+  static thread_local unsigned int thread_id = GetCurrentThreadId();
+  return thread_id;
+}
+
+static LogLineFormatter& GetLineFormatter() {
+  static thread_local LogLineFormatter formatter;
+  return formatter;
+}
+
+#ifdef WIN32
+static bool ListLogFiles(const LogPath& file_pre_path, std::vector<LogFileInfo>& log_files) {
+  WIN32_FIND_DATA find_data = {0};
+  auto find_string = file_pre_path + L"*.log*";
+  auto find_handler = FindFirstFile(find_string.c_str(), &find_data);
+  if (find_handler == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  auto last_slash_pos = file_pre_path.rfind(L'\\');
+  std::wstring log_dir(file_pre_path, 0, ++last_slash_pos);
+  do {
+    LogFileInfo log_file;
+    log_file.path = log_dir + find_data.cFileName;
+    log_file.size = (static_cast<unsigned long long>(find_data.nFileSizeHigh) << 32) | find_data.nFileSizeLow;
+    log_file.modify_time = (static_cast<long long>(find_data.ftLastWriteTime.dwHighDateTime) << 32) | find_data.ftLastWriteTime.dwLowDateTime;
+    log_files.push_back(std::move(log_file));
+  } while (FindNextFile(find_handler, &find_data));
+  FindClose(find_handler);
+  return true;
+}
+
+static bool IsLogFileExist(const LogPath& path) {
+  return GetFileAttributes(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+}
+
+static bool MoveLogFile(const LogPath& from, const LogPath& to) {
+  return MoveFileEx(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+}
+
+static bool RemoveLogFile(const LogPath& path) {
+  return DeleteFile(path.c_str()) != FALSE;
+}
+
+static gzFile OpenCompressFile(const LogPath& path) {
+  return gzopen_w(path.c_str(), "wb");
+}
+
+static void LowerThreadPriority() {
+  SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+}
+#else
+static bool ListLogFiles(const LogPath& file_pre_path, std::vector<LogFileInfo>& log_files) {
+  auto last_slash_pos = file_pre_path.rfind('/');
+  std::string log_dir(file_pre_path, 0, last_slash_pos);
+  std::string file_pre_name(file_pre_path, last_slash_pos + 1);
+  auto dir = opendir(log_dir.c_str());
+  if (dir == nullptr) {
+    return false;
+  }
+  dirent* find_data = nullptr;
+  while ((find_data = readdir(dir)) != nullptr) {
+    std::string find_name(find_data->d_name);
+    if (find_name.compare(0, file_pre_name.size(), file_pre_name) != 0 || find_name.find(".log") == std::string::npos) {
+      continue;
+    }
+    LogFileInfo log_file;
+    log_file.path = log_dir + "/" + find_name;
+    struct stat file_stat;
+    if (stat(log_file.path.c_str(), &file_stat) != 0) {
+      continue;
+    }
+    log_file.size = file_stat.st_size;
+    log_file.modify_time = file_stat.st_mtime;
+    log_files.push_back(std::move(log_file));
+  }
+  closedir(dir);
+  return true;
+}
+
+static bool IsLogFileExist(const LogPath& path) {
+  return access(path.c_str(), F_OK) == 0;
+}
+
+static bool MoveLogFile(const LogPath& from, const LogPath& to) {
+  return rename(from.c_str(), to.c_str()) == 0;
+}
+
+static bool RemoveLogFile(const LogPath& path) {
+  return unlink(path.c_str()) == 0;
+}
+
+static gzFile OpenCompressFile(const LogPath& path) {
+  return gzopen(path.c_str(), "wb");
+}
+
+static void LowerThreadPriority() {
+  setpriority(PRIO_PROCESS, GetCurrentThreadId(), 19);
+}
+#endif
+
+static bool IsEndWith(const LogPath& path, const LogPath& ext) {
+  return path.size() >= ext.size() && path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+// Get yyyymmdd from "file_pre_path" + "yyyymmdd[.N].log", 0 for other files
+static unsigned int GetLogFileDay(const LogPath& path, const LogPath& file_pre_path) {
+  const size_t kDayLength = 8;
+  if (path.compare(0, file_pre_path.size(), file_pre_path) != 0 || path.size() < file_pre_path.size() + kDayLength) {
+    return 0;
+  }
+  unsigned int day = 0;
+  for (size_t i = 0; i < kDayLength; ++i) {
+    auto c = path[file_pre_path.size() + i];
+    if (c < '0' || c > '9') {
+      return 0;
+    }
+    day = day * 10 + (c - '0');
+  }
+  return day;
+}
+
+// Get N from "file_pre_path" + "yyyymmdd.N.log", 0 for other files
+static unsigned int GetLogFileIndex(const LogPath& path, const LogPath& file_pre_path) {
+  const size_t kDayLength = 8;
+  if (GetLogFileDay(path, file_pre_path) == 0) {
+    return 0;
+  }
+  auto index_pos = file_pre_path.size() + kDayLength;
+  if (index_pos >= path.size() || path[index_pos] != '.') {
+    return 0;
+  }
+  unsigned int index = 0;
+  for (++index_pos; index_pos < path.size() && path[index_pos] >= '0' && path[index_pos] <= '9'; ++index_pos) {
+    index = index * 10 + (path[index_pos] - '0');
+  }
+  return index_pos < path.size() && path[index_pos] == '.' ? index : 0;
+}
+
+// Replace path with path.gz, the temporary file keeps a broken archive invisible
+static bool CompressLogFile(const LogPath& path) {
+  auto compress_path = path + LOG_PATH_TEXT(".gz");
+  auto temp_path = compress_path + LOG_PATH_TEXT(".tmp");
+  std::ifstream input(path, std::ios::in | std::ios::binary);
+  if (!input.is_open()) {
+    return false;
+  }
+  auto output = OpenCompressFile(temp_path);
+  if (output == nullptr) {
+    return false;
+  }
+  std::vector<char> buffer(kCompressBufferSize);
+  auto result = true;
+  while (result && input.read(buffer.data(), buffer.size()).gcount() > 0) {
+    auto read_size = static_cast<unsigned int>(input.gcount());
+    result = gzwrite(output, buffer.data(), read_size) == static_cast<int>(read_size);
+  }
+  result = gzclose(output) == Z_OK && result;
+  input.close();
+  if (!result || !MoveLogFile(temp_path, compress_path)) {
+    RemoveLogFile(temp_path);
+    return false;
+  }
+  return RemoveLogFile(path);
+}
+
+// A destination of formatted lines besides the file, lines are queued and
+// written in batches by the thread of the sink
+class LogSink : public Uncopyable {
+ public:
+  explicit LogSink(int log_level);
+  virtual ~LogSink() {}
+
+  bool Init(unsigned int queue_size);
+  // Write the queued lines and stop the thread, later lines are written by the caller
+  void Uninit();
+  // Never blocks while the thread runs, a full queue drops the line
+  bool Push(const char* data, size_t length);
+  void Flush();
+
+  int log_level() const { return log_level_; }
+
+ protected:
+  virtual bool Write(const char* data, size_t length) = 0;
+
+ private:
+  struct SinkLine {
+    unsigned int length;
+    char data[kMaxLogLength];
+  };
+
+  bool Loop();
+
+ private:
+  int log_level_;
+  RingBuffer<SinkLine> lines_;
+  std::atomic<bool> writing_;
+  std::atomic<bool> flush_requested_;
+  std::atomic<unsigned long long> pushed_count_;
+  std::atomic<unsigned long long> written_count_;
+  std::atomic<unsigned long long> dropped_count_;
+  std::mutex write_lock_;
+  std::condition_variable write_cond_;
+  std::condition_variable flush_cond_;
+  std::unique_ptr<std::thread> write_thread_;
+};
+
+LogSink::LogSink(int log_level) {
+  log_level_ = log_level;
+  writing_ = false;
+  flush_requested_ = false;
+  pushed_count_ = 0;
+  written_count_ = 0;
+  dropped_count_ = 0;
+}
+
+bool LogSink::Init(unsigned int queue_size) {
+  if (write_thread_ != nullptr || !lines_.Init(queue_size)) {
+    return false;
+  }
+  writing_ = true;
+  auto thread_proc = std::bind(&LogSink::Loop, this);
+  write_thread_.reset(new std::thread(thread_proc));
+  return true;
+}
+
+void LogSink::Uninit() {
+  write_lock_.lock();
+  writing_ = false;
+  write_lock_.unlock();
+  write_cond_.notify_one();
+  if (write_thread_ != nullptr) {
+    write_thread_->join();
+    write_thread_ = nullptr;
+  }
+  flush_cond_.notify_all();
+}
+
+bool LogSink::Push(const char* data, size_t length) {
+  if (!writing_.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(write_lock_);
+    return Write(data, length);
+  }
+  auto pushed = lines_.TryPush([=](SinkLine& line) {
+    line.length = static_cast<unsigned int>(std::min(length, sizeof(line.data)));
+    memcpy(line.data, data, line.length);
+  });
+  if (!pushed) {
+    dropped_count_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  pushed_count_.fetch_add(1, std::memory_order_release);
+  if (lines_.size() >= lines_.capacity() / 2) {
+    write_cond_.notify_one();
+  }
+  return true;
+}
+
+void LogSink::Flush() {
+  auto flush_target = pushed_count_.load(std::memory_order_acquire);
+  std::unique_lock<std::mutex> lock(write_lock_);
+  while (writing_.load(std::memory_order_acquire) && written_count_.load(std::memory_order_acquire) < flush_target) {
+    flush_requested_ = true;
+    write_cond_.notify_one();
+    flush_cond_.wait_for(lock, std::chrono::milliseconds(kSinkFlushInterval));
+  }
+}
+
+bool LogSink::Loop() {
+  std::string batch;
+  batch.reserve(kMaxBatchSize + kMaxLogLength);
+  unsigned long long batch_count = 0;
+  auto consume = [&](SinkLine& line) {
+    batch.append(line.data, line.length);
+    ++batch_count;
+  };
+  auto running = true;
+  while (running) {
+    {
+      std::unique_lock<std::mutex> lock(write_lock_);
+      write_cond_.wait_for(lock, std::chrono::milliseconds(kSinkFlushInterval), [this] {
+        return !writing_ || flush_requested_ || lines_.size() >= lines_.capacity() / 2;
+      });
+      flush_requested_ = false;
+      running = writing_;
+    }
+    while (lines_.TryPop(consume)) {
+      if (batch.size() >= kMaxBatchSize) {
+        Write(batch.data(), batch.size());
+        batch.clear();
+      }
+    }
+    auto dropped_count = dropped_count_.exchange(0);
+    if (dropped_count != 0) {
+      AccurateTime now;
+      GetCurrentAccurateTime(now);
+      char drop_data[256] = {0};
+      auto drop_length = FormatLogPrefix(drop_data, _countof(drop_data), now, GetLogThreadId(), kWarning);
+      drop_length += sprintf_s(drop_data + drop_length, _countof(drop_data) - drop_length, "%llu log lines dropped by a full sink\n", dropped_count);
+      batch.append(drop_data, drop_length);
+    }
+    if (!batch.empty()) {
+      Write(batch.data(), batch.size());
+      batch.clear();
+    }
+    written_count_.fetch_add(batch_count, std::memory_order_release);
+    batch_count = 0;
+    write_lock_.lock();
+    write_lock_.unlock();
+    flush_cond_.notify_all();
+  }
+  return true;
+}
+
+class ConsoleSink : public LogSink {
+ public:
+  explicit ConsoleSink(int log_level) : LogSink(log_level) {}
+
+ protected:
+  bool Write(const char* data, size_t length) override {
+    auto result = fwrite(data, 1, length, stdout) == length;
+    return fflush(stdout) == 0 && result;
+  }
+};
+
+// Keeps the latest lines up to memory_size bytes
+class MemorySink : public LogSink {
+ public:
+  MemorySink(int log_level, size_t memory_size) : LogSink(log_level), memory_size_(memory_size) {}
+
+  std::string GetLines() {
+    std::lock_guard<std::mutex> lock(lines_lock_);
+    return lines_;
+  }
+
+ protected:
+  bool Write(const char* data, size_t length) override {
+    std::lock_guard<std::mutex> lock(lines_lock_);
+    lines_.append(data, length);
+    if (lines_.size() > memory_size_) {
+      // drop whole lines from the front
+      auto line_end = lines_.find('\n', lines_.size() - memory_size_);
+      lines_.erase(0, line_end == std::string::npos ? lines_.size() : line_end + 1);
+    }
+    return true;
+  }
+
+ private:
+  size_t memory_size_;
+  std::mutex lines_lock_;
+  std::string lines_;
+};
+
+// Streams lines to a Unix domain socket, reconnects at most once a second
+// and drops what is written while disconnected
+class SocketSink : public LogSink {
+ public:
+  SocketSink(int log_level, const std::string& address);
+  ~SocketSink();
+
+ protected:
+  bool Write(const char* data, size_t length) override;
+
+ private:
+  bool Connect();
+  void Disconnect();
+
+ private:
+#ifdef WIN32
+  typedef SOCKET SocketHandle;
+  static const SocketHandle kInvalidSocket = INVALID_SOCKET;
+#else
+  typedef int SocketHandle;
+  static const SocketHandle kInvalidSocket = -1;
+#endif
+  std::string address_;
+  SocketHandle socket_;
+  std::chrono::steady_clock::time_point connect_time_;
+};
+
+SocketSink::SocketSink(int log_level, const std::string& address) : LogSink(log_level), address_(address) {
+  socket_ = kInvalidSocket;
+  connect_time_ = std::chrono::steady_clock::now() - std::chrono::seconds(kSinkReconnectPeriod);
+}
+
+SocketSink::~SocketSink() {
+  Disconnect();
+}
+
+bool SocketSink::Connect() {
+  auto now = std::chrono::steady_clock::now();
+  if (now - connect_time_ < std::chrono::seconds(kSinkReconnectPeriod)) {
+    return false;
+  }
+  connect_time_ = now;
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  if (address_.empty() || address_.size() >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, address_.data(), address_.size());
+  socket_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socket_ == kInvalidSocket) {
+    return false;
+  }
+  if (connect(socket_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+    Disconnect();
+    return false;
+  }
+  return true;
+}
+
+#ifdef WIN32
+bool SocketSink::Write(const char* data, size_t length) {
+  if (socket_ == kInvalidSocket && !Connect()) {
+    return false;
+  }
+  while (length != 0) {
+    auto sent = send(socket_, data, static_cast<int>(std::min(length, static_cast<size_t>(kMaxBatchSize))), 0);
+    if (sent <= 0) {
+      Disconnect();
+      return false;
+    }
+    data += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+void SocketSink::Disconnect() {
+  if (socket_ != kInvalidSocket) {
+    closesocket(socket_);
+    socket_ = kInvalidSocket;
+  }
+}
+#else
+bool SocketSink::Write(const char* data, size_t length) {
+  if (socket_ == kInvalidSocket && !Connect()) {
+    return false;
+  }
+  while (length != 0) {
+    auto sent = send(socket_, data, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      Disconnect();
+      return false;
+    }
+    data += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+void SocketSink::Disconnect() {
+  if (socket_ != kInvalidSocket) {
+    close(socket_);
+    socket_ = kInvalidSocket;
+  }
+}
+#endif
+
 class Logger : public Uncopyable {
  public:
   Logger();
   ~Logger();
   void InitLog(const char* init_info, int log_level);
+  void InitLog(const char* init_info, const LogConfig& config);
   bool Logging(LogLevel log_level, const char* file_name, int line_number, const char* function_name, const char* format_str, va_list args);
+  bool LoggingFields(LogLevel log_level, const char* fields, size_t length);
+  void FlushLog();
+  void UninitWrite();
+  void UninitClear();
+  void UninitReport();
+  // Called on the first suppression of a site, starts the reporter
+  void OnFirstSuppression();
+  void DumpRecorder();
+  std::string GetMemoryLog();
+
+ private:
+  enum RecordType {
+    kRecordText,    // a formatted line of day
+    kRecordArgs,    // arguments of format_str, timestamp in microseconds
+    kRecordFields   // LogFieldWriter fields, timestamp in nanoseconds
+  };
+
+  struct LogRecord {
+    RecordType type;
+    unsigned int day;
+    unsigned int length;
+    const char* format_str;
+    long long timestamp;
+    unsigned int thread_id;
+    LogLevel level;
+    char data[kMaxLogLength];
+  };
+
+  struct SinkList {
+    std::vector<std::unique_ptr<LogSink>> sinks;
+    std::vector<MemorySink*> memory_sinks;
+  };
 
  private:
-  bool Logging(const char* log_data, bool is_new_day);
-  const char* GetLevelString(LogLevel level);
-  bool InitClear();
+  bool Logging(const char* log_data, size_t length, unsigned int day);
+  bool OpenLogFile();
+  bool WriteLogFile(const char* log_data, size_t length);
+  void CloseLogFile();
+  bool RotateLogFile();
+  bool WriteBinaryLogHeader();
+  void InitPath();
+  bool InitClear(const LogConfig& config);
   bool LoopClear();
+  void OnClearTimer();
   bool ClearOldLog();
+  // Suppressed LOG lines are reported every kMaintainPeriod, whatever the
+  // clear period is. The reporter only starts once a site suppressed a line,
+  // a program that never does has no thread for it.
+  bool InitReport(const LogConfig& config);
+  bool StartReport();
+  bool LoopReport();
+  bool InitWrite(const LogConfig& config);
+  bool LoopWrite();
+  template <typename Filler>
+  bool PushRecord(Filler&& fill);
+  void AppendRecord(const LogRecord& record, std::string& batch, unsigned int& batch_day);
+  const AccurateTime& GetRecordTime(long long timestamp);
+  bool WriteBatch(const std::string& batch, unsigned int day);
+  void SetDayFileName(unsigned int day);
+  static unsigned int GetDayKey(const DayTime& day);
+  template <typename Filler>
+  bool RecordLine(Filler&& fill);
+  bool InitRecorder(const LogConfig& config);
+  static void InstallFatalSignals();
+  void WriteRecorder();
+  static void OnFatalSignal(int signal_number);
+  bool InitSinks(const LogConfig& config);
+  void DeliverLine(LogLevel log_level, const char* log_data, size_t length);
+  // Readers of the sink list count themselves in the slot of the epoch they
+  // saw, so InitSinks only waits for the readers that may hold the old list
+  const SinkList* AcquireSinks(unsigned int& epoch);
+  void ReleaseSinks(unsigned int epoch);
 
  private:
-#ifdef WIN32
-  std::wstring file_pre_path_;
-  std::wstring thisday_file_name_;
-#else
-  std::string file_pre_path_;
-  std::string thisday_file_name_;
-#endif
+  LogPath file_pre_path_;
+  LogPath thisday_file_name_;
+  LogPath log_file_path_;
   std::ofstream log_file_;
+  MappedFile mapped_file_;
+  bool mapped_;
+  size_t map_chunk_size_;
+  int sync_interval_;
+  std::chrono::steady_clock::time_point sync_time_;
   std::mutex file_lock_;
-  int log_level_;
+  unsigned long long file_size_;
+  unsigned int file_index_;
+  unsigned long long max_file_size_;
+  unsigned long long max_total_size_;
+  int keep_days_;
+  bool compress_;
+  int clear_period_;
   Timer clear_timer_;
+  bool clear_rearmed_;
+  EventLoop* clear_loop_;
   std::unique_ptr<std::thread> clear_thread_;
+  std::mutex report_lock_;
+  bool report_enabled_;
+  EventLoop* report_event_loop_;
+  Timer report_timer_;
+  EventLoop* report_loop_;
+  std::unique_ptr<std::thread> report_thread_;
+  std::atomic<bool> async_;
+  std::atomic<bool> writing_;
+  std::atomic<bool> flush_requested_;
+  LogOverflow overflow_;
+  LogEncoding encoding_;
+  int flush_interval_;
+  unsigned int file_day_;
+  long long record_second_;
+  AccurateTime record_time_;
+  std::unordered_set<const char*> written_formats_;
+  RingBuffer<LogRecord> records_;
+  std::atomic<unsigned long long> pushed_count_;
+  std::atomic<unsigned long long> written_count_;
+  std::atomic<unsigned long long> dropped_count_;
+  std::mutex write_lock_;
+  std::condition_variable write_cond_;
+  std::condition_variable flush_cond_;
+  std::unique_ptr<std::thread> write_thread_;
+  std::atomic<int> recorder_level_;
+  std::atomic<int> recorder_trigger_;
+  RingBuffer<LogRecord> recorder_;
+  std::mutex recorder_lock_;
+  std::atomic<int> file_level_;
+  std::atomic<int> sink_level_;
+  // replaced as a whole by InitLog while other threads deliver, never changed
+  std::atomic<const SinkList*> sink_list_;
+  std::atomic<unsigned int> sink_epoch_;
+  std::atomic<int> sink_readers_[2];
 };
 
+// Signals that write the flight recorder out before the process dies
+const int kFatalSignals[] = {SIGSEGV, SIGABRT, SIGFPE, SIGILL};
+const size_t kFatalSignalNumber = sizeof(kFatalSignals) / sizeof(kFatalSignals[0]);
+// Bytes of the stack the fatal signals run on, an overflow leaves none
+const size_t kFatalStackSize = 64 * 1024;
+static std::atomic<Logger*> fatal_signal_logger(nullptr);
+// Sites that ever suppressed a line, a site is static so it is never removed
+std::atomic<LogSite*> suppressing_log_sites(nullptr);
+// the handlers before InitLog, a fatal signal is passed on to them
+#ifdef WIN32
+typedef void (*SignalHandler)(int);
+static SignalHandler previous_fatal_handlers[kFatalSignalNumber];
+#else
+static struct sigaction previous_fatal_actions[kFatalSignalNumber];
+#endif
+
 Logger::Logger() {
-  log_level_ = kStartup | kShutdown | kInfo | kWarning | kError;
+  mapped_ = false;
+  map_chunk_size_ = 0;
+  sync_interval_ = 0;
+  file_size_ = 0;
+  file_index_ = 0;
+  max_file_size_ = 0;
+  max_total_size_ = 0;
+  keep_days_ = 30;
+  compress_ = false;
+  clear_period_ = kOneDaySeconds;
+  clear_rearmed_ = false;
+  clear_loop_ = nullptr;
+  report_enabled_ = false;
+  report_event_loop_ = nullptr;
+  report_loop_ = nullptr;
+  async_ = false;
+  writing_ = false;
+  flush_requested_ = false;
+  overflow_ = kOverflowBlock;
+  encoding_ = kEncodingText;
+  flush_interval_ = 0;
+  file_day_ = 0;
+  record_second_ = -1;
+  pushed_count_ = 0;
+  written_count_ = 0;
+  dropped_count_ = 0;
+  recorder_level_ = 0;
+  recorder_trigger_ = 0;
+  file_level_ = kStartup | kShutdown | kInfo | kWarning | kError;
+  sink_level_ = 0;
+  sink_list_ = new SinkList;
+  sink_epoch_ = 0;
+  sink_readers_[0] = 0;
+  sink_readers_[1] = 0;
 }
 
 Logger::~Logger() {
+  UninitWrite();
   file_lock_.lock();
-  if (log_file_.is_open()) {
-    log_file_.close();
+  CloseLogFile();
+  file_lock_.unlock();
+  UninitClear();
+  UninitReport();
+  delete sink_list_.load();
+}
+
+void Logger::InitLog(const char* init_info, int log_level) {
+  LogConfig config;
+  config.log_level = log_level;
+  InitLog(init_info, config);
+}
+
+void Logger::InitLog(const char* init_info, const LogConfig& config) {
+  InitRecorder(config);
+  InitSinks(config);
+  auto log_level = file_level_.load(std::memory_order_relaxed) | sink_level_.load(std::memory_order_relaxed);
+  enabled_log_level.store(log_level | recorder_level_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  max_file_size_ = config.max_file_size;
+  max_total_size_ = config.max_total_size;
+  keep_days_ = config.keep_days;
+  compress_ = config.compress;
+  file_lock_.lock();
+  CloseLogFile();
+  mapped_ = config.mapped;
+  map_chunk_size_ = config.map_chunk_size;
+  sync_interval_ = config.sync_interval;
+  file_lock_.unlock();
+  if (max_file_size_ != 0 || max_total_size_ != 0 || compress_) {
+    clear_period_ = kMaintainPeriod;
   }
+  InitPath();
+  DayTime now;
+  GetCurrentDayTime(now);
+  file_lock_.lock();
+  file_day_ = 0;
   file_lock_.unlock();
-  clear_timer_.Uninit();
-  if (clear_thread_ != nullptr) {
-    clear_thread_->join();
-    clear_thread_ = nullptr;
+  DeliverLine(kStartup, init_info, strlen(init_info));
+  Logging(init_info, strlen(init_info), GetDayKey(now));
+  InitClear(config);
+  InitReport(config);
+  if (config.async || config.encoding != kEncodingText) {
+    InitWrite(config);
   }
 }
 
 #ifdef WIN32
-void Logger::InitLog(const char* init_info, int log_level) {
-  log_level_ = log_level;
+void Logger::InitPath() {
   auto exe_dir = GetExeDirectory();
   auto log_dir = exe_dir + L"\\log";
   CreateDirectory(log_dir.c_str(), NULL);
   auto exe_name = GetExeName(L".exe");
   file_pre_path_ = log_dir + L"\\" + exe_name + L"_";
-  InitClear();
-  DayTime now;
-  GetCurrentDayTime(now);
-  wchar_t today_file_name[1024] = {0};
-  swprintf_s(today_file_name, _countof(today_file_name), L"%04u%02u%02u.log", now.year, now.month, now.day);
-  thisday_file_name_ = today_file_name;
-  Logging(init_info, true);
 }
 #else
-void Logger::InitLog(const char* init_info, int log_level) {
-  log_level_ = log_level;
+void Logger::InitPath() {
   auto exe_dir = GetExeDirectory();
   auto log_dir = WStringToA(exe_dir) + "/log";
   mkdir(log_dir.c_str(), 0777);
   auto exe_name = GetExeName(L".exe");
   file_pre_path_ = log_dir + "/" + WStringToA(exe_name) + "_";
-  InitClear();
-  DayTime now;
-  GetCurrentDayTime(now);
-  char today_file_name[1024] = {0};
-  sprintf_s(today_file_name, _countof(today_file_name), "%04u%02u%02u.log", now.year, now.month, now.day);
-  thisday_file_name_ = today_file_name;
-  Logging(init_info, true);
 }
 #endif
 
 bool Logger::Logging(LogLevel log_level, const char* file_name, int line_number, const char* function_name, const char* format_str, va_list args) {
-  if ((log_level_ & log_level) == 0) {
+  if (!IsLogEnabled(log_level)) {
     return true;
   }
-  AccurateTime now;
-  GetCurrentAccurateTime(now);
-  char time_data[1024] = {0};
-  char thread_data[1024] = {0};
-  char source_data[1024] = {0};
-  char level_data[1024] = {0};
-  char function_data[1024] = {0};
-  char format_data[1024] = {0};
-  char log_data[2048] = {0};
-  sprintf_s(time_data, _countof(time_data), "[%02u:%02u:%02u.%03u]|", now.hour, now.minute, now.second, now.milliseconds);
-  sprintf_s(thread_data, _countof(thread_data), "[%04x]|", GetCurrentThreadId());
-  //sprintf_s(source_data, _countof(source_data), "[%s:%d]|", file_name, line_number);
-  sprintf_s(level_data, _countof(level_data), "[%s]|", GetLevelString(log_level));
-  //sprintf_s(function_data, _countof(function_data), "[%s]|", function_name);
-  _vsnprintf_s(format_data, _countof(format_data), format_str, args);
-  sprintf_s(log_data, _countof(log_data), "%s%s%s%s%s%s\n", time_data, thread_data, source_data, level_data, function_data, format_data);
-#ifdef WIN32
-  wchar_t today_file_name[1024] = {0};
-  swprintf_s(today_file_name, _countof(today_file_name), L"%04u%02u%02u.log", now.year, now.month, now.day);
-#else
-  char today_file_name[1024] = {0};
-  sprintf_s(today_file_name, _countof(today_file_name), "%04u%02u%02u.log", now.year, now.month, now.day);
-#endif
-  auto is_new_day = false;
-  if (thisday_file_name_ != today_file_name) {
-    thisday_file_name_ = today_file_name;
-    is_new_day = true;
+  auto& formatter = GetLineFormatter();
+  auto timestamp = GetCurrentMicroseconds();
+  if ((recorder_level_.load(std::memory_order_relaxed) & log_level) != 0) {
+    return RecordLine([&](LogRecord& record) {
+      record.type = kRecordText;
+      record.length = static_cast<unsigned int>(formatter.Format(record.data, sizeof(record.data), timestamp, log_level, format_str, args));
+      record.day = formatter.day();
+    });
   }
-  auto result = Logging(log_data, is_new_day);
-  return result;
+  if ((recorder_trigger_.load(std::memory_order_relaxed) & log_level) != 0) {
+    DumpRecorder();
+  }
+  // the sinks share the line formatted for a text file
+  static thread_local char log_data[kMaxLogLength];
+  size_t log_length = 0;
+  if ((sink_level_.load(std::memory_order_relaxed) & log_level) != 0) {
+    va_list sink_args;
+    va_copy(sink_args, args);
+    log_length = formatter.Format(log_data, sizeof(log_data), timestamp, log_level, format_str, sink_args);
+    va_end(sink_args);
+    DeliverLine(log_level, log_data, log_length);
+  }
+  if ((file_level_.load(std::memory_order_relaxed) & log_level) == 0) {
+    return true;
+  }
+  if (async_.load(std::memory_order_acquire) && encoding_ != kEncodingText) {
+    return PushRecord([=](LogRecord& record) {
+      record.type = kRecordArgs;
+      record.format_str = format_str;
+      record.timestamp = timestamp;
+      record.thread_id = GetLogThreadId();
+      record.level = log_level;
+      record.length = static_cast<unsigned int>(CaptureLogArgs(record.data, sizeof(record.data), format_str, args));
+    });
+  }
+  if (async_.load(std::memory_order_acquire)) {
+    return PushRecord([&](LogRecord& record) {
+      record.type = kRecordText;
+      if (log_length != 0) {
+        record.length = static_cast<unsigned int>(log_length);
+        memcpy(record.data, log_data, log_length);
+      } else {
+        record.length = static_cast<unsigned int>(formatter.Format(record.data, sizeof(record.data), timestamp, log_level, format_str, args));
+      }
+      record.day = formatter.day();
+    });
+  }
+  if (log_length == 0) {
+    log_length = formatter.Format(log_data, sizeof(log_data), timestamp, log_level, format_str, args);
+  }
+  return Logging(log_data, log_length, formatter.day());
 }
 
-bool Logger::Logging(const char* log_data, bool is_new_day) {
+bool Logger::LoggingFields(LogLevel log_level, const char* fields, size_t length) {
+  if (!IsLogEnabled(log_level)) {
+    return true;
+  }
+  length = std::min(length, static_cast<size_t>(kMaxLogLength));
+  auto timestamp = GetCurrentNanoseconds();
+  if ((recorder_level_.load(std::memory_order_relaxed) & log_level) != 0) {
+    return RecordLine([&](LogRecord& record) {
+      record.type = kRecordText;
+      record.length = static_cast<unsigned int>(RenderLogFields(record.data, sizeof(record.data), timestamp, GetLogThreadId(), log_level, fields, length));
+      record.day = GetLineFormatter().GetDay(timestamp / 1000);
+    });
+  }
+  if ((recorder_trigger_.load(std::memory_order_relaxed) & log_level) != 0) {
+    DumpRecorder();
+  }
+  static thread_local char log_data[kMaxLogLength];
+  size_t log_length = 0;
+  if ((sink_level_.load(std::memory_order_relaxed) & log_level) != 0) {
+    log_length = RenderLogFields(log_data, sizeof(log_data), timestamp, GetLogThreadId(), log_level, fields, length);
+    DeliverLine(log_level, log_data, log_length);
+  }
+  if ((file_level_.load(std::memory_order_relaxed) & log_level) == 0) {
+    return true;
+  }
+  if (async_.load(std::memory_order_acquire)) {
+    return PushRecord([=](LogRecord& record) {
+      record.type = kRecordFields;
+      record.timestamp = timestamp;
+      record.thread_id = GetLogThreadId();
+      record.level = log_level;
+      record.length = static_cast<unsigned int>(length);
+      memcpy(record.data, fields, length);
+    });
+  }
+  if (log_length == 0) {
+    log_length = RenderLogFields(log_data, sizeof(log_data), timestamp, GetLogThreadId(), log_level, fields, length);
+  }
+  return Logging(log_data, log_length, GetLineFormatter().GetDay(timestamp / 1000));
+}
+
+bool Logger::Logging(const char* log_data, size_t length, unsigned int day) {
   std::lock_guard<std::mutex> lock(file_lock_);
-  printf("%s", log_data);
-  if (is_new_day) {
-    if (log_file_.is_open()) {
-      log_file_.close();
-    }
-    auto log_file_path = file_pre_path_ + thisday_file_name_;
-    log_file_.open(log_file_path, std::ios::app);
-    if (!log_file_.good()) {
+  if (day != file_day_) {
+    SetDayFileName(day);
+    file_day_ = day;
+    file_index_ = 0;
+    if (!OpenLogFile()) {
       return false;
     }
+  } else if (max_file_size_ != 0 && file_size_ != 0 && file_size_ + length > max_file_size_) {
+    if (!RotateLogFile()) {
+      return false;
+    }
+    if (encoding_ == kEncodingBinary && !WriteBinaryLogHeader()) {
+      return false;
+    }
+  }
+  if (!WriteLogFile(log_data, length)) {
+    return false;
+  }
+  file_size_ += length;
+  return true;
+}
+
+bool Logger::OpenLogFile() {
+  CloseLogFile();
+  log_file_path_ = file_pre_path_ + thisday_file_name_;
+  if (mapped_) {
+    // binary records may end with zeros, the decoder skips the crash padding instead
+    if (!mapped_file_.Open(log_file_path_, map_chunk_size_, encoding_ != kEncodingBinary)) {
+      return false;
+    }
+    file_size_ = mapped_file_.size();
+    sync_time_ = std::chrono::steady_clock::now();
+    return true;
+  }
+  auto open_mode = std::ios::app;
+  if (encoding_ == kEncodingBinary) {
+    open_mode |= std::ios::binary;
+  }
+  log_file_.open(log_file_path_, open_mode);
+  if (!log_file_.good()) {
+    return false;
+  }
+  log_file_.seekp(0, std::ios::end);
+  auto file_size = log_file_.tellp();
+  file_size_ = file_size > 0 ? static_cast<unsigned long long>(file_size) : 0;
+  return true;
+}
+
+bool Logger::WriteLogFile(const char* log_data, size_t length) {
+  if (mapped_) {
+    if (!mapped_file_.Append(log_data, length)) {
+      return false;
+    }
+    if (sync_interval_ > 0) {
+      auto now = std::chrono::steady_clock::now();
+      if (now - sync_time_ >= std::chrono::milliseconds(sync_interval_)) {
+        sync_time_ = now;
+        return mapped_file_.Sync();
+      }
+    }
+    return true;
   }
   if (!log_file_.is_open()) {
     return false;
   }
-  log_file_.write(log_data, strlen(log_data));
+  log_file_.write(log_data, length);
   if (!log_file_.good()) {
     return false;
   }
@@ -164,119 +962,753 @@ bool Logger::Logging(const char* log_data, bool is_new_day) {
   return true;
 }
 
-const char* Logger::GetLevelString(LogLevel level) {
-  static const char* log_levels[] = {"Startup", "Shutdown", "Info", "Warning", "Error", "Unkown"};
-  switch (level) {
-  case kStartup:
-    return log_levels[0];
-  case kShutdown:
-    return log_levels[1];
-  case kInfo:
-    return log_levels[2];
-  case kWarning:
-    return log_levels[3];
-  case kError:
-    return log_levels[4];
+void Logger::CloseLogFile() {
+  if (log_file_.is_open()) {
+    log_file_.close();
+  }
+  if (mapped_file_.is_open()) {
+    if (sync_interval_ > 0) {
+      mapped_file_.Sync();
+    }
+    mapped_file_.Close();
   }
-  return log_levels[5];
 }
 
-bool Logger::InitClear() {
-  ClearOldLog();
+bool Logger::RotateLogFile() {
+  CloseLogFile();
+  auto log_file_path = file_pre_path_ + thisday_file_name_;
+  auto ext_pos = thisday_file_name_.find(LOG_PATH_TEXT('.'));
+  if (file_index_ == 0) {
+    // continue after the segments of an earlier run
+    std::vector<LogFileInfo> log_files;
+    ListLogFiles(file_pre_path_, log_files);
+    auto day_file_pre_path = file_pre_path_ + thisday_file_name_.substr(0, ext_pos);
+    for (const auto& i : log_files) {
+      if (i.path.compare(0, day_file_pre_path.size(), day_file_pre_path) == 0) {
+        file_index_ = std::max(file_index_, GetLogFileIndex(i.path, file_pre_path_));
+      }
+    }
+  }
+  while (true) {
+    auto index_string = std::to_string(++file_index_);
+    auto rotate_file_path = file_pre_path_ + thisday_file_name_;
+    rotate_file_path.insert(file_pre_path_.size() + ext_pos, LOG_PATH_TEXT(".") + LogPath(index_string.begin(), index_string.end()));
+    if (IsLogFileExist(rotate_file_path) || IsLogFileExist(rotate_file_path + LOG_PATH_TEXT(".gz"))) {
+      continue;
+    }
+    MoveLogFile(log_file_path, rotate_file_path);
+    break;
+  }
+  return OpenLogFile();
+}
+
+// A segment is decoded on its own, so it starts with a session and every
+// format the events of this or later batches may refer to. Called on the
+// writer thread, the only one that touches written_formats_.
+bool Logger::WriteBinaryLogHeader() {
+  std::string header;
+  AppendBinaryLogSession(header);
+  for (auto format_str : written_formats_) {
+    AppendBinaryLogFormat(header, format_str);
+  }
+  if (!WriteLogFile(header.data(), header.size())) {
+    return false;
+  }
+  file_size_ += header.size();
+  return true;
+}
+
+bool Logger::InitClear(const LogConfig& config) {
+  if (clear_thread_ != nullptr || clear_loop_ != nullptr) {
+    return true;
+  }
   AccurateTime now;
   GetCurrentAccurateTime(now);
   auto first_clear_hour = 23 - now.hour;
   auto first_clear_minute = 59 - now.minute;
   auto first_clear_second = 60 - now.second;
   auto first_clear = first_clear_hour * 24 + first_clear_minute * 60 + first_clear_second;
+  if (clear_period_ != kOneDaySeconds) {
+    first_clear = clear_period_;
+  }
   auto init_result = clear_timer_.Init(first_clear);
+  clear_rearmed_ = false;
+  if (config.event_loop != nullptr) {
+    if (!init_result || !config.event_loop->AddTimer(clear_timer_, std::bind(&Logger::OnClearTimer, this))) {
+      clear_timer_.Uninit();
+      return false;
+    }
+    clear_loop_ = config.event_loop;
+    clear_loop_->Post(std::bind(&Logger::ClearOldLog, this));
+    return true;
+  }
   auto thread_proc = std::bind(&Logger::LoopClear, this);
   clear_thread_.reset(new std::thread(thread_proc));
   return init_result;
 }
 
 bool Logger::LoopClear() {
-  auto first_clear = true;
+  LowerThreadPriority();
+  ClearOldLog();
   while (clear_timer_.Wait()) {
-    if (first_clear) {
-      const auto one_day_seconds = 24 * 60 * 60;
-      clear_timer_.ResetTimer(one_day_seconds);
-      first_clear = false;
+    OnClearTimer();
+  }
+  return true;
+}
+
+void Logger::OnClearTimer() {
+  // the first clear is at midnight, then every period
+  if (!clear_rearmed_) {
+    clear_timer_.ResetTimer(clear_period_);
+    clear_rearmed_ = true;
+  }
+  ClearOldLog();
+}
+
+void Logger::UninitClear() {
+  if (clear_loop_ != nullptr) {
+    clear_loop_->RemoveTimer(clear_timer_);
+    clear_loop_ = nullptr;
+  }
+  clear_timer_.Uninit();
+  if (clear_thread_ != nullptr) {
+    clear_thread_->join();
+    clear_thread_ = nullptr;
+  }
+}
+
+bool Logger::InitReport(const LogConfig& config) {
+  std::lock_guard<std::mutex> lock(report_lock_);
+  if (report_thread_ != nullptr || report_loop_ != nullptr) {
+    return true;
+  }
+  report_enabled_ = true;
+  report_event_loop_ = config.event_loop;
+  // a site may have suppressed lines before InitLog
+  if (suppressing_log_sites.load(std::memory_order_acquire) == nullptr) {
+    return true;
+  }
+  return StartReport();
+}
+
+void Logger::OnFirstSuppression() {
+  std::lock_guard<std::mutex> lock(report_lock_);
+  if (report_enabled_) {
+    StartReport();
+  }
+}
+
+// Called with report_lock_ held
+bool Logger::StartReport() {
+  if (report_thread_ != nullptr || report_loop_ != nullptr) {
+    return true;
+  }
+  if (!report_timer_.Init(kMaintainPeriod)) {
+    return false;
+  }
+  if (report_event_loop_ != nullptr) {
+    if (!report_event_loop_->AddTimer(report_timer_, ReportSuppressedLogs)) {
+      report_timer_.Uninit();
+      return false;
     }
-    ClearOldLog();
+    report_loop_ = report_event_loop_;
+    return true;
   }
+  auto thread_proc = std::bind(&Logger::LoopReport, this);
+  report_thread_.reset(new std::thread(thread_proc));
   return true;
 }
 
-#ifdef WIN32
+bool Logger::LoopReport() {
+  LowerThreadPriority();
+  while (report_timer_.Wait()) {
+    ReportSuppressedLogs();
+  }
+  return true;
+}
+
+void Logger::UninitReport() {
+  std::lock_guard<std::mutex> lock(report_lock_);
+  report_enabled_ = false;
+  if (report_loop_ != nullptr) {
+    report_loop_->RemoveTimer(report_timer_);
+    report_loop_ = nullptr;
+  }
+  report_timer_.Uninit();
+  if (report_thread_ != nullptr) {
+    report_thread_->join();
+    report_thread_ = nullptr;
+  }
+}
+
 bool Logger::ClearOldLog() {
-  std::vector<std::wstring> all_log_file;
-  WIN32_FIND_DATA find_data = {0};
-  auto find_string = file_pre_path_ + L"*.log";
-  auto find_handler = FindFirstFile(find_string.c_str(), &find_data);
-  if (find_handler == INVALID_HANDLE_VALUE) {
+  std::vector<LogFileInfo> log_files;
+  if (!ListLogFiles(file_pre_path_, log_files)) {
     return false;
   }
-  auto last_slash_pos = file_pre_path_.rfind(L'\\');
-  std::wstring log_dir(file_pre_path_, 0, ++last_slash_pos);
-  do {
-    auto find_file = log_dir + find_data.cFileName;
-    std::transform(find_file.begin(), find_file.end(), find_file.begin(), towlower);
-    all_log_file.push_back(std::move(find_file));
-  } while (FindNextFile(find_handler, &find_data));
-  FindClose(find_handler);
+  file_lock_.lock();
+  auto active_file_path = file_pre_path_ + thisday_file_name_;
+  file_lock_.unlock();
+  if (compress_) {
+    auto compressed = false;
+    for (const auto& i : log_files) {
+      if (i.path == active_file_path || !(IsEndWith(i.path, LOG_PATH_TEXT(".log")) || IsEndWith(i.path, LOG_PATH_TEXT(".logb")))) {
+        continue;
+      }
+      compressed = CompressLogFile(i.path) || compressed;
+    }
+    if (compressed) {
+      log_files.clear();
+      ListLogFiles(file_pre_path_, log_files);
+    }
+  }
   DayTime past;
-  auto past_due = -30 * 24 * 60 * 60; // push back 30 days
-  GetSpecialDayTime(past, past_due);
-  wchar_t base[1024] = {0};
-  swprintf_s(base, _countof(base), L"%s%04u%02u%02u.log", file_pre_path_.c_str(), past.year, past.month, past.day);
-  std::wstring delete_base(base);
-  std::transform(delete_base.begin(), delete_base.end(), delete_base.begin(), towlower);
-  for (const auto& i : all_log_file) {
-    if (i < delete_base) {
-      DeleteFile(i.c_str());
+  GetSpecialDayTime(past, -keep_days_ * kOneDaySeconds);
+  auto delete_day = GetDayKey(past);
+  unsigned long long total_size = 0;
+  std::vector<LogFileInfo> keep_files;
+  for (auto& i : log_files) {
+    auto file_day = GetLogFileDay(i.path, file_pre_path_);
+    if (file_day == 0) {
+      continue;
+    }
+    if (file_day < delete_day && i.path != active_file_path) {
+      RemoveLogFile(i.path);
+      continue;
+    }
+    total_size += i.size;
+    keep_files.push_back(std::move(i));
+  }
+  if (max_total_size_ == 0 || total_size <= max_total_size_) {
+    return true;
+  }
+  std::sort(keep_files.begin(), keep_files.end(), [](const LogFileInfo& left, const LogFileInfo& right) {
+    return left.modify_time < right.modify_time;
+  });
+  for (const auto& i : keep_files) {
+    if (total_size <= max_total_size_) {
+      break;
+    }
+    if (i.path != active_file_path && RemoveLogFile(i.path)) {
+      total_size -= i.size;
     }
   }
   return true;
 }
-#else
-bool Logger::ClearOldLog() {
-  std::vector<std::string> all_log_file;
-  auto last_slash_pos = file_pre_path_.rfind('/');
-  std::string log_dir(file_pre_path_, 0, last_slash_pos);
-  auto dir = opendir(log_dir.c_str());
-  if (dir == nullptr) {
+
+void Logger::FlushLog() {
+  unsigned int epoch = 0;
+  auto sink_list = AcquireSinks(epoch);
+  for (auto& i : sink_list->sinks) {
+    i->Flush();
+  }
+  ReleaseSinks(epoch);
+  if (!writing_.load(std::memory_order_acquire)) {
+    return;
+  }
+  auto flush_target = pushed_count_.load(std::memory_order_acquire);
+  std::unique_lock<std::mutex> lock(write_lock_);
+  while (writing_.load(std::memory_order_acquire) && written_count_.load(std::memory_order_acquire) < flush_target) {
+    flush_requested_ = true;
+    write_cond_.notify_one();
+    flush_cond_.wait_for(lock, std::chrono::milliseconds(flush_interval_));
+  }
+}
+
+void Logger::UninitWrite() {
+  async_ = false;
+  write_lock_.lock();
+  writing_ = false;
+  write_lock_.unlock();
+  write_cond_.notify_one();
+  if (write_thread_ != nullptr) {
+    write_thread_->join();
+    write_thread_ = nullptr;
+  }
+  flush_cond_.notify_all();
+  unsigned int epoch = 0;
+  auto sink_list = AcquireSinks(epoch);
+  for (auto& i : sink_list->sinks) {
+    i->Uninit();
+  }
+  ReleaseSinks(epoch);
+  file_lock_.lock();
+  encoding_ = kEncodingText;
+  if (mapped_) {
+    CloseLogFile();
+    mapped_ = false;
+    file_day_ = 0;
+  }
+  file_lock_.unlock();
+}
+
+bool Logger::InitWrite(const LogConfig& config) {
+  if (write_thread_ != nullptr) {
     return false;
   }
-  dirent* find_data = nullptr;
-  while ((find_data = readdir(dir)) != nullptr) {
-    auto find_file = log_dir + "/" + find_data->d_name;
-    auto find_ext = find_file.find(".log");
-    if (find_ext == std::string::npos) {
+  if (records_.capacity() == 0 && !records_.Init(config.buffer_size)) {
+    return false;
+  }
+  overflow_ = config.overflow;
+  flush_interval_ = config.flush_interval > 0 ? config.flush_interval : 1;
+  file_lock_.lock();
+  encoding_ = config.encoding;
+  if (encoding_ == kEncodingBinary) {
+    // reopen the day file with binary extension on the first batch
+    file_day_ = 0;
+  }
+  file_lock_.unlock();
+  writing_ = true;
+  auto thread_proc = std::bind(&Logger::LoopWrite, this);
+  write_thread_.reset(new std::thread(thread_proc));
+  async_ = true;
+  return true;
+}
+
+bool Logger::LoopWrite() {
+  std::string batch;
+  batch.reserve(kMaxBatchSize + kMaxLogLength);
+  auto batch_day = file_day_;
+  unsigned long long batch_count = 0;
+  auto consume = [&](LogRecord& record) {
+    AppendRecord(record, batch, batch_day);
+    ++batch_count;
+  };
+  auto running = true;
+  while (running) {
+    {
+      std::unique_lock<std::mutex> lock(write_lock_);
+      write_cond_.wait_for(lock, std::chrono::milliseconds(flush_interval_), [this] {
+        return !writing_ || flush_requested_ || records_.size() >= records_.capacity() / 2;
+      });
+      flush_requested_ = false;
+      running = writing_;
+    }
+    while (records_.TryPop(consume)) {
+      if (batch.size() >= kMaxBatchSize) {
+        WriteBatch(batch, batch_day);
+        batch.clear();
+      }
+    }
+    auto dropped_count = dropped_count_.exchange(0);
+    if (dropped_count != 0) {
+      AccurateTime now;
+      GetCurrentAccurateTime(now);
+      char drop_data[256] = {0};
+      auto drop_length = FormatLogPrefix(drop_data, _countof(drop_data), now, GetLogThreadId(), kWarning);
+      drop_length += sprintf_s(drop_data + drop_length, _countof(drop_data) - drop_length, "%llu log records dropped\n", dropped_count);
+      if (encoding_ == kEncodingBinary) {
+        AppendBinaryLogText(batch, drop_data, drop_length);
+      } else {
+        batch.append(drop_data, drop_length);
+      }
+    }
+    WriteBatch(batch, batch_day);
+    batch.clear();
+    written_count_.fetch_add(batch_count, std::memory_order_release);
+    batch_count = 0;
+    write_lock_.lock();
+    write_lock_.unlock();
+    flush_cond_.notify_all();
+  }
+  return true;
+}
+
+template <typename Filler>
+bool Logger::PushRecord(Filler&& fill) {
+  auto discard = [](LogRecord&) {};
+  while (!records_.TryPush(fill)) {
+    if (!writing_.load(std::memory_order_acquire) || overflow_ == kOverflowDropNewest) {
+      dropped_count_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    if (overflow_ == kOverflowDropOldest) {
+      if (records_.TryPop(discard)) {
+        dropped_count_.fetch_add(1, std::memory_order_relaxed);
+        written_count_.fetch_add(1, std::memory_order_release);
+      }
       continue;
     }
-    std::transform(find_file.begin(), find_file.end(), find_file.begin(), towlower);
-    all_log_file.push_back(std::move(find_file));
+    write_cond_.notify_one();
+    std::this_thread::yield();
   }
-  closedir(dir);
-  DayTime past;
-  auto past_due = -30 * 24 * 60 * 60; // push back 30 days
-  GetSpecialDayTime(past, past_due);
-  char base[1024] = {0};
-  sprintf_s(base, _countof(base), "%s%04u%02u%02u.log", file_pre_path_.c_str(), past.year, past.month, past.day);
-  std::string delete_base(base);
-  std::transform(delete_base.begin(), delete_base.end(), delete_base.begin(), towlower);
-  for (const auto& i : all_log_file) {
-    if (i < delete_base) {
-      unlink(i.c_str());
+  pushed_count_.fetch_add(1, std::memory_order_release);
+  if (records_.size() >= records_.capacity() / 2) {
+    write_cond_.notify_one();
+  }
+  return true;
+}
+
+void Logger::AppendRecord(const LogRecord& record, std::string& batch, unsigned int& batch_day) {
+  auto day = record.day;
+  if (record.type == kRecordArgs) {
+    day = GetDayKey(GetRecordTime(record.timestamp));
+  } else if (record.type == kRecordFields) {
+    day = GetDayKey(GetRecordTime(record.timestamp / 1000));
+  }
+  if (day != batch_day) {
+    WriteBatch(batch, batch_day);
+    batch.clear();
+    batch_day = day;
+    if (encoding_ == kEncodingBinary) {
+      written_formats_.clear();
+      AppendBinaryLogSession(batch);
+    }
+  }
+  if (encoding_ == kEncodingBinary) {
+    if (record.type == kRecordText) {
+      AppendBinaryLogText(batch, record.data, record.length);
+      return;
+    }
+    if (record.type == kRecordFields) {
+      AppendBinaryLogFields(batch, record.timestamp, record.thread_id, record.level, record.data, record.length);
+      return;
+    }
+    if (written_formats_.insert(record.format_str).second) {
+      AppendBinaryLogFormat(batch, record.format_str);
+    }
+    AppendBinaryLogEvent(batch, record.format_str, record.timestamp, record.thread_id, record.level, record.data, record.length);
+    return;
+  }
+  if (record.type == kRecordText) {
+    batch.append(record.data, record.length);
+    return;
+  }
+  char log_data[kMaxLogLength] = {0};
+  if (record.type == kRecordFields) {
+    auto log_length = RenderLogFields(log_data, _countof(log_data), record.timestamp, record.thread_id, record.level, record.data, record.length);
+    batch.append(log_data, log_length);
+    return;
+  }
+  auto log_length = FormatLogPrefix(log_data, _countof(log_data), GetRecordTime(record.timestamp), record.thread_id, record.level);
+  log_length += RenderLogArgs(log_data + log_length, _countof(log_data) - log_length - 1, record.format_str, record.data, record.length);
+  log_data[log_length++] = '\n';
+  batch.append(log_data, log_length);
+}
+
+const AccurateTime& Logger::GetRecordTime(long long timestamp) {
+  auto second = timestamp / 1000000;
+  if (second != record_second_) {
+    GetSpecialAccurateTime(record_time_, timestamp);
+    record_second_ = second;
+  }
+  record_time_.milliseconds = timestamp % 1000000 / 1000;
+  return record_time_;
+}
+
+bool Logger::WriteBatch(const std::string& batch, unsigned int day) {
+  if (batch.empty()) {
+    return true;
+  }
+  return Logging(batch.data(), batch.size(), day);
+}
+
+#ifdef WIN32
+void Logger::SetDayFileName(unsigned int day) {
+  wchar_t today_file_name[1024] = {0};
+  swprintf_s(today_file_name, _countof(today_file_name), encoding_ == kEncodingBinary ? L"%08u.logb" : L"%08u.log", day);
+  thisday_file_name_ = today_file_name;
+}
+#else
+void Logger::SetDayFileName(unsigned int day) {
+  char today_file_name[1024] = {0};
+  sprintf_s(today_file_name, _countof(today_file_name), encoding_ == kEncodingBinary ? "%08u.logb" : "%08u.log", day);
+  thisday_file_name_ = today_file_name;
+}
+#endif
+
+unsigned int Logger::GetDayKey(const DayTime& day) {
+  return day.year * 10000 + day.month * 100 + day.day;
+}
+
+void Logger::DumpRecorder() {
+  if (recorder_.capacity() == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(recorder_lock_);
+  auto async = async_.load(std::memory_order_acquire);
+  std::string batch;
+  unsigned int batch_day = 0;
+  auto dump = [&](LogRecord& line) {
+    if (async) {
+      PushRecord([&](LogRecord& record) {
+        record.type = kRecordText;
+        record.day = line.day;
+        record.length = line.length;
+        memcpy(record.data, line.data, line.length);
+      });
+      return;
+    }
+    if (line.day != batch_day && !batch.empty()) {
+      Logging(batch.data(), batch.size(), batch_day);
+      batch.clear();
     }
+    batch_day = line.day;
+    batch.append(line.data, line.length);
+  };
+  // lines recorded during the dump wait for the next one
+  auto count = recorder_.size();
+  while (count-- != 0 && recorder_.TryPop(dump)) {
+  }
+  if (!batch.empty()) {
+    Logging(batch.data(), batch.size(), batch_day);
+  }
+}
+
+template <typename Filler>
+bool Logger::RecordLine(Filler&& fill) {
+  auto discard = [](LogRecord&) {};
+  while (!recorder_.TryPush(fill)) {
+    recorder_.TryPop(discard);
+  }
+  return true;
+}
+
+bool Logger::InitSinks(const LogConfig& config) {
+  sink_level_.store(0, std::memory_order_relaxed);
+  std::unique_ptr<SinkList> sink_list(new SinkList);
+  auto sink_configs = config.sinks;
+  if (sink_configs.empty()) {
+    sink_configs.emplace_back(kSinkFile, config.log_level);
+    if (config.encoding == kEncodingText) {
+      sink_configs.emplace_back(kSinkConsole, config.log_level);
+    }
+  }
+  auto file_level = 0;
+  auto sink_level = 0;
+  auto result = true;
+  for (const auto& i : sink_configs) {
+    std::unique_ptr<LogSink> sink;
+    MemorySink* memory_sink = nullptr;
+    if (i.type == kSinkFile) {
+      file_level |= i.log_level;
+      continue;
+    } else if (i.type == kSinkConsole) {
+      sink.reset(new ConsoleSink(i.log_level));
+    } else if (i.type == kSinkMemory) {
+      memory_sink = new MemorySink(i.log_level, i.memory_size);
+      sink.reset(memory_sink);
+    } else if (i.type == kSinkSocket) {
+      sink.reset(new SocketSink(i.log_level, i.address));
+    }
+    if (sink == nullptr || !sink->Init(i.queue_size)) {
+      result = false;
+      continue;
+    }
+    if (memory_sink != nullptr) {
+      sink_list->memory_sinks.push_back(memory_sink);
+    }
+    sink_level |= i.log_level;
+    sink_list->sinks.push_back(std::move(sink));
+  }
+  std::unique_ptr<const SinkList> old_list(sink_list_.exchange(sink_list.release()));
+  // a reader that counts itself from now on sees the new list
+  auto epoch = sink_epoch_.fetch_add(1);
+  while (sink_readers_[epoch % 2].load() != 0) {
+    std::this_thread::yield();
+  }
+  for (auto& i : old_list->sinks) {
+    i->Uninit();
+  }
+  file_level_.store(file_level, std::memory_order_relaxed);
+  sink_level_.store(sink_level, std::memory_order_relaxed);
+  return result;
+}
+
+void Logger::DeliverLine(LogLevel log_level, const char* log_data, size_t length) {
+  unsigned int epoch = 0;
+  auto sink_list = AcquireSinks(epoch);
+  for (auto& i : sink_list->sinks) {
+    if ((i->log_level() & log_level) != 0) {
+      i->Push(log_data, length);
+    }
+  }
+  ReleaseSinks(epoch);
+}
+
+const Logger::SinkList* Logger::AcquireSinks(unsigned int& epoch) {
+  epoch = sink_epoch_.load();
+  sink_readers_[epoch % 2].fetch_add(1);
+  return sink_list_.load();
+}
+
+void Logger::ReleaseSinks(unsigned int epoch) {
+  sink_readers_[epoch % 2].fetch_sub(1);
+}
+
+std::string Logger::GetMemoryLog() {
+  std::string memory_log;
+  unsigned int epoch = 0;
+  auto sink_list = AcquireSinks(epoch);
+  for (auto i : sink_list->memory_sinks) {
+    i->Flush();
+    memory_log += i->GetLines();
+  }
+  ReleaseSinks(epoch);
+  return memory_log;
+}
+
+bool Logger::InitRecorder(const LogConfig& config) {
+  recorder_trigger_.store(0, std::memory_order_relaxed);
+  recorder_level_.store(0, std::memory_order_relaxed);
+  if (config.recorder_level == 0) {
+    return true;
+  }
+  if (recorder_.capacity() == 0 && !recorder_.Init(config.recorder_size)) {
+    return false;
+  }
+  recorder_trigger_.store(config.recorder_trigger & ~config.recorder_level, std::memory_order_relaxed);
+  recorder_level_.store(config.recorder_level, std::memory_order_relaxed);
+  Logger* no_logger = nullptr;
+  if (fatal_signal_logger.compare_exchange_strong(no_logger, this)) {
+    InstallFatalSignals();
   }
   return true;
 }
+
+#ifdef WIN32
+void Logger::InstallFatalSignals() {
+  for (size_t i = 0; i < kFatalSignalNumber; ++i) {
+    previous_fatal_handlers[i] = signal(kFatalSignals[i], &Logger::OnFatalSignal);
+  }
+}
+#else
+// The alternate stack is of the thread that called InitLog, a stack overflow
+// on another thread without one of its own still kills it undumped
+void Logger::InstallFatalSignals() {
+  static char fatal_stack[kFatalStackSize];
+  stack_t old_stack;
+  if (sigaltstack(nullptr, &old_stack) == 0 && (old_stack.ss_flags & SS_DISABLE) != 0) {
+    stack_t stack;
+    memset(&stack, 0, sizeof(stack));
+    stack.ss_sp = fatal_stack;
+    stack.ss_size = sizeof(fatal_stack);
+    sigaltstack(&stack, nullptr);
+  }
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = &Logger::OnFatalSignal;
+  action.sa_flags = SA_ONSTACK | SA_RESETHAND;
+  sigemptyset(&action.sa_mask);
+  for (size_t i = 0; i < kFatalSignalNumber; ++i) {
+    sigaction(kFatalSignals[i], &action, &previous_fatal_actions[i]);
+  }
+}
+#endif
+
+// Only async signal safe calls and no locks, the thread holding one may be
+// the one that crashed. The lines are written straight to the file, for a
+// mapped file past its appended data where the window would have put them,
+// so a write of another thread meanwhile may be overwritten. The ring only
+// pops records whose push completed, so one being filled when the signal
+// came ends the dump instead of coming out torn
+#ifdef WIN32
+void Logger::WriteRecorder() {
+  if (log_file_path_.empty()) {
+    return;
+  }
+  auto file = CreateFile(log_file_path_.c_str(), mapped_ ? FILE_WRITE_DATA : FILE_APPEND_DATA,
+    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return;
+  }
+  LARGE_INTEGER offset;
+  offset.QuadPart = static_cast<LONGLONG>(mapped_file_.size());
+  if (mapped_ && !SetFilePointerEx(file, offset, NULL, FILE_BEGIN)) {
+    CloseHandle(file);
+    return;
+  }
+  auto failed = false;
+  auto write_file = [&](const char* data, size_t length) {
+    DWORD written = 0;
+    failed = failed || !WriteFile(file, data, static_cast<DWORD>(length), &written, NULL);
+  };
+  auto write = [&](LogRecord& line) {
+    if (encoding_ == kEncodingBinary) {
+      char header[kBinaryLogTextHeaderSize];
+      FormatBinaryLogTextHeader(header, line.length);
+      write_file(header, sizeof(header));
+    }
+    write_file(line.data, line.length);
+  };
+  while (recorder_.TryPop(write)) {
+  }
+  CloseHandle(file);
+}
+#else
+void Logger::WriteRecorder() {
+  if (log_file_path_.empty()) {
+    return;
+  }
+  auto file = open(log_file_path_.c_str(), mapped_ ? O_WRONLY | O_CLOEXEC : O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (file == -1) {
+    return;
+  }
+  auto offset = static_cast<off_t>(mapped_file_.size());
+  auto failed = false;
+  auto write_file = [&](const char* data, size_t length) {
+    if (failed) {
+      return;
+    }
+    auto written = mapped_ ? pwrite(file, data, length, offset) : write(file, data, length);
+    failed = written != static_cast<ssize_t>(length);
+    offset += length;
+  };
+  auto write = [&](LogRecord& line) {
+    if (encoding_ == kEncodingBinary) {
+      char header[kBinaryLogTextHeaderSize];
+      FormatBinaryLogTextHeader(header, line.length);
+      write_file(header, sizeof(header));
+    }
+    write_file(line.data, line.length);
+  };
+  while (recorder_.TryPop(write)) {
+  }
+  close(file);
+}
+#endif
+
+// Best effort, only the first fatal signal dumps. The handler from before
+// InitLog is put back and gets the signal once this one returns, the
+// default one ends the process.
+void Logger::OnFatalSignal(int signal_number) {
+  auto logger = fatal_signal_logger.exchange(nullptr);
+  if (logger != nullptr) {
+    logger->WriteRecorder();
+  }
+  for (size_t i = 0; i < kFatalSignalNumber; ++i) {
+    if (kFatalSignals[i] == signal_number) {
+#ifdef WIN32
+      signal(signal_number, previous_fatal_handlers[i]);
+#else
+      sigaction(signal_number, &previous_fatal_actions[i], nullptr);
 #endif
+    }
+  }
+  raise(signal_number);
+}
 
 typedef Singleton<Logger> SingleLogger;
 
+void LogSite::Report() {
+  auto suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+  if (suppressed != 0) {
+    logging(level_, file_name_, line_number_, "", "%llu lines suppressed at %s:%d", suppressed, file_name_, line_number_);
+  }
+}
+
+void LogSite::Suppress() {
+  suppressed_.fetch_add(1, std::memory_order_relaxed);
+  if (registered_.load(std::memory_order_relaxed) || registered_.exchange(true, std::memory_order_relaxed)) {
+    return;
+  }
+  auto head = suppressing_log_sites.load(std::memory_order_relaxed);
+  do {
+    next_ = head;
+  } while (!suppressing_log_sites.compare_exchange_weak(head, this, std::memory_order_release, std::memory_order_relaxed));
+  SingleLogger::GetInstance()->OnFirstSuppression();
+}
+
 } // namespace utility
 
 void InitLog(const char* init_info, int log_level) {
@@ -284,6 +1716,46 @@ void InitLog(const char* init_info, int log_level) {
   logger->InitLog(init_info, log_level);
 }
 
+void InitLog(const char* init_info, const LogConfig& config) {
+  auto logger = utility::SingleLogger::GetInstance();
+  logger->InitLog(init_info, config);
+}
+
+void FlushLog() {
+  auto logger = utility::SingleLogger::GetInstance();
+  logger->FlushLog();
+}
+
+void UninitLog() {
+  ReportSuppressedLogs();
+  auto logger = utility::SingleLogger::GetInstance();
+  logger->UninitWrite();
+  logger->UninitClear();
+  logger->UninitReport();
+}
+
+std::string GetMemoryLog() {
+  auto logger = utility::SingleLogger::GetInstance();
+  return logger->GetMemoryLog();
+}
+
+void DumpLogRecorder() {
+  auto logger = utility::SingleLogger::GetInstance();
+  logger->DumpRecorder();
+}
+
+void ReportSuppressedLogs() {
+  auto site = utility::suppressing_log_sites.load(std::memory_order_acquire);
+  for (; site != nullptr; site = site->next()) {
+    site->Report();
+  }
+}
+
+void logging_fields(LogLevel level, const char* fields, size_t length) {
+  auto logger = utility::SingleLogger::GetInstance();
+  logger->LoggingFields(level, fields, length);
+}
+
 void logging(LogLevel level,
   const char* file_name,
   int line,
@@ -1,4 +1,4 @@
-/************************************************************************/
+﻿/************************************************************************/
 /*  Log Interface                                                       */
 /*  THREAD: safe                                                        */
 /*  AUTHOR: chen_lu@outlook.com                                         */
@@ -7,6 +7,17 @@
 #ifndef UTILITY_LOG_H_
 #define UTILITY_LOG_H_
 
+#include <atomic>
+#include <chrono>
+#include <stddef.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace utility {
+class EventLoop;
+}
+
 // Distinguish between different types of logs
 enum LogLevel {
   kStartup = 1,
@@ -23,10 +34,375 @@ void logging(LogLevel level,
   const char* format_str,
   ...);
 
+// What an asynchronous log does when its buffer is full
+enum LogOverflow {
+  kOverflowBlock = 0,       // wait for the writer thread
+  kOverflowDropNewest = 1,  // discard the record being logged
+  kOverflowDropOldest = 2   // discard the oldest buffered record
+};
+
+// Where a log line is formatted, the deferred encodings only keep the
+// format string pointer, so it must be a string literal
+enum LogEncoding {
+  kEncodingText = 0,      // format on the caller thread
+  kEncodingDeferred = 1,  // copy the arguments, format on the writer thread
+  kEncodingBinary = 2     // copy the arguments, write binary files for log_decoder
+};
+
+// Where log lines are delivered
+enum LogSinkType {
+  kSinkFile = 0,     // the day files, written as the rest of LogConfig says
+  kSinkConsole = 1,  // stdout
+  kSinkMemory = 2,   // the latest lines kept in memory, read by GetMemoryLog
+  kSinkSocket = 3    // a local collector listening on a Unix domain socket
+};
+
+// Every sink but the file has its own queue and thread, a full queue drops
+// the newest lines so a slow sink never blocks the callers or other sinks
+struct LogSinkConfig {
+  explicit LogSinkConfig(LogSinkType type = kSinkFile, int log_level = kStartup | kShutdown | kInfo | kWarning | kError)
+      : type(type),
+        log_level(log_level),
+        queue_size(1024),
+        memory_size(1024 * 1024) {}
+
+  LogSinkType type;
+  int log_level;
+  unsigned int queue_size;  // lines waiting for the sink
+  size_t memory_size;       // bytes a memory sink keeps
+  std::string address;      // socket path of a socket sink
+};
+
+struct LogConfig {
+  LogConfig()
+      : log_level(kStartup | kShutdown | kInfo | kWarning | kError),
+        async(false),
+        buffer_size(4096),
+        overflow(kOverflowBlock),
+        flush_interval(100),
+        encoding(kEncodingText),
+        max_file_size(0),
+        compress(false),
+        keep_days(30),
+        max_total_size(0),
+        mapped(false),
+        map_chunk_size(16 * 1024 * 1024),
+        sync_interval(0),
+        recorder_level(0),
+        recorder_trigger(kError),
+        recorder_size(1024),
+        event_loop(nullptr) {}
+
+  int log_level;
+  bool async;                 // format on the caller, write on a background thread
+  unsigned int buffer_size;   // number of records the asynchronous buffer holds
+  LogOverflow overflow;
+  int flush_interval;         // milliseconds between two batch writes at most
+  LogEncoding encoding;       // the deferred encodings imply async
+  unsigned long long max_file_size;   // bytes, a full day file is moved to _YYYYMMDD.N.log, 0 rotates by day only
+  bool compress;                      // gzip rotated files on the clear thread
+  int keep_days;                      // days of log files kept
+  unsigned long long max_total_size;  // bytes of log files kept, 0 is unlimited
+  bool mapped;                        // append through a memory mapped window, UninitLog cuts the preallocated tail
+  unsigned int map_chunk_size;        // bytes the mapped file is grown by
+  int sync_interval;                  // milliseconds between two syncs of the mapped file, 0 leaves it to the system
+  int recorder_level;                 // levels only kept in the in-memory flight recorder, 0 disables it
+  int recorder_trigger;               // levels that write the flight recorder out before themselves
+  unsigned int recorder_size;         // lines the flight recorder keeps, the oldest are overwritten
+  std::vector<LogSinkConfig> sinks;   // empty writes log_level to the file and to the console of a text log
+  utility::EventLoop* event_loop;     // clears old logs on this loop instead of a thread, it must outlive UninitLog
+};
+
+// Backend of LOGS, fields are encoded by utility::LogFieldWriter
+void logging_fields(LogLevel level, const char* fields, size_t length);
+
 void InitLog(const char* init_info, int log_level = kStartup | kShutdown | kInfo | kWarning | kError);
 
-// The macro for logging
+void InitLog(const char* init_info, const LogConfig& config);
+
+// Block until every record logged before this call is written
+void FlushLog();
+
+// Flush and stop the asynchronous writer and close a mapped file,
+// later records are written synchronously through a stream. Old logs are
+// no longer cleared until the next InitLog.
+void UninitLog();
+
+// Lines kept by the memory sinks
+std::string GetMemoryLog();
+
+// Write the lines held by the flight recorder to the log, a fatal signal
+// does it too once a recorder level is configured, as a best effort dump
+void DumpLogRecorder();
+
+// Log how many lines every rate limited call site suppressed since its last
+// report, the logger does it on UninitLog and once a minute from the first
+// suppression on
+void ReportSuppressedLogs();
+
+// Levels compiled into the program, LOG calls of other levels compile away
+// USAGE: -DLOG_COMPILED_LEVELS=24 keeps kWarning and kError only
+#ifndef LOG_COMPILED_LEVELS
+#define LOG_COMPILED_LEVELS (kStartup | kShutdown | kInfo | kWarning | kError)
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LOG_PRINTF_FORMAT(format_index, args_index) __attribute__((format(printf, format_index, args_index)))
+#else
+#define LOG_PRINTF_FORMAT(format_index, args_index)
+#endif
+
+namespace utility {
+
+// Levels enabled by InitLog, read before the logger or any argument is touched
+extern std::atomic<int> enabled_log_level;
+
+inline bool IsLogEnabled(LogLevel level) {
+  return (enabled_log_level.load(std::memory_order_relaxed) & level) != 0;
+}
+
+// Only what printf can consume: numbers, enums and pointers
+template <typename... Args>
+struct IsLogArgument;
+
+template <>
+struct IsLogArgument<> : std::true_type {};
+
+template <typename T, typename... Args>
+struct IsLogArgument<T, Args...>
+    : std::integral_constant<bool,
+        (std::is_arithmetic<typename std::decay<T>::type>::value ||
+         std::is_enum<typename std::decay<T>::type>::value ||
+         std::is_pointer<typename std::decay<T>::type>::value ||
+         std::is_same<typename std::decay<T>::type, std::nullptr_t>::value) &&
+        IsLogArgument<Args...>::value> {};
+
+// Never called, lets the compiler check the format string against the arguments
+inline void CheckLogFormat(const char* format_str, ...) LOG_PRINTF_FORMAT(1, 2);
+inline void CheckLogFormat(const char*, ...) {}
+
+template <typename... Args>
+inline void LogFormat(LogLevel level,
+  const char* file_name,
+  int line_number,
+  const char* function_name,
+  const char* format_str,
+  const Args&... args) {
+  static_assert(IsLogArgument<Args...>::value, "LOG arguments must be numbers, enums or pointers, pass strings with c_str()");
+  logging(level, file_name, line_number, function_name, format_str, args...);
+}
+
+// Encodes typed key value fields into a thread local buffer, never allocates.
+// Fields that do not fit are dropped.
+class LogFieldWriter {
+ public:
+  static const size_t kMaxLength = 2048;
+
+  LogFieldWriter();
+
+  bool Add(const char* key, bool value);
+  bool Add(const char* key, long long value);
+  bool Add(const char* key, unsigned long long value);
+  bool Add(const char* key, double value);
+  bool Add(const char* key, const char* value);
+  bool Add(const char* key, const std::string& value);
+
+  const char* data() const { return buffer_; }
+  size_t length() const { return length_; }
+
+ private:
+  bool AddField(char type, const char* key, const void* value, size_t size);
+
+ private:
+  char* buffer_;
+  size_t length_;
+};
+
+template <typename T>
+inline typename std::enable_if<std::is_same<T, bool>::value>::type AddLogField(LogFieldWriter& writer, const char* key, T value) {
+  writer.Add(key, value);
+}
+
+template <typename T>
+inline typename std::enable_if<(std::is_integral<T>::value && std::is_signed<T>::value) || std::is_enum<T>::value>::type
+AddLogField(LogFieldWriter& writer, const char* key, T value) {
+  writer.Add(key, static_cast<long long>(value));
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value && !std::is_same<T, bool>::value>::type
+AddLogField(LogFieldWriter& writer, const char* key, T value) {
+  writer.Add(key, static_cast<unsigned long long>(value));
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_floating_point<T>::value>::type AddLogField(LogFieldWriter& writer, const char* key, T value) {
+  writer.Add(key, static_cast<double>(value));
+}
+
+inline void AddLogField(LogFieldWriter& writer, const char* key, const char* value) {
+  writer.Add(key, value);
+}
+
+inline void AddLogField(LogFieldWriter& writer, const char* key, const std::string& value) {
+  writer.Add(key, value);
+}
+
+inline void AddLogFields(LogFieldWriter&) {}
+
+template <typename T, typename... Fields>
+inline void AddLogFields(LogFieldWriter& writer, const char* key, const T& value, const Fields&... fields) {
+  AddLogField(writer, key, value);
+  AddLogFields(writer, fields...);
+}
+
+template <typename... Fields>
+inline void LogFields(LogLevel level, const char* message, const Fields&... fields) {
+  static_assert(sizeof...(Fields) % 2 == 0, "LOGS fields must be key value pairs");
+  LogFieldWriter writer;
+  writer.Add("msg", message);
+  AddLogFields(writer, fields...);
+  logging_fields(level, writer.data(), writer.length());
+}
+
+// Rate limit of one call site, a static instance per site checked with
+// atomics only. With a rate, burst lines pass at once and then rate lines
+// per second, otherwise one line in every sample_every passes. The count of
+// suppressed lines is logged before the next line that passes or by
+// ReportSuppressedLogs.
+class LogSite {
+ public:
+  constexpr LogSite(const char* file_name, int line_number, LogLevel level,
+    unsigned int rate, unsigned int burst, unsigned int sample_every)
+    : file_name_(file_name),
+      line_number_(line_number),
+      level_(level),
+      interval_(rate == 0 ? 0 : 1000000000LL / rate),
+      tolerance_(rate == 0 || burst == 0 ? 0 : 1000000000LL / rate * (burst - 1)),
+      sample_every_(sample_every == 0 ? 1 : sample_every),
+      next_time_(0),
+      count_(0),
+      suppressed_(0),
+      registered_(false),
+      next_(nullptr) {}
+
+  bool Pass() {
+    auto pass = interval_ != 0 ? TakeToken() : count_.fetch_add(1, std::memory_order_relaxed) % sample_every_ == 0;
+    if (!pass) {
+      Suppress();
+      return false;
+    }
+    if (suppressed_.load(std::memory_order_relaxed) != 0) {
+      Report();
+    }
+    return true;
+  }
+
+  // Log the suppressed count if there is one
+  void Report();
+
+  LogSite* next() const { return next_; }
+
+ private:
+  // Generic cell rate algorithm, next_time_ is when the bucket is full again
+  bool TakeToken() {
+    auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+    auto next_time = next_time_.load(std::memory_order_relaxed);
+    while (true) {
+      auto start = next_time > now ? next_time : now;
+      if (start - now > tolerance_) {
+        return false;
+      }
+      if (next_time_.compare_exchange_weak(next_time, start + interval_, std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+  }
+
+  void Suppress();
+
+ private:
+  const char* file_name_;
+  int line_number_;
+  LogLevel level_;
+  long long interval_;
+  long long tolerance_;
+  unsigned int sample_every_;
+  std::atomic<long long> next_time_;
+  std::atomic<unsigned int> count_;
+  std::atomic<unsigned long long> suppressed_;
+  std::atomic<bool> registered_;
+  LogSite* next_;
+};
+
+} // namespace utility
+
+// The macro for logging, arguments are not evaluated when the level is disabled
 // USAGE: LOG(kInfo, "Hello, %s!", "World");
-#define LOG(level, ...) logging(level, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define LOG(level, ...) \
+  do { \
+    if (((level) & (LOG_COMPILED_LEVELS)) != 0 && utility::IsLogEnabled(level)) { \
+      if (false) { \
+        utility::CheckLogFormat(__VA_ARGS__); \
+      } \
+      utility::LogFormat(level, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__); \
+    } \
+  } while (0)
+
+// The macro for structured logging, a message and key value pairs written as
+// one JSON line with an epoch nanosecond timestamp
+// USAGE: LOGS(kInfo, "request done", "user", user_id, "latency_us", latency);
+#define LOGS(level, ...) \
+  do { \
+    if (((level) & (LOG_COMPILED_LEVELS)) != 0 && utility::IsLogEnabled(level)) { \
+      utility::LogFields(level, __VA_ARGS__); \
+    } \
+  } while (0)
+
+// Rate limited logging, up to rate lines per second from this call site,
+// bursts of rate lines pass at once
+// USAGE: LOG_RATE_LIMIT(kError, 10, "connect %s failed: %d", host, error);
+#define LOG_RATE_LIMIT(level, rate, ...) \
+  do { \
+    static utility::LogSite log_site(__FILE__, __LINE__, level, rate, rate, 0); \
+    if (((level) & (LOG_COMPILED_LEVELS)) != 0 && utility::IsLogEnabled(level) && log_site.Pass()) { \
+      if (false) { \
+        utility::CheckLogFormat(__VA_ARGS__); \
+      } \
+      utility::LogFormat(level, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__); \
+    } \
+  } while (0)
+
+// Sampled logging, the first line and then one in every n from this call site
+// USAGE: LOG_EVERY_N(kInfo, 1000, "queue size %zu", size);
+#define LOG_EVERY_N(level, n, ...) \
+  do { \
+    static utility::LogSite log_site(__FILE__, __LINE__, level, 0, 0, n); \
+    if (((level) & (LOG_COMPILED_LEVELS)) != 0 && utility::IsLogEnabled(level) && log_site.Pass()) { \
+      if (false) { \
+        utility::CheckLogFormat(__VA_ARGS__); \
+      } \
+      utility::LogFormat(level, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__); \
+    } \
+  } while (0)
+
+// LOGS with the rate limit of LOG_RATE_LIMIT
+#define LOGS_RATE_LIMIT(level, rate, ...) \
+  do { \
+    static utility::LogSite log_site(__FILE__, __LINE__, level, rate, rate, 0); \
+    if (((level) & (LOG_COMPILED_LEVELS)) != 0 && utility::IsLogEnabled(level) && log_site.Pass()) { \
+      utility::LogFields(level, __VA_ARGS__); \
+    } \
+  } while (0)
+
+// LOGS with the sampling of LOG_EVERY_N
+#define LOGS_EVERY_N(level, n, ...) \
+  do { \
+    static utility::LogSite log_site(__FILE__, __LINE__, level, 0, 0, n); \
+    if (((level) & (LOG_COMPILED_LEVELS)) != 0 && utility::IsLogEnabled(level) && log_site.Pass()) { \
+      utility::LogFields(level, __VA_ARGS__); \
+    } \
+  } while (0)
 
-#endif // UTILITY_LOG_H_
\ No newline at end of file
+#endif // UTILITY_LOG_H_
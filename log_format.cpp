@@ -0,0 +1,849 @@
+#include "log_format.h"
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+#include <wchar.h>
+
+namespace utility {
+
+namespace {
+
+enum ArgType {
+  kArgNone,
+  kArgInt,
+  kArgLong,
+  kArgLongLong,
+  kArgIntMax,
+  kArgSize,
+  kArgPtrDiff,
+  kArgDouble,
+  kArgLongDouble,
+  kArgString,
+  kArgWideString,
+  kArgPointer,
+  kArgCount,
+  kArgInvalid
+};
+
+// One "%..." conversion of a printf format string
+struct FormatSpec {
+  const char* begin;
+  const char* end;
+  int star_count;
+  ArgType type;
+};
+
+const size_t kMaxSpecLength = 32;
+const uint32_t kNullString = 0xFFFFFFFF;
+
+const char kBinaryLogMagic[] = {'U', 'L', 'O', 'G'};
+const unsigned char kBinaryLogVersion = 1;
+const char kSessionRecord = 'S';
+const char kFormatRecord = 'F';
+const char kEventRecord = 'E';
+const char kTextRecord = 'T';
+const char kFieldsRecord = 'K';
+
+const char kFieldBool = 'b';
+const char kFieldInt = 'i';
+const char kFieldUnsigned = 'u';
+const char kFieldDouble = 'd';
+const char kFieldString = 's';
+const size_t kMaxFieldKeyLength = 0xFF;
+const size_t kMaxFieldStringLength = 0xFFFF;
+
+// p points at '%', return the position after the conversion
+const char* ParseFormatSpec(const char* p, FormatSpec& spec) {
+  spec.begin = p;
+  spec.star_count = 0;
+  spec.type = kArgInvalid;
+  ++p;
+  if (*p == '%') {
+    spec.type = kArgNone;
+    spec.end = ++p;
+    return p;
+  }
+  while (*p != '\0' && strchr("-+ #0'", *p) != nullptr) {
+    ++p;
+  }
+  if (*p == '*') {
+    ++spec.star_count;
+    ++p;
+  }
+  while (*p >= '0' && *p <= '9') {
+    ++p;
+  }
+  if (*p == '.') {
+    ++p;
+    if (*p == '*') {
+      ++spec.star_count;
+      ++p;
+    }
+    while (*p >= '0' && *p <= '9') {
+      ++p;
+    }
+  }
+  auto length = 'n';
+  if (p[0] == 'h' && p[1] == 'h') {
+    p += 2;
+  } else if (p[0] == 'l' && p[1] == 'l') {
+    length = 'q';
+    p += 2;
+  } else if (p[0] == 'I' && p[1] == '6' && p[2] == '4') {
+    length = 'q';
+    p += 3;
+  } else if (p[0] == 'I' && p[1] == '3' && p[2] == '2') {
+    p += 3;
+  } else if (*p != '\0' && strchr("hljztLqI", *p) != nullptr) {
+    length = *p++;
+  }
+  auto conversion = *p;
+  if (conversion == '\0') {
+    spec.end = p;
+    return p;
+  }
+  spec.end = ++p;
+  switch (conversion) {
+  case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c': case 'C':
+    switch (length) {
+    case 'l':
+      spec.type = conversion == 'c' ? kArgInt : kArgLong;
+      break;
+    case 'q':
+      spec.type = kArgLongLong;
+      break;
+    case 'j':
+      spec.type = kArgIntMax;
+      break;
+    case 'z': case 'I':
+      spec.type = kArgSize;
+      break;
+    case 't':
+      spec.type = kArgPtrDiff;
+      break;
+    default:
+      spec.type = kArgInt;
+      break;
+    }
+    break;
+  case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+    spec.type = length == 'L' ? kArgLongDouble : kArgDouble;
+    break;
+  case 's':
+    spec.type = length == 'l' ? kArgWideString : kArgString;
+    break;
+  case 'S':
+    spec.type = kArgWideString;
+    break;
+  case 'p':
+    spec.type = kArgPointer;
+    break;
+  case 'n':
+    spec.type = kArgCount;
+    break;
+  }
+  return p;
+}
+
+template <typename T>
+bool CaptureValue(char* buffer, size_t size, size_t& used, T value) {
+  if (used + sizeof(value) > size) {
+    return false;
+  }
+  memcpy(buffer + used, &value, sizeof(value));
+  used += sizeof(value);
+  return true;
+}
+
+bool CaptureString(char* buffer, size_t size, size_t& used, const void* data, size_t data_size) {
+  if (used + sizeof(uint32_t) > size) {
+    return false;
+  }
+  if (data == nullptr) {
+    return CaptureValue(buffer, size, used, kNullString);
+  }
+  auto copy_size = std::min(data_size, size - used - sizeof(uint32_t));
+  CaptureValue(buffer, size, used, static_cast<uint32_t>(copy_size));
+  memcpy(buffer + used, data, copy_size);
+  used += copy_size;
+  return true;
+}
+
+template <typename T>
+bool ReadValue(const char* args, size_t args_size, size_t& used, T& value) {
+  if (used + sizeof(value) > args_size) {
+    return false;
+  }
+  memcpy(&value, args + used, sizeof(value));
+  used += sizeof(value);
+  return true;
+}
+
+template <typename T>
+int RenderValue(char* buffer, size_t size, const char* spec, const int* stars, int star_count, T value) {
+  switch (star_count) {
+  case 0:
+    return snprintf(buffer, size, spec, value);
+  case 1:
+    return snprintf(buffer, size, spec, stars[0], value);
+  default:
+    return snprintf(buffer, size, spec, stars[0], stars[1], value);
+  }
+}
+
+template <typename T>
+void AppendValue(std::string& output, const T& value) {
+  output.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+bool ReadValue(std::istream& input, T& value) {
+  input.read(reinterpret_cast<char*>(&value), sizeof(value));
+  return input.gcount() == sizeof(value);
+}
+
+// Appends to a fixed buffer, keeps reserve bytes for the end of the line
+class JsonWriter {
+ public:
+  JsonWriter(char* buffer, size_t size, size_t reserve) : buffer_(buffer), end_(size > reserve ? size - reserve : 0), length_(0) {}
+
+  bool Append(const char* data, size_t length) {
+    if (length_ + length > end_) {
+      return false;
+    }
+    memcpy(buffer_ + length_, data, length);
+    length_ += length;
+    return true;
+  }
+
+  bool AppendString(const char* data, size_t length) {
+    static const char kHex[] = "0123456789abcdef";
+    if (!Append("\"", 1)) {
+      return false;
+    }
+    for (size_t i = 0; i < length; ++i) {
+      auto c = static_cast<unsigned char>(data[i]);
+      char escape[6] = {'\\', 0, 0, 0, 0, 0};
+      size_t escape_length = 2;
+      switch (c) {
+      case '"': escape[1] = '"'; break;
+      case '\\': escape[1] = '\\'; break;
+      case '\n': escape[1] = 'n'; break;
+      case '\r': escape[1] = 'r'; break;
+      case '\t': escape[1] = 't'; break;
+      default:
+        if (c >= 0x20) {
+          escape[0] = static_cast<char>(c);
+          escape_length = 1;
+        } else {
+          escape[1] = 'u';
+          escape[2] = '0';
+          escape[3] = '0';
+          escape[4] = kHex[c >> 4];
+          escape[5] = kHex[c & 0xF];
+          escape_length = 6;
+        }
+        break;
+      }
+      if (!Append(escape, escape_length)) {
+        return false;
+      }
+    }
+    return Append("\"", 1);
+  }
+
+  template <typename T>
+  bool AppendNumber(const char* format_str, T value) {
+    char number[32] = {0};
+    auto length = sprintf_s(number, _countof(number), format_str, value);
+    return length > 0 && Append(number, length);
+  }
+
+  void Truncate(size_t length) { length_ = std::min(length, length_); }
+  size_t length() const { return length_; }
+
+ private:
+  char* buffer_;
+  size_t end_;
+  size_t length_;
+};
+
+} // namespace
+
+const char* GetLogLevelString(LogLevel level) {
+  static const char* log_levels[] = {"Startup", "Shutdown", "Info", "Warning", "Error", "Unkown"};
+  switch (level) {
+  case kStartup:
+    return log_levels[0];
+  case kShutdown:
+    return log_levels[1];
+  case kInfo:
+    return log_levels[2];
+  case kWarning:
+    return log_levels[3];
+  case kError:
+    return log_levels[4];
+  }
+  return log_levels[5];
+}
+
+size_t FormatLogPrefix(char* buffer, size_t size, const AccurateTime& time, unsigned int thread_id, LogLevel level) {
+  auto length = sprintf_s(buffer, size, "[%02u:%02u:%02u.%03u]|[%04x]|[%s]|",
+    time.hour, time.minute, time.second, time.milliseconds, thread_id, GetLogLevelString(level));
+  if (length < 0) {
+    return 0;
+  }
+  return std::min(static_cast<size_t>(length), size - 1);
+}
+
+LogLineFormatter::LogLineFormatter() {
+  second_ = -1;
+  day_ = 0;
+  memset(time_prefix_, 0, sizeof(time_prefix_));
+  auto thread_length = sprintf_s(thread_data_, _countof(thread_data_), "]|[%04x]|", GetCurrentThreadId());
+  thread_length_ = thread_length > 0 ? std::min(static_cast<size_t>(thread_length), sizeof(thread_data_) - 1) : 0;
+}
+
+unsigned int LogLineFormatter::GetDay(long long timestamp) {
+  UpdateTime(timestamp);
+  return day_;
+}
+
+void LogLineFormatter::UpdateTime(long long timestamp) {
+  auto second = timestamp / 1000000;
+  if (second != second_) {
+    AccurateTime now;
+    GetSpecialAccurateTime(now, timestamp);
+    sprintf_s(time_prefix_, _countof(time_prefix_), "[%02u:%02u:%02u.", now.hour % 100, now.minute % 100, now.second % 100);
+    day_ = now.year * 10000 + now.month * 100 + now.day;
+    second_ = second;
+  }
+}
+
+size_t LogLineFormatter::Format(char* buffer, size_t size, long long timestamp, LogLevel level, const char* format_str, va_list args) {
+  const size_t kTimePrefixLength = 10;
+  UpdateTime(timestamp);
+  auto level_string = GetLogLevelString(level);
+  auto level_length = strlen(level_string);
+  // "[hh:mm:ss." + "mmm" + "]|[tid]|" + "[level]|"
+  auto prefix_length = kTimePrefixLength + 3 + thread_length_ + level_length + 3;
+  if (size <= prefix_length + 1) {
+    return 0;
+  }
+  auto p = buffer;
+  memcpy(p, time_prefix_, kTimePrefixLength);
+  p += kTimePrefixLength;
+  auto milliseconds = static_cast<unsigned int>(timestamp % 1000000 / 1000);
+  *p++ = static_cast<char>('0' + milliseconds / 100);
+  *p++ = static_cast<char>('0' + milliseconds / 10 % 10);
+  *p++ = static_cast<char>('0' + milliseconds % 10);
+  memcpy(p, thread_data_, thread_length_);
+  p += thread_length_;
+  *p++ = '[';
+  memcpy(p, level_string, level_length);
+  p += level_length;
+  *p++ = ']';
+  *p++ = '|';
+  auto left_size = size - (p - buffer) - 1;
+  auto message_length = _vsnprintf_s(p, left_size, format_str, args);
+  if (message_length > 0) {
+    p += std::min(static_cast<size_t>(message_length), left_size - 1);
+  }
+  *p++ = '\n';
+  return p - buffer;
+}
+
+LogFieldWriter::LogFieldWriter() {
+  static thread_local char field_buffer[kMaxLength];
+  buffer_ = field_buffer;
+  length_ = 0;
+}
+
+bool LogFieldWriter::Add(const char* key, bool value) {
+  unsigned char field_value = value ? 1 : 0;
+  return AddField(kFieldBool, key, &field_value, sizeof(field_value));
+}
+
+bool LogFieldWriter::Add(const char* key, long long value) {
+  int64_t field_value = value;
+  return AddField(kFieldInt, key, &field_value, sizeof(field_value));
+}
+
+bool LogFieldWriter::Add(const char* key, unsigned long long value) {
+  uint64_t field_value = value;
+  return AddField(kFieldUnsigned, key, &field_value, sizeof(field_value));
+}
+
+bool LogFieldWriter::Add(const char* key, double value) {
+  return AddField(kFieldDouble, key, &value, sizeof(value));
+}
+
+bool LogFieldWriter::Add(const char* key, const char* value) {
+  if (value == nullptr) {
+    value = "";
+  }
+  return AddField(kFieldString, key, value, strlen(value));
+}
+
+bool LogFieldWriter::Add(const char* key, const std::string& value) {
+  return AddField(kFieldString, key, value.data(), value.size());
+}
+
+bool LogFieldWriter::AddField(char type, const char* key, const void* value, size_t size) {
+  auto key_length = std::min(strlen(key), kMaxFieldKeyLength);
+  size_t head_size = 2 + key_length;
+  if (type == kFieldString) {
+    head_size += sizeof(uint16_t);
+    size = std::min(size, kMaxFieldStringLength);
+    if (length_ + head_size < kMaxLength) {
+      size = std::min(size, kMaxLength - length_ - head_size);
+    }
+  }
+  if (length_ + head_size + size > kMaxLength) {
+    return false;
+  }
+  auto p = buffer_ + length_;
+  *p++ = type;
+  *p++ = static_cast<char>(key_length);
+  memcpy(p, key, key_length);
+  p += key_length;
+  if (type == kFieldString) {
+    auto string_length = static_cast<uint16_t>(size);
+    memcpy(p, &string_length, sizeof(string_length));
+    p += sizeof(string_length);
+  }
+  memcpy(p, value, size);
+  length_ += head_size + size;
+  return true;
+}
+
+size_t RenderLogFields(char* buffer, size_t size, long long timestamp, unsigned int thread_id, LogLevel level, const char* fields, size_t length) {
+  // "}\n" always fits
+  const size_t kLineEndLength = 2;
+  if (size < kLineEndLength + 1) {
+    return 0;
+  }
+  JsonWriter writer(buffer, size, kLineEndLength);
+  writer.AppendNumber("{\"ts\":%lld", timestamp);
+  writer.Append(",\"level\":", 9);
+  auto level_string = GetLogLevelString(level);
+  writer.AppendString(level_string, strlen(level_string));
+  writer.AppendNumber(",\"tid\":%u", thread_id);
+  size_t used = 0;
+  while (used + 2 <= length) {
+    auto type = fields[used];
+    size_t key_length = static_cast<unsigned char>(fields[used + 1]);
+    used += 2;
+    if (used + key_length > length) {
+      break;
+    }
+    auto key = fields + used;
+    used += key_length;
+    auto field_start = writer.length();
+    auto written = writer.Append(",", 1) && writer.AppendString(key, key_length) && writer.Append(":", 1);
+    switch (type) {
+    case kFieldBool: {
+      unsigned char value = 0;
+      written = ReadValue(fields, length, used, value) && written && (value != 0 ? writer.Append("true", 4) : writer.Append("false", 5));
+      break;
+    }
+    case kFieldInt: {
+      int64_t value = 0;
+      written = ReadValue(fields, length, used, value) && written && writer.AppendNumber("%lld", static_cast<long long>(value));
+      break;
+    }
+    case kFieldUnsigned: {
+      uint64_t value = 0;
+      written = ReadValue(fields, length, used, value) && written && writer.AppendNumber("%llu", static_cast<unsigned long long>(value));
+      break;
+    }
+    case kFieldDouble: {
+      double value = 0;
+      written = ReadValue(fields, length, used, value) && written;
+      if (written) {
+        written = value == value && value - value == 0 ? writer.AppendNumber("%.17g", value) : writer.Append("null", 4);
+      }
+      break;
+    }
+    case kFieldString: {
+      uint16_t value_length = 0;
+      if (!ReadValue(fields, length, used, value_length) || used + value_length > length) {
+        used = length;
+        written = false;
+        break;
+      }
+      written = written && writer.AppendString(fields + used, value_length);
+      used += value_length;
+      break;
+    }
+    default:
+      used = length;
+      written = false;
+      break;
+    }
+    if (!written) {
+      // a field either fits or is left out
+      writer.Truncate(field_start);
+      break;
+    }
+  }
+  auto line_length = writer.length();
+  buffer[line_length++] = '}';
+  buffer[line_length++] = '\n';
+  return line_length;
+}
+
+size_t CaptureLogArgs(char* buffer, size_t size, const char* format_str, va_list args) {
+  size_t used = 0;
+  auto p = format_str;
+  while (*p != '\0') {
+    if (*p != '%') {
+      ++p;
+      continue;
+    }
+    FormatSpec spec;
+    p = ParseFormatSpec(p, spec);
+    if (spec.type == kArgInvalid) {
+      break;
+    }
+    auto captured = true;
+    for (auto i = 0; i < spec.star_count && captured; ++i) {
+      captured = CaptureValue(buffer, size, used, va_arg(args, int));
+    }
+    switch (spec.type) {
+    case kArgNone:
+      break;
+    case kArgInt:
+      captured = captured && CaptureValue(buffer, size, used, va_arg(args, int));
+      break;
+    case kArgLong:
+      captured = captured && CaptureValue(buffer, size, used, va_arg(args, long));
+      break;
+    case kArgLongLong:
+      captured = captured && CaptureValue(buffer, size, used, va_arg(args, long long));
+      break;
+    case kArgIntMax:
+      captured = captured && CaptureValue(buffer, size, used, va_arg(args, intmax_t));
+      break;
+    case kArgSize:
+      captured = captured && CaptureValue(buffer, size, used, va_arg(args, size_t));
+      break;
+    case kArgPtrDiff:
+      captured = captured && CaptureValue(buffer, size, used, va_arg(args, ptrdiff_t));
+      break;
+    case kArgDouble:
+      captured = captured && CaptureValue(buffer, size, used, va_arg(args, double));
+      break;
+    case kArgLongDouble:
+      captured = captured && CaptureValue(buffer, size, used, va_arg(args, long double));
+      break;
+    case kArgPointer:
+    case kArgCount:
+      captured = captured && CaptureValue(buffer, size, used, va_arg(args, void*));
+      break;
+    case kArgString: {
+      auto value = va_arg(args, const char*);
+      captured = captured && CaptureString(buffer, size, used, value, value == nullptr ? 0 : strlen(value));
+      break;
+    }
+    case kArgWideString: {
+      auto value = va_arg(args, const wchar_t*);
+      captured = captured && CaptureString(buffer, size, used, value, value == nullptr ? 0 : wcslen(value) * sizeof(wchar_t));
+      break;
+    }
+    default:
+      break;
+    }
+    if (!captured) {
+      break;
+    }
+  }
+  return used;
+}
+
+size_t RenderLogArgs(char* buffer, size_t size, const char* format_str, const char* args, size_t args_size) {
+  if (size == 0) {
+    return 0;
+  }
+  size_t length = 0;
+  size_t used = 0;
+  std::vector<char> text;
+  auto p = format_str;
+  while (*p != '\0' && length + 1 < size) {
+    if (*p != '%') {
+      buffer[length++] = *p++;
+      continue;
+    }
+    FormatSpec spec;
+    p = ParseFormatSpec(p, spec);
+    if (spec.type == kArgNone) {
+      buffer[length++] = '%';
+      continue;
+    }
+    auto spec_length = static_cast<size_t>(spec.end - spec.begin);
+    if (spec.type == kArgInvalid || spec_length >= kMaxSpecLength) {
+      break;
+    }
+    char spec_str[kMaxSpecLength] = {0};
+    memcpy(spec_str, spec.begin, spec_length);
+    int stars[2] = {0};
+    auto read = true;
+    for (auto i = 0; i < spec.star_count && read; ++i) {
+      read = ReadValue(args, args_size, used, stars[i]);
+    }
+    auto out = buffer + length;
+    auto out_size = size - length;
+    auto written = 0;
+    switch (spec.type) {
+    case kArgInt: {
+      int value = 0;
+      read = read && ReadValue(args, args_size, used, value);
+      written = read ? RenderValue(out, out_size, spec_str, stars, spec.star_count, value) : 0;
+      break;
+    }
+    case kArgLong: {
+      long value = 0;
+      read = read && ReadValue(args, args_size, used, value);
+      written = read ? RenderValue(out, out_size, spec_str, stars, spec.star_count, value) : 0;
+      break;
+    }
+    case kArgLongLong: {
+      long long value = 0;
+      read = read && ReadValue(args, args_size, used, value);
+      written = read ? RenderValue(out, out_size, spec_str, stars, spec.star_count, value) : 0;
+      break;
+    }
+    case kArgIntMax: {
+      intmax_t value = 0;
+      read = read && ReadValue(args, args_size, used, value);
+      written = read ? RenderValue(out, out_size, spec_str, stars, spec.star_count, value) : 0;
+      break;
+    }
+    case kArgSize: {
+      size_t value = 0;
+      read = read && ReadValue(args, args_size, used, value);
+      written = read ? RenderValue(out, out_size, spec_str, stars, spec.star_count, value) : 0;
+      break;
+    }
+    case kArgPtrDiff: {
+      ptrdiff_t value = 0;
+      read = read && ReadValue(args, args_size, used, value);
+      written = read ? RenderValue(out, out_size, spec_str, stars, spec.star_count, value) : 0;
+      break;
+    }
+    case kArgDouble: {
+      double value = 0;
+      read = read && ReadValue(args, args_size, used, value);
+      written = read ? RenderValue(out, out_size, spec_str, stars, spec.star_count, value) : 0;
+      break;
+    }
+    case kArgLongDouble: {
+      long double value = 0;
+      read = read && ReadValue(args, args_size, used, value);
+      written = read ? RenderValue(out, out_size, spec_str, stars, spec.star_count, value) : 0;
+      break;
+    }
+    case kArgPointer: {
+      void* value = nullptr;
+      read = read && ReadValue(args, args_size, used, value);
+      written = read ? RenderValue(out, out_size, spec_str, stars, spec.star_count, value) : 0;
+      break;
+    }
+    case kArgCount: {
+      void* value = nullptr;
+      read = read && ReadValue(args, args_size, used, value);
+      break;
+    }
+    case kArgString:
+    case kArgWideString: {
+      uint32_t value_size = 0;
+      read = read && ReadValue(args, args_size, used, value_size);
+      if (!read) {
+        break;
+      }
+      if (value_size == kNullString) {
+        written = RenderValue(out, out_size, spec_str, stars, spec.star_count, static_cast<const char*>(nullptr));
+        break;
+      }
+      if (used + value_size > args_size) {
+        read = false;
+        break;
+      }
+      text.assign(args + used, args + used + value_size);
+      text.resize(value_size + sizeof(wchar_t), 0);
+      used += value_size;
+      if (spec.type == kArgString) {
+        written = RenderValue(out, out_size, spec_str, stars, spec.star_count, static_cast<const char*>(text.data()));
+      } else {
+        written = RenderValue(out, out_size, spec_str, stars, spec.star_count, reinterpret_cast<const wchar_t*>(text.data()));
+      }
+      break;
+    }
+    default:
+      break;
+    }
+    if (!read) {
+      break;
+    }
+    if (written > 0) {
+      length += std::min(static_cast<size_t>(written), out_size - 1);
+    }
+  }
+  buffer[length] = '\0';
+  return length;
+}
+
+void AppendBinaryLogSession(std::string& output) {
+  output.push_back(kSessionRecord);
+  output.append(kBinaryLogMagic, sizeof(kBinaryLogMagic));
+  AppendValue(output, kBinaryLogVersion);
+  AppendValue(output, static_cast<unsigned char>(sizeof(long)));
+  AppendValue(output, static_cast<unsigned char>(sizeof(void*)));
+  AppendValue(output, static_cast<unsigned char>(sizeof(long double)));
+}
+
+void AppendBinaryLogFormat(std::string& output, const char* format_str) {
+  auto length = static_cast<uint32_t>(strlen(format_str));
+  output.push_back(kFormatRecord);
+  AppendValue(output, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(format_str)));
+  AppendValue(output, length);
+  output.append(format_str, length);
+}
+
+void AppendBinaryLogEvent(std::string& output, const char* format_str, long long timestamp, unsigned int thread_id, LogLevel level, const char* args, size_t args_size) {
+  output.push_back(kEventRecord);
+  AppendValue(output, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(format_str)));
+  AppendValue(output, static_cast<int64_t>(timestamp));
+  AppendValue(output, static_cast<uint32_t>(thread_id));
+  AppendValue(output, static_cast<uint32_t>(level));
+  AppendValue(output, static_cast<uint32_t>(args_size));
+  output.append(args, args_size);
+}
+
+void AppendBinaryLogText(std::string& output, const char* text, size_t length) {
+  output.push_back(kTextRecord);
+  AppendValue(output, static_cast<uint32_t>(length));
+  output.append(text, length);
+}
+
+void FormatBinaryLogTextHeader(char* header, size_t length) {
+  auto text_length = static_cast<uint32_t>(length);
+  header[0] = kTextRecord;
+  memcpy(header + 1, &text_length, sizeof(text_length));
+}
+
+void AppendBinaryLogFields(std::string& output, long long timestamp, unsigned int thread_id, LogLevel level, const char* fields, size_t length) {
+  output.push_back(kFieldsRecord);
+  AppendValue(output, static_cast<int64_t>(timestamp));
+  AppendValue(output, static_cast<uint32_t>(thread_id));
+  AppendValue(output, static_cast<uint32_t>(level));
+  AppendValue(output, static_cast<uint32_t>(length));
+  output.append(fields, length);
+}
+
+bool DecodeBinaryLog(std::istream& input, std::ostream& output) {
+  std::unordered_map<uint64_t, std::string> formats;
+  std::vector<char> data;
+  char line[2048] = {0};
+  auto has_session = false;
+  char type = 0;
+  while (input.get(type)) {
+    // zeros left in the preallocated chunk of a mapped file that was not closed
+    if (type == 0) {
+      continue;
+    }
+    if (type == kSessionRecord) {
+      char magic[sizeof(kBinaryLogMagic)] = {0};
+      unsigned char version = 0;
+      unsigned char type_sizes[3] = {0};
+      input.read(magic, sizeof(magic));
+      if (!ReadValue(input, version) || !ReadValue(input, type_sizes)) {
+        return false;
+      }
+      if (memcmp(magic, kBinaryLogMagic, sizeof(magic)) != 0 || version != kBinaryLogVersion) {
+        return false;
+      }
+      if (type_sizes[0] != sizeof(long) || type_sizes[1] != sizeof(void*) || type_sizes[2] != sizeof(long double)) {
+        return false;
+      }
+      formats.clear();
+      has_session = true;
+      continue;
+    }
+    if (!has_session) {
+      return false;
+    }
+    if (type == kFormatRecord) {
+      uint64_t format_id = 0;
+      uint32_t length = 0;
+      if (!ReadValue(input, format_id) || !ReadValue(input, length)) {
+        return false;
+      }
+      std::string format_str(length, '\0');
+      input.read(&format_str[0], length);
+      if (static_cast<uint32_t>(input.gcount()) != length) {
+        return false;
+      }
+      formats[format_id] = std::move(format_str);
+    } else if (type == kEventRecord) {
+      uint64_t format_id = 0;
+      int64_t timestamp = 0;
+      uint32_t thread_id = 0;
+      uint32_t level = 0;
+      uint32_t args_size = 0;
+      if (!ReadValue(input, format_id) || !ReadValue(input, timestamp) || !ReadValue(input, thread_id) ||
+        !ReadValue(input, level) || !ReadValue(input, args_size)) {
+        return false;
+      }
+      data.resize(args_size);
+      input.read(data.data(), args_size);
+      if (static_cast<uint32_t>(input.gcount()) != args_size) {
+        return false;
+      }
+      auto find_format = formats.find(format_id);
+      if (find_format == formats.end()) {
+        return false;
+      }
+      AccurateTime time;
+      GetSpecialAccurateTime(time, timestamp);
+      auto length = FormatLogPrefix(line, sizeof(line), time, thread_id, static_cast<LogLevel>(level));
+      length += RenderLogArgs(line + length, sizeof(line) - length - 1, find_format->second.c_str(), data.data(), data.size());
+      line[length++] = '\n';
+      output.write(line, length);
+    } else if (type == kFieldsRecord) {
+      int64_t timestamp = 0;
+      uint32_t thread_id = 0;
+      uint32_t level = 0;
+      uint32_t length = 0;
+      if (!ReadValue(input, timestamp) || !ReadValue(input, thread_id) || !ReadValue(input, level) || !ReadValue(input, length)) {
+        return false;
+      }
+      data.resize(length);
+      input.read(data.data(), length);
+      if (static_cast<uint32_t>(input.gcount()) != length) {
+        return false;
+      }
+      auto line_length = RenderLogFields(line, sizeof(line), timestamp, thread_id, static_cast<LogLevel>(level), data.data(), data.size());
+      output.write(line, line_length);
+    } else if (type == kTextRecord) {
+      uint32_t length = 0;
+      if (!ReadValue(input, length)) {
+        return false;
+      }
+      data.resize(length);
+      input.read(data.data(), length);
+      if (static_cast<uint32_t>(input.gcount()) != length) {
+        return false;
+      }
+      output.write(data.data(), length);
+    } else {
+      return false;
+    }
+  }
+  return output.good();
+}
+
+} // namespace utility
@@ -0,0 +1,80 @@
+/************************************************************************/
+/*  Log Format                                                          */
+/*  THREAD: safe                                                        */
+/*  AUTHOR: chen_lu@outlook.com                                         */
+/************************************************************************/
+
+#ifndef UTILITY_LOG_FORMAT_H_
+#define UTILITY_LOG_FORMAT_H_
+
+#include "log.h"
+#include "utility.h"
+#include <istream>
+#include <ostream>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string>
+
+namespace utility {
+
+// Get the level name shown in a log line
+const char* GetLogLevelString(LogLevel level);
+
+// Write "[hh:mm:ss.mmm]|[tid]|[level]|", return the length written
+size_t FormatLogPrefix(char* buffer, size_t size, const AccurateTime& time, unsigned int thread_id, LogLevel level);
+
+// Formats a whole line in one pass, "[hh:mm:ss." and the day are cached
+// until the second changes, keep one instance per thread
+class LogLineFormatter {
+ public:
+  LogLineFormatter();
+
+  // timestamp is microseconds since epoch, return the length written,
+  // the line is truncated to size and always ends with '\n'
+  size_t Format(char* buffer, size_t size, long long timestamp, LogLevel level, const char* format_str, va_list args);
+
+  // Day of the last formatted line as yyyymmdd
+  unsigned int day() const { return day_; }
+
+  // Day of timestamp as yyyymmdd, refreshes the cache like Format
+  unsigned int GetDay(long long timestamp);
+
+ private:
+  void UpdateTime(long long timestamp);
+
+ private:
+  long long second_;
+  unsigned int day_;
+  char time_prefix_[16];
+  char thread_data_[16];
+  size_t thread_length_;
+};
+
+// Copy the arguments consumed by format_str into buffer, strings are copied
+// by value, return the size used
+size_t CaptureLogArgs(char* buffer, size_t size, const char* format_str, va_list args);
+
+// Format format_str with arguments copied by CaptureLogArgs, return the length written
+size_t RenderLogArgs(char* buffer, size_t size, const char* format_str, const char* args, size_t args_size);
+
+// Write fields encoded by LogFieldWriter as a JSON line, timestamp is
+// nanoseconds since epoch, return the length written
+size_t RenderLogFields(char* buffer, size_t size, long long timestamp, unsigned int thread_id, LogLevel level, const char* fields, size_t length);
+
+// Binary log file records, a file is a sequence of sessions and every
+// session defines the format strings its events refer to
+void AppendBinaryLogSession(std::string& output);
+void AppendBinaryLogFormat(std::string& output, const char* format_str);
+void AppendBinaryLogEvent(std::string& output, const char* format_str, long long timestamp, unsigned int thread_id, LogLevel level, const char* args, size_t args_size);
+void AppendBinaryLogText(std::string& output, const char* text, size_t length);
+// The header AppendBinaryLogText puts before text, for writers that cannot allocate
+const size_t kBinaryLogTextHeaderSize = 5;
+void FormatBinaryLogTextHeader(char* header, size_t length);
+void AppendBinaryLogFields(std::string& output, long long timestamp, unsigned int thread_id, LogLevel level, const char* fields, size_t length);
+
+// Convert a binary log file into the text log format
+bool DecodeBinaryLog(std::istream& input, std::ostream& output);
+
+} // namespace utility
+
+#endif // UTILITY_LOG_FORMAT_H_
@@ -0,0 +1,290 @@
+#include "mapped_file.h"
+#include <algorithm>
+#include <string.h>
+#ifdef WIN32
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace utility {
+
+#ifdef WIN32
+const MappedFile::FileHandle MappedFile::kInvalidFile = INVALID_HANDLE_VALUE;
+
+// walk back over the zeros a crash left in the preallocated chunk
+static bool FindDataEnd(HANDLE file, unsigned long long size, unsigned long long& end) {
+  char buffer[4096];
+  end = size;
+  while (end != 0) {
+    auto length = static_cast<DWORD>(std::min<unsigned long long>(end, sizeof(buffer)));
+    OVERLAPPED overlapped = {0};
+    overlapped.Offset = static_cast<DWORD>(end - length);
+    overlapped.OffsetHigh = static_cast<DWORD>((end - length) >> 32);
+    DWORD read_size = 0;
+    if (!ReadFile(file, buffer, length, &read_size, &overlapped) || read_size != length) {
+      return false;
+    }
+    auto data_end = length;
+    while (data_end != 0 && buffer[data_end - 1] == 0) {
+      --data_end;
+    }
+    end -= length - data_end;
+    if (data_end != 0) {
+      break;
+    }
+  }
+  return true;
+}
+#else
+// walk back over the zeros a crash left in the preallocated chunk
+static bool FindDataEnd(int file, unsigned long long size, unsigned long long& end) {
+  char buffer[4096];
+  end = size;
+  while (end != 0) {
+    auto length = static_cast<size_t>(std::min<unsigned long long>(end, sizeof(buffer)));
+    if (pread(file, buffer, length, end - length) != static_cast<ssize_t>(length)) {
+      return false;
+    }
+    auto data_end = length;
+    while (data_end != 0 && buffer[data_end - 1] == 0) {
+      --data_end;
+    }
+    end -= length - data_end;
+    if (data_end != 0) {
+      break;
+    }
+  }
+  return true;
+}
+#endif
+
+MappedFile::MappedFile() {
+#ifdef WIN32
+  mapping_ = NULL;
+#endif
+  file_ = kInvalidFile;
+  window_ = nullptr;
+  window_offset_ = 0;
+  window_size_ = 0;
+  chunk_size_ = 0;
+  size_ = 0;
+}
+
+MappedFile::~MappedFile() {
+  Close();
+}
+
+#ifdef WIN32
+bool MappedFile::Open(const std::wstring& path, size_t chunk_size, bool trim_zeros) {
+  if (file_ != kInvalidFile || chunk_size == 0) {
+    return false;
+  }
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  size_t granularity = info.dwAllocationGranularity;
+  chunk_size_ = (chunk_size + granularity - 1) / granularity * granularity;
+  file_ = CreateFile(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+    NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file_ == kInvalidFile) {
+    return false;
+  }
+  LARGE_INTEGER file_size = {0};
+  if (!GetFileSizeEx(file_, &file_size)) {
+    Close();
+    return false;
+  }
+  size_ = file_size.QuadPart;
+  if (trim_zeros) {
+    unsigned long long data_end = 0;
+    if (!FindDataEnd(file_, size_, data_end)) {
+      Close();
+      return false;
+    }
+    if (data_end != size_) {
+      file_size.QuadPart = data_end;
+      if (!SetFilePointerEx(file_, file_size, NULL, FILE_BEGIN) || !SetEndOfFile(file_)) {
+        Close();
+        return false;
+      }
+      size_ = data_end;
+    }
+  }
+  return true;
+}
+#else
+bool MappedFile::Open(const std::string& path, size_t chunk_size, bool trim_zeros) {
+  if (file_ != kInvalidFile || chunk_size == 0) {
+    return false;
+  }
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  chunk_size_ = (chunk_size + page_size - 1) / page_size * page_size;
+  file_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (file_ == kInvalidFile) {
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(file_, &file_stat) != 0) {
+    Close();
+    return false;
+  }
+  size_ = file_stat.st_size;
+  if (trim_zeros) {
+    unsigned long long data_end = 0;
+    if (!FindDataEnd(file_, size_, data_end)) {
+      Close();
+      return false;
+    }
+    if (data_end != size_) {
+      if (ftruncate(file_, data_end) != 0) {
+        Close();
+        return false;
+      }
+      size_ = data_end;
+    }
+  }
+  return true;
+}
+#endif
+
+bool MappedFile::Append(const char* data, size_t length) {
+  if (file_ == kInvalidFile) {
+    return false;
+  }
+  while (length != 0) {
+    if (window_ == nullptr || size_ >= window_offset_ + window_size_) {
+      if (!MapWindow()) {
+        return false;
+      }
+    }
+    auto window_pos = static_cast<size_t>(size_ - window_offset_);
+    auto copy_size = std::min(length, window_size_ - window_pos);
+    memcpy(window_ + window_pos, data, copy_size);
+    data += copy_size;
+    length -= copy_size;
+    size_ += copy_size;
+  }
+  return true;
+}
+
+#ifdef WIN32
+bool MappedFile::Sync() {
+  return Flush() && SyncFile();
+}
+
+bool MappedFile::Flush() {
+  return window_ == nullptr || FlushViewOfFile(window_, 0) != FALSE;
+}
+
+bool MappedFile::SyncFile() {
+  return file_ != kInvalidFile && FlushFileBuffers(file_) != FALSE;
+}
+
+bool MappedFile::Close() {
+  UnmapWindow();
+  auto result = true;
+  if (file_ != kInvalidFile) {
+    LARGE_INTEGER file_size = {0};
+    file_size.QuadPart = size_;
+    result = SetFilePointerEx(file_, file_size, NULL, FILE_BEGIN) && SetEndOfFile(file_);
+    CloseHandle(file_);
+    file_ = kInvalidFile;
+  }
+  size_ = 0;
+  return result;
+}
+
+bool MappedFile::MapWindow() {
+  UnmapWindow();
+  // the view offset must be a multiple of the allocation granularity, which chunk_size_ is
+  window_offset_ = size_ / chunk_size_ * chunk_size_;
+  window_size_ = chunk_size_;
+  auto map_end = window_offset_ + window_size_;
+  mapping_ = CreateFileMapping(file_, NULL, PAGE_READWRITE, static_cast<DWORD>(map_end >> 32), static_cast<DWORD>(map_end), NULL);
+  if (mapping_ == NULL) {
+    return false;
+  }
+  window_ = static_cast<char*>(MapViewOfFile(mapping_, FILE_MAP_WRITE, static_cast<DWORD>(window_offset_ >> 32),
+    static_cast<DWORD>(window_offset_), window_size_));
+  if (window_ == nullptr) {
+    UnmapWindow();
+    return false;
+  }
+  return true;
+}
+
+void MappedFile::UnmapWindow() {
+  if (window_ != nullptr) {
+    UnmapViewOfFile(window_);
+    window_ = nullptr;
+  }
+  if (mapping_ != NULL) {
+    CloseHandle(mapping_);
+    mapping_ = NULL;
+  }
+  window_size_ = 0;
+}
+#else
+bool MappedFile::Sync() {
+  if (window_ != nullptr && msync(window_, window_size_, MS_SYNC) != 0) {
+    return false;
+  }
+  return SyncFile();
+}
+
+// fdatasync writes the pages dirtied through any mapping, so the window
+// only has to be scheduled
+bool MappedFile::Flush() {
+  return window_ == nullptr || msync(window_, window_size_, MS_ASYNC) == 0;
+}
+
+bool MappedFile::SyncFile() {
+  return file_ != kInvalidFile && fdatasync(file_) == 0;
+}
+
+bool MappedFile::Close() {
+  UnmapWindow();
+  auto result = true;
+  if (file_ != kInvalidFile) {
+    result = ftruncate(file_, size_) == 0;
+    close(file_);
+    file_ = kInvalidFile;
+  }
+  size_ = 0;
+  return result;
+}
+
+bool MappedFile::MapWindow() {
+  UnmapWindow();
+  window_offset_ = size_ / chunk_size_ * chunk_size_;
+  window_size_ = chunk_size_;
+  auto map_end = window_offset_ + window_size_;
+  // a sparse window is only taken where the file system cannot preallocate,
+  // a window past a full disk would fault on the first write into it.
+  // posix_fallocate returns the error instead of setting errno
+  auto error = posix_fallocate(file_, window_offset_, window_size_);
+  if (error != 0 && ((error != EOPNOTSUPP && error != EINVAL) || ftruncate(file_, map_end) != 0)) {
+    return false;
+  }
+  auto window = mmap(nullptr, window_size_, PROT_READ | PROT_WRITE, MAP_SHARED, file_, window_offset_);
+  if (window == MAP_FAILED) {
+    window_size_ = 0;
+    return false;
+  }
+  window_ = static_cast<char*>(window);
+  return true;
+}
+
+void MappedFile::UnmapWindow() {
+  if (window_ != nullptr) {
+    munmap(window_, window_size_);
+    window_ = nullptr;
+  }
+  window_size_ = 0;
+}
+#endif
+
+} // namespace utility
@@ -0,0 +1,73 @@
+/************************************************************************/
+/*  Memory Mapped Append File                                           */
+/*  THREAD: unsafe                                                      */
+/*  AUTHOR: chen_lu@outlook.com                                         */
+/************************************************************************/
+
+#ifndef UTILITY_MAPPED_FILE_H_
+#define UTILITY_MAPPED_FILE_H_
+
+#include "uncopyable.h"
+#include <stddef.h>
+#include <string>
+#ifdef WIN32
+#include <Windows.h>
+#else
+#endif
+
+namespace utility {
+
+// Appends by copying into a mapped window of the file. The file is grown a
+// chunk at a time, so until Close it may end with zeroed preallocated space.
+class MappedFile : public Uncopyable {
+ public:
+  MappedFile();
+  ~MappedFile();
+
+  // New data goes after the existing content, chunk_size is rounded up to pages.
+  // trim_zeros cuts the trailing zeros a crash left before Close, pass false
+  // when the content itself may end with zero bytes
+#ifdef WIN32
+  bool Open(const std::wstring& path, size_t chunk_size, bool trim_zeros = true);
+#else
+  bool Open(const std::string& path, size_t chunk_size, bool trim_zeros = true);
+#endif
+  bool Append(const char* data, size_t length);
+  // Write the appended data through to the disk
+  bool Sync();
+  // Sync in two steps, Flush hands the window to the system and SyncFile
+  // then writes the file through. Flush must be serialized with Append by the
+  // caller, as MessageJournal does under its lock, SyncFile only uses the file
+  // handle and may run beside Append, never beside Open or Close
+  bool Flush();
+  bool SyncFile();
+  // Unmap and cut the preallocated space off
+  bool Close();
+
+  bool is_open() const { return file_ != kInvalidFile; }
+  unsigned long long size() const { return size_; }
+
+ private:
+  bool MapWindow();
+  void UnmapWindow();
+
+ private:
+#ifdef WIN32
+  typedef HANDLE FileHandle;
+  static const FileHandle kInvalidFile;
+  HANDLE mapping_;
+#else
+  typedef int FileHandle;
+  static const FileHandle kInvalidFile = -1;
+#endif
+  FileHandle file_;
+  char* window_;
+  unsigned long long window_offset_;
+  size_t window_size_;
+  size_t chunk_size_;
+  unsigned long long size_;
+};
+
+} // namespace utility
+
+#endif // UTILITY_MAPPED_FILE_H_
@@ -0,0 +1,381 @@
+#include "message_journal.h"
+#include "log.h"
+#include <chrono>
+#include <functional>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef WIN32
+#else
+#include <unistd.h>
+#endif
+
+namespace utility {
+
+// type, index, length of the payload and the payload, then the crc of them
+const char kRecordMessage = 1;
+// type and index, then the crc of them
+const char kRecordAck = 2;
+// or-ed into the type when the index takes 8 bytes instead of 4
+const char kRecordWide = 4;
+const size_t kRecordHeaderSize = 13;
+const size_t kRecordCrcSize = 4;
+
+#ifdef WIN32
+static const wchar_t kBaseSuffix[] = L".base";
+static const wchar_t kOldSuffix[] = L".old";
+static const wchar_t kTempSuffix[] = L".tmp";
+
+static bool IsJournalFileExist(const JournalPath& path) {
+  return GetFileAttributes(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+}
+
+static bool MoveJournalFile(const JournalPath& from, const JournalPath& to) {
+  return MoveFileEx(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+}
+
+static bool RemoveJournalFile(const JournalPath& path) {
+  return DeleteFile(path.c_str()) != FALSE;
+}
+
+static FILE* OpenReadFile(const JournalPath& path) {
+  return _wfopen(path.c_str(), L"rb");
+}
+#else
+static const char kBaseSuffix[] = ".base";
+static const char kOldSuffix[] = ".old";
+static const char kTempSuffix[] = ".tmp";
+
+static bool IsJournalFileExist(const JournalPath& path) {
+  return access(path.c_str(), F_OK) == 0;
+}
+
+static bool MoveJournalFile(const JournalPath& from, const JournalPath& to) {
+  return rename(from.c_str(), to.c_str()) == 0;
+}
+
+static bool RemoveJournalFile(const JournalPath& path) {
+  return unlink(path.c_str()) == 0;
+}
+
+static FILE* OpenReadFile(const JournalPath& path) {
+  return fopen(path.c_str(), "rb");
+}
+#endif
+
+static bool WriteRecord(MappedFile& file, char type, Index index, const char* data, size_t length) {
+  char header[kRecordHeaderSize];
+  size_t header_size = 1;
+  if (static_cast<unsigned long long>(index) > 0xFFFFFFFF) {
+    auto record_index = static_cast<uint64_t>(index);
+    header[0] = type | kRecordWide;
+    memcpy(header + header_size, &record_index, sizeof(record_index));
+    header_size += sizeof(record_index);
+  } else {
+    auto record_index = static_cast<uint32_t>(index);
+    header[0] = type;
+    memcpy(header + header_size, &record_index, sizeof(record_index));
+    header_size += sizeof(record_index);
+  }
+  if (type == kRecordMessage) {
+    auto record_length = static_cast<uint32_t>(length);
+    memcpy(header + header_size, &record_length, sizeof(record_length));
+    header_size += sizeof(record_length);
+  }
+  auto crc = static_cast<uint32_t>(crc32(0, reinterpret_cast<const Bytef*>(header), static_cast<uInt>(header_size)));
+  if (length != 0) {
+    crc = static_cast<uint32_t>(crc32(crc, reinterpret_cast<const Bytef*>(data), static_cast<uInt>(length)));
+  }
+  return file.Append(header, header_size) && file.Append(data, length) &&
+         file.Append(reinterpret_cast<const char*>(&crc), kRecordCrcSize);
+}
+
+// Apply the records of the file to messages, a missing file has none. The
+// zeroed preallocated tail or a torn record ends the file.
+static bool ReadJournal(const JournalPath& path, std::unordered_map<Index, std::string>& messages) {
+  if (!IsJournalFileExist(path)) {
+    return true;
+  }
+  auto file = OpenReadFile(path);
+  if (file == nullptr) {
+    return false;
+  }
+  std::string data;
+  char buffer[64 * 1024];
+  size_t read_size = 0;
+  while ((read_size = fread(buffer, 1, sizeof(buffer), file)) != 0) {
+    data.append(buffer, read_size);
+  }
+  auto read_error = ferror(file) != 0;
+  fclose(file);
+  if (read_error) {
+    return false;
+  }
+  size_t position = 0;
+  while (position + 5 + kRecordCrcSize <= data.size()) {
+    auto type = data[position];
+    Index index = kInvalidIndex;
+    uint32_t length = 0;
+    size_t header_size = 1;
+    if ((type & kRecordWide) != 0) {
+      uint64_t record_index = 0;
+      if (position + header_size + sizeof(record_index) > data.size()) {
+        break;
+      }
+      memcpy(&record_index, data.data() + position + header_size, sizeof(record_index));
+      index = static_cast<Index>(record_index);
+      header_size += sizeof(record_index);
+      type &= ~kRecordWide;
+    } else {
+      uint32_t record_index = 0;
+      memcpy(&record_index, data.data() + position + header_size, sizeof(record_index));
+      index = record_index;
+      header_size += sizeof(record_index);
+    }
+    if (type == kRecordMessage) {
+      if (position + header_size + sizeof(length) > data.size()) {
+        break;
+      }
+      memcpy(&length, data.data() + position + header_size, sizeof(length));
+      header_size += sizeof(length);
+    } else if (type != kRecordAck) {
+      break;
+    }
+    if (data.size() - position < header_size + kRecordCrcSize + length) {
+      break;
+    }
+    auto record = data.data() + position;
+    uint32_t crc = 0;
+    memcpy(&crc, record + header_size + length, sizeof(crc));
+    if (crc != static_cast<uint32_t>(crc32(0, reinterpret_cast<const Bytef*>(record), static_cast<uInt>(header_size + length)))) {
+      break;
+    }
+    if (type == kRecordMessage) {
+      messages[index].assign(record + header_size, length);
+    } else {
+      messages.erase(index);
+    }
+    position += header_size + length + kRecordCrcSize;
+  }
+  return true;
+}
+
+MessageJournal::MessageJournal() {
+  running_ = false;
+  failed_ = false;
+  compacting_ = false;
+  appended_ = 0;
+  committed_ = 0;
+}
+
+MessageJournal::~MessageJournal() {
+  Uninit();
+}
+
+bool MessageJournal::Init(const JournalConfig& config, std::unordered_map<Index, std::string>& messages) {
+  if (config.path.empty() || config.chunk_size == 0 || commit_thread_ != nullptr) {
+    return false;
+  }
+  config_ = config;
+  base_path_ = config.path + kBaseSuffix;
+  old_path_ = config.path + kOldSuffix;
+  // the old file is left by a compaction that did not finish
+  messages.clear();
+  if (!ReadJournal(base_path_, messages) || !ReadJournal(old_path_, messages) || !ReadJournal(config.path, messages)) {
+    return false;
+  }
+  // start over from a base without the acked messages and the torn tail
+  if (!WriteBase(messages)) {
+    return false;
+  }
+  if (IsJournalFileExist(old_path_) && !RemoveJournalFile(old_path_)) {
+    return false;
+  }
+  if (IsJournalFileExist(config.path) && !RemoveJournalFile(config.path)) {
+    return false;
+  }
+  if (!file_.Open(config.path, config.chunk_size)) {
+    return false;
+  }
+  running_ = true;
+  failed_ = false;
+  compacting_ = false;
+  appended_ = 0;
+  committed_ = 0;
+  auto commit_proc = std::bind(&MessageJournal::CommitLoop, this);
+  commit_thread_.reset(new std::thread(commit_proc));
+  auto compact_proc = std::bind(&MessageJournal::CompactLoop, this);
+  compact_thread_.reset(new std::thread(compact_proc));
+  return true;
+}
+
+unsigned long long MessageJournal::AppendMessage(Index index, const char* data, size_t length) {
+  std::lock_guard<std::mutex> lock(journal_lock_);
+  if (!AppendRecord(kRecordMessage, index, data, length)) {
+    return 0;
+  }
+  return appended_;
+}
+
+bool MessageJournal::AppendAck(Index index) {
+  std::lock_guard<std::mutex> lock(journal_lock_);
+  return AppendRecord(kRecordAck, index, nullptr, 0);
+}
+
+bool MessageJournal::WaitCommit(unsigned long long position) {
+  std::unique_lock<std::mutex> lock(journal_lock_);
+  committed_cond_.wait(lock, [this, position] { return committed_ >= position || failed_ || !running_; });
+  return committed_ >= position;
+}
+
+void MessageJournal::Uninit() {
+  journal_lock_.lock();
+  running_ = false;
+  journal_lock_.unlock();
+  commit_cond_.notify_all();
+  committed_cond_.notify_all();
+  compact_cond_.notify_all();
+  // the commit thread syncs what is left, a compaction running finishes
+  if (commit_thread_ != nullptr) {
+    commit_thread_->join();
+    commit_thread_ = nullptr;
+  }
+  if (compact_thread_ != nullptr) {
+    compact_thread_->join();
+    compact_thread_ = nullptr;
+  }
+  file_.Close();
+}
+
+bool MessageJournal::CommitLoop() {
+  std::unique_lock<std::mutex> lock(journal_lock_);
+  while (true) {
+    commit_cond_.wait(lock, [this] { return !running_ || appended_ != committed_; });
+    if (appended_ == committed_) {
+      return true;
+    }
+    if (config_.commit_interval > 0 && running_) {
+      // the records appended while waiting go into this commit
+      commit_cond_.wait_for(lock, std::chrono::milliseconds(config_.commit_interval), [this] { return !running_; });
+    }
+    auto position = appended_;
+    // the file only changes on this thread, appends go on while it syncs
+    auto synced = !failed_ && file_.Flush();
+    if (synced) {
+      lock.unlock();
+      synced = file_.SyncFile();
+      lock.lock();
+    }
+    if (!synced && !failed_) {
+      LOG(kError, "fail to sync message journal.");
+      failed_ = true;
+    }
+    if (failed_) {
+      committed_cond_.notify_all();
+      return false;
+    }
+    committed_ = position;
+    committed_cond_.notify_all();
+    if (!compacting_ && file_.size() >= config_.compact_size) {
+      compacting_ = RotateFile();
+      if (compacting_) {
+        compact_cond_.notify_one();
+      }
+    }
+  }
+  return true;
+}
+
+bool MessageJournal::CompactLoop() {
+  std::unique_lock<std::mutex> lock(journal_lock_);
+  while (true) {
+    compact_cond_.wait(lock, [this] { return !running_ || compacting_; });
+    if (!compacting_) {
+      return true;
+    }
+    lock.unlock();
+    auto compacted = CompactFiles();
+    lock.lock();
+    if (!compacted) {
+      // the old file stays for the next Init, no more rotations until then
+      LOG(kError, "fail to compact message journal.");
+      return false;
+    }
+    compacting_ = false;
+  }
+  return true;
+}
+
+bool MessageJournal::AppendRecord(char type, Index index, const char* data, size_t length) {
+  if (!running_ || failed_) {
+    return false;
+  }
+  auto size = file_.size();
+  if (!WriteRecord(file_, type, index, data, length)) {
+    LOG(kError, "fail to append message journal.");
+    failed_ = true;
+    return false;
+  }
+  appended_ += file_.size() - size;
+  commit_cond_.notify_one();
+  return true;
+}
+
+// Called with journal_lock_ held. The records appended while the last
+// commit synced without the lock are synced here, so the moved file is all
+// on the disk. The commit thread is the only one that replaces the file.
+bool MessageJournal::RotateFile() {
+  if (!file_.Sync()) {
+    LOG(kError, "fail to sync message journal.");
+    failed_ = true;
+    return false;
+  }
+  committed_ = appended_;
+  committed_cond_.notify_all();
+  if (!file_.Close() || !MoveJournalFile(config_.path, old_path_)) {
+    LOG(kError, "fail to move message journal.");
+    failed_ = true;
+    return false;
+  }
+  if (!file_.Open(config_.path, config_.chunk_size)) {
+    LOG(kError, "fail to open message journal.");
+    failed_ = true;
+    return false;
+  }
+  return true;
+}
+
+// Only this thread touches the base and the old file while compacting_
+bool MessageJournal::CompactFiles() {
+  std::unordered_map<Index, std::string> messages;
+  if (!ReadJournal(base_path_, messages) || !ReadJournal(old_path_, messages)) {
+    return false;
+  }
+  // the old file read again after a crash here applies the same records
+  return WriteBase(messages) && RemoveJournalFile(old_path_);
+}
+
+// Written aside and moved over the base, so a crash leaves either one whole
+bool MessageJournal::WriteBase(const std::unordered_map<Index, std::string>& messages) {
+  auto temp_path = base_path_ + kTempSuffix;
+  if (IsJournalFileExist(temp_path) && !RemoveJournalFile(temp_path)) {
+    return false;
+  }
+  MappedFile base_file;
+  if (!base_file.Open(temp_path, config_.chunk_size)) {
+    return false;
+  }
+  for (const auto& message : messages) {
+    if (!WriteRecord(base_file, kRecordMessage, message.first, message.second.data(), message.second.size())) {
+      base_file.Close();
+      return false;
+    }
+  }
+  if (!base_file.Sync() || !base_file.Close()) {
+    return false;
+  }
+  return MoveJournalFile(temp_path, base_path_);
+}
+
+} // namespace utility
@@ -0,0 +1,96 @@
+/************************************************************************/
+/*  Message Journal                                                     */
+/*  THREAD: safe                                                        */
+/*  AUTHOR: chen_lu@outlook.com                                         */
+/************************************************************************/
+
+#ifndef UTILITY_MESSAGE_JOURNAL_H_
+#define UTILITY_MESSAGE_JOURNAL_H_
+
+#include "indexer.h"
+#include "mapped_file.h"
+#include "uncopyable.h"
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace utility {
+
+#ifdef WIN32
+typedef std::wstring JournalPath;
+#else
+typedef std::string JournalPath;
+#endif
+
+struct JournalConfig {
+  JournalConfig()
+      : chunk_size(4 * 1024 * 1024),
+        commit_interval(0),
+        compact_size(64 * 1024 * 1024),
+        wait_commit(true) {}
+
+  JournalPath path;                 // path.base and path.old are kept beside it
+  size_t chunk_size;                // bytes the mapped file is grown by
+  int commit_interval;              // milliseconds a commit waits for more records, 0 syncs at once
+  unsigned long long compact_size;  // bytes of the appended file that start a compaction
+  // false sends once appended, a crash of the process loses nothing then
+  // but a crash of the system loses what was not committed
+  bool wait_commit;
+};
+
+// Messages and acks are appended to a memory mapped file, every record
+// with a crc so a torn tail ends the replay. A commit thread syncs all the
+// records appended meanwhile at once. A full file is moved to path.old and
+// merged with path.base into a new base on a compaction thread, which
+// keeps only the messages not acked.
+class MessageJournal : public Uncopyable {
+ public:
+  MessageJournal();
+  ~MessageJournal();
+
+  // messages gets what was appended and not acked before, the journal
+  // starts over with them in the base
+  bool Init(const JournalConfig& config, std::unordered_map<Index, std::string>& messages);
+  // The position to wait for, 0 on failure
+  unsigned long long AppendMessage(Index index, const char* data, size_t length);
+  // Committed with the messages, an ack lost in a crash resends the message
+  bool AppendAck(Index index);
+  // Return once everything up to position is on the disk
+  bool WaitCommit(unsigned long long position);
+  void Uninit();
+
+  bool is_open() const { return file_.is_open(); }
+
+ private:
+  bool CommitLoop();
+  bool CompactLoop();
+  // Called with journal_lock_ held
+  bool AppendRecord(char type, Index index, const char* data, size_t length);
+  bool RotateFile();
+  bool CompactFiles();
+  bool WriteBase(const std::unordered_map<Index, std::string>& messages);
+
+ private:
+  JournalConfig config_;
+  JournalPath base_path_;
+  JournalPath old_path_;
+  MappedFile file_;
+  bool running_;
+  bool failed_;
+  bool compacting_;
+  unsigned long long appended_;
+  unsigned long long committed_;
+  std::mutex journal_lock_;
+  std::condition_variable commit_cond_;
+  std::condition_variable committed_cond_;
+  std::condition_variable compact_cond_;
+  std::unique_ptr<std::thread> commit_thread_;
+  std::unique_ptr<std::thread> compact_thread_;
+};
+
+} // namespace utility
+
+#endif // UTILITY_MESSAGE_JOURNAL_H_
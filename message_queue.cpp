@@ -1,116 +1,856 @@
 #include "message_queue.h"
 #include "log.h"
 #include <algorithm>
+#include <atomic>
+#include <random>
 
 namespace utility {
 
+// Slot of index in a table of mask + 1 slots. Indices are handed out in
+// order, so the runs of queued ones are spread out by a Fibonacci hash.
+// Where Index is wider than the 32 bits of a slot, the bits above count the
+// rounds the slots of the shard wrapped, so an index popped late does not
+// find the message queued in its slot a round later
+static const unsigned long long kIndexRound = sizeof(Index) > 4 ? 0x100000000ULL : 0;
+
+static Index GetSlot(Index index) {
+  return static_cast<Index>(index & kMaxIndexNumber);
+}
+
+// every round of a slot is in the same probe run
+static size_t HashIndex(Index index, size_t mask) {
+  return static_cast<size_t>((static_cast<uint64_t>(GetSlot(index)) * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+// A policy whose intervals shrink or go negative would resend in a tight loop
+static bool IsValidRetryPolicy(const RetryPolicy& retry_policy) {
+  return retry_policy.initial_delay >= std::chrono::milliseconds::zero() &&
+         retry_policy.max_interval >= std::chrono::milliseconds::zero() &&
+         retry_policy.multiplier >= 1.0 &&
+         retry_policy.jitter >= 0.0 && retry_policy.jitter <= 1.0;
+}
+
+// interval moved by a random fraction of up to jitter either way, never
+// below a millisecond
+static std::chrono::milliseconds AddJitter(const std::chrono::milliseconds& interval, double jitter) {
+  if (jitter <= 0.0 || interval.count() <= 0) {
+    return interval;
+  }
+  static thread_local std::mt19937 generator{std::random_device()()};
+  std::uniform_real_distribution<double> distribution(-jitter, jitter);
+  auto offset = static_cast<std::chrono::milliseconds::rep>(interval.count() * distribution(generator));
+  return std::max(interval + std::chrono::milliseconds(offset), std::chrono::milliseconds(1));
+}
+
+// Add amount to value unless it would go over limit, 0 is no limit
+static bool AddBelowLimit(std::atomic<size_t>& value, size_t amount, size_t limit) {
+  if (limit == 0) {
+    value += amount;
+    return true;
+  }
+  auto current = value.load();
+  do {
+    if (current + amount > limit) {
+      return false;
+    }
+  } while (!value.compare_exchange_weak(current, current + amount));
+  return true;
+}
+
 MessageQueue::MessageQueue() {
+  event_loop_ = nullptr;
   timeout_ = 0;
+  shard_index_bits_ = 32;
+  window_messages_ = 0;
+  window_bytes_ = 0;
+  window_waiters_ = 0;
+  window_full_ = false;
 }
 
 MessageQueue::~MessageQueue() {
   Uninit();
 }
 
-bool MessageQueue::Init(int timeout) {
+bool MessageQueue::Init(int timeout, size_t resend_threads, size_t shard_number) {
   if (timeout <= 0) {
     return false;
   }
-  if (!timer_.Init(timeout)) {
+  if (!shards_.empty()) {
+    return true;
+  }
+  if (!InitShards(shard_number)) {
     return false;
   }
   timeout_ = timeout;
-  auto thread_proc = std::bind(&MessageQueue::CheckTimeout, this);
-  check_thread_.reset(new std::thread(thread_proc));
+  if (!ReplayJournal()) {
+    shards_.clear();
+    timeout_ = 0;
+    return false;
+  }
+  if (resend_threads != 0 && !resend_pool_.Init(resend_threads)) {
+    journal_.Uninit();
+    shards_.clear();
+    timeout_ = 0;
+    return false;
+  }
+  for (auto& shard : shards_) {
+    auto thread_proc = std::bind(&MessageQueue::CheckTimeout, this, std::ref(*shard));
+    shard->check_thread.reset(new std::thread(thread_proc));
+  }
   return true;
 }
 
-bool MessageQueue::Push(std::function<bool (Index, bool)>&& sender) {
-  auto index = queue_indexer_.CreateIndex();
+bool MessageQueue::Init(int timeout, EventLoop& event_loop, size_t resend_threads, size_t shard_number) {
+  if (timeout <= 0) {
+    return false;
+  }
+  if (!shards_.empty()) {
+    return true;
+  }
+  if (!InitShards(shard_number)) {
+    return false;
+  }
+  timeout_ = timeout;
+  if (!ReplayJournal()) {
+    shards_.clear();
+    timeout_ = 0;
+    return false;
+  }
+  if (resend_threads != 0 && !resend_pool_.Init(resend_threads)) {
+    journal_.Uninit();
+    shards_.clear();
+    timeout_ = 0;
+    return false;
+  }
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    if (!event_loop.AddTimer(shards_[i]->timer, std::bind(&MessageQueue::ResendTimeout, this, std::ref(*shards_[i])))) {
+      while (i-- != 0) {
+        event_loop.RemoveTimer(shards_[i]->timer);
+      }
+      resend_pool_.Uninit();
+      journal_.Uninit();
+      shards_.clear();
+      timeout_ = 0;
+      return false;
+    }
+  }
+  event_loop_ = &event_loop;
+  return true;
+}
+
+bool MessageQueue::SetJournal(const JournalConfig& journal_config, PayloadSender&& payload_sender) {
+  if (!shards_.empty() || journal_config.path.empty() || payload_sender == nullptr) {
+    return false;
+  }
+  journal_config_ = journal_config;
+  payload_sender_ = std::move(payload_sender);
+  return true;
+}
+
+bool MessageQueue::SetWindow(const WindowConfig& window_config) {
+  if (!shards_.empty() || window_config.low_watermark < 0.0 || window_config.low_watermark > 1.0 ||
+      window_config.block_timeout < std::chrono::milliseconds::zero()) {
+    return false;
+  }
+  window_config_ = window_config;
+  return true;
+}
+
+bool MessageQueue::Push(MessageSender&& sender, const RetryPolicy& retry_policy, size_t size) {
+  if (shards_.empty()) {
+    LOG(kError, "message queue is not initialized.");
+    return false;
+  }
+  if (!IsValidRetryPolicy(retry_policy)) {
+    LOG(kError, "invalid message queue retry policy.");
+    return false;
+  }
+  if (!AcquireWindow(1, size)) {
+    return false;
+  }
+  auto& shard = *shards_[GetThreadShard()];
+  shard.task_queue_lock.lock();
+  auto index = CreateIndex(shard);
   if (index == kInvalidIndex) {
+    shard.task_queue_lock.unlock();
+    ReleaseWindow(1, size);
+    NotifyWindow();
     LOG(kError, "no useful message queue index.");
     return false;
   }
-  auto resender = std::bind(sender, std::placeholders::_1, true);
-  std::unique_ptr<MessageResender> new_msg_resender(new MessageResender(std::move(resender)));
-  new_msg_resender->set_resend_time(time(nullptr) + timeout_);
-  task_queue_lock_.lock();
-  task_queue_.insert(std::make_pair(index, std::move(new_msg_resender)));
-  task_queue_lock_.unlock();
-  if (!sender(index, false)) {
-    Pop(index);
+  auto resender = AllocResender(shard);
+  resender->set_index(index);
+  resender->set_size(size);
+  resender->sender() = std::move(sender);
+  resender->retry_policy() = retry_policy;
+  // out of the heap until sent, a pop meanwhile leaves it to be freed here
+  InsertResender(shard, resender);
+  shard.task_queue_lock.unlock();
+  auto sent = resender->sender()(index, false);
+  shard.task_queue_lock.lock();
+  RequeueResender(shard, resender, sent);
+  shard.task_queue_lock.unlock();
+  NotifyWindow();
+  return sent;
+}
+
+bool MessageQueue::Push(std::vector<MessageSender>&& senders, const RetryPolicy& retry_policy, size_t size) {
+  if (shards_.empty()) {
+    LOG(kError, "message queue is not initialized.");
     return false;
   }
-  return true;
+  if (!IsValidRetryPolicy(retry_policy)) {
+    LOG(kError, "invalid message queue retry policy.");
+    return false;
+  }
+  if (!AcquireWindow(senders.size(), senders.size() * size)) {
+    return false;
+  }
+  // the whole batch goes to one shard
+  auto& shard = *shards_[GetThreadShard()];
+  std::vector<MessageResender*> new_resenders;
+  new_resenders.reserve(senders.size());
+  shard.task_queue_lock.lock();
+  if (senders.size() > shard.max_index - shard.min_index + 1 - shard.resender_count) {
+    shard.task_queue_lock.unlock();
+    ReleaseWindow(senders.size(), senders.size() * size);
+    NotifyWindow();
+    LOG(kError, "no useful message queue index.");
+    return false;
+  }
+  for (auto& sender : senders) {
+    auto resender = AllocResender(shard);
+    resender->set_index(CreateIndex(shard));
+    resender->set_size(size);
+    resender->sender() = std::move(sender);
+    resender->retry_policy() = retry_policy;
+    InsertResender(shard, resender);
+    new_resenders.push_back(resender);
+  }
+  shard.task_queue_lock.unlock();
+  std::vector<char> sent(new_resenders.size());
+  for (size_t i = 0; i < new_resenders.size(); ++i) {
+    sent[i] = new_resenders[i]->sender()(new_resenders[i]->index(), false);
+  }
+  auto all_sent = true;
+  shard.task_queue_lock.lock();
+  for (size_t i = 0; i < new_resenders.size(); ++i) {
+    RequeueResender(shard, new_resenders[i], sent[i] != 0);
+    all_sent = all_sent && sent[i] != 0;
+  }
+  shard.task_queue_lock.unlock();
+  NotifyWindow();
+  return all_sent;
+}
+
+bool MessageQueue::Push(std::vector<std::function<bool (Index, bool)>>&& senders, const RetryPolicy& retry_policy, size_t size) {
+  std::vector<MessageSender> inline_senders;
+  inline_senders.reserve(senders.size());
+  for (auto& sender : senders) {
+    inline_senders.emplace_back(std::move(sender));
+  }
+  return Push(std::move(inline_senders), retry_policy, size);
+}
+
+bool MessageQueue::Push(const char* data, size_t length, const RetryPolicy& retry_policy) {
+  if (shards_.empty() || !journal_.is_open()) {
+    LOG(kError, "message queue journal is not initialized.");
+    return false;
+  }
+  if (!IsValidRetryPolicy(retry_policy)) {
+    LOG(kError, "invalid message queue retry policy.");
+    return false;
+  }
+  if (!AcquireWindow(1, length)) {
+    return false;
+  }
+  auto& shard = *shards_[GetThreadShard()];
+  std::string payload(data, length);
+  shard.task_queue_lock.lock();
+  auto index = CreateIndex(shard);
+  if (index == kInvalidIndex) {
+    shard.task_queue_lock.unlock();
+    ReleaseWindow(1, length);
+    NotifyWindow();
+    LOG(kError, "no useful message queue index.");
+    return false;
+  }
+  // journaled under the shard lock, so its ack can only come after it
+  auto position = journal_.AppendMessage(index, data, length);
+  if (position == 0) {
+    shard.task_queue_lock.unlock();
+    ReleaseWindow(1, length);
+    NotifyWindow();
+    LOG(kError, "fail to journal message.");
+    return false;
+  }
+  auto resender = AllocResender(shard);
+  resender->set_index(index);
+  resender->set_size(length);
+  SetPayload(resender, std::move(payload));
+  resender->retry_policy() = retry_policy;
+  InsertResender(shard, resender);
+  shard.task_queue_lock.unlock();
+  auto sent = (!journal_config_.wait_commit || journal_.WaitCommit(position)) && resender->sender()(index, false);
+  shard.task_queue_lock.lock();
+  RequeueResender(shard, resender, sent);
+  shard.task_queue_lock.unlock();
+  NotifyWindow();
+  return sent;
 }
 
 void MessageQueue::Pop(Index index) {
-  task_queue_lock_.lock();
-  auto find_resender = task_queue_.find(index);
-  if (find_resender != task_queue_.end()) {
-    task_queue_.erase(find_resender);
-    task_queue_lock_.unlock();
-    queue_indexer_.DestroyIndex(index);
-  } else {
-    task_queue_lock_.unlock();
+  auto shard = FindShard(index);
+  if (shard == nullptr) {
+    return;
+  }
+  shard->task_queue_lock.lock();
+  auto resender = FindResender(*shard, index);
+  if (resender != nullptr) {
+    PopResender(*shard, resender);
   }
+  shard->task_queue_lock.unlock();
+  NotifyWindow();
 }
 
 void MessageQueue::Pop(const std::vector<Index>& batch_index) {
-  task_queue_lock_.lock();
-  std::for_each(batch_index.begin(), batch_index.end(), [this](Index index) { task_queue_.erase(index); });
-  task_queue_lock_.unlock();
-  queue_indexer_.DestroyIndex(batch_index);
+  // one lock for the indices of each shard
+  for (auto& shard : shards_) {
+    std::unique_lock<std::mutex> lock(shard->task_queue_lock, std::defer_lock);
+    for (auto index : batch_index) {
+      if (FindShard(index) != shard.get()) {
+        continue;
+      }
+      if (!lock.owns_lock()) {
+        lock.lock();
+      }
+      auto resender = FindResender(*shard, index);
+      if (resender != nullptr) {
+        PopResender(*shard, resender);
+      }
+    }
+  }
+  NotifyWindow();
 }
 
 void MessageQueue::Uninit() {
-  timer_.Uninit();
-  if (check_thread_ != nullptr) {
-    check_thread_->join();
-    check_thread_ = nullptr;
-  }
-  task_queue_lock_.lock();
-  task_queue_.clear();
-  task_queue_lock_.unlock();
-  queue_indexer_.Clear();
+  if (event_loop_ != nullptr) {
+    for (auto& shard : shards_) {
+      event_loop_->RemoveTimer(shard->timer);
+    }
+    event_loop_ = nullptr;
+  }
+  for (auto& shard : shards_) {
+    shard->timer.Uninit();
+  }
+  for (auto& shard : shards_) {
+    if (shard->check_thread != nullptr) {
+      shard->check_thread->join();
+      shard->check_thread = nullptr;
+    }
+  }
+  // the resends in flight finish first
+  resend_pool_.Uninit();
+  journal_.Uninit();
+  shards_.clear();
+  shard_index_bits_ = 32;
   timeout_ = 0;
+  window_messages_ = 0;
+  window_bytes_ = 0;
+  window_full_ = false;
 }
 
-bool MessageQueue::CheckTimeout() {
+bool MessageQueue::InitShards(size_t shard_number) {
+  if (shard_number == 0 || shard_number > kMaxShardNumber) {
+    return false;
+  }
+  size_t shard_bits = 0;
+  while ((1ULL << shard_bits) < shard_number) {
+    ++shard_bits;
+  }
+  shard_index_bits_ = 32 - shard_bits;
+  for (size_t i = 0; i < shard_number; ++i) {
+    auto min_index = static_cast<Index>(std::max<unsigned long long>(i << shard_index_bits_, 1));
+    auto max_index = static_cast<Index>(((i + 1ULL) << shard_index_bits_) - 1);
+    shards_.emplace_back(new Shard(min_index, max_index));
+    // armed for the first resend by Push
+    if (!shards_.back()->timer.Init()) {
+      shards_.clear();
+      shard_index_bits_ = 32;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool MessageQueue::ReplayJournal() {
+  if (journal_config_.path.empty()) {
+    return true;
+  }
+  std::unordered_map<Index, std::string> messages;
+  if (!journal_.Init(journal_config_, messages)) {
+    LOG(kError, "fail to init message queue journal.");
+    return false;
+  }
+  std::vector<char> replayed(shards_.size());
+  size_t replayed_bytes = 0;
+  std::vector<std::pair<const Index, std::string>*> moved_messages;
+  auto now_time = Timer::Clock::now();
+  for (auto& message : messages) {
+    auto shard = FindShard(message.first);
+    if (shard == nullptr) {
+      // journaled with more shards, queued under a new index once the others are in
+      moved_messages.push_back(&message);
+      continue;
+    }
+    auto shard_number = static_cast<size_t>(static_cast<unsigned long long>(GetSlot(message.first)) >> shard_index_bits_);
+    // new indices go after the replayed ones
+    if (replayed[shard_number] == 0 || message.first > shard->next_index) {
+      shard->next_index = message.first;
+    }
+    replayed[shard_number] = 1;
+    auto resender = AllocResender(*shard);
+    resender->set_index(message.first);
+    resender->set_size(message.second.size());
+    replayed_bytes += message.second.size();
+    SetPayload(resender, std::move(message.second));
+    ScheduleResend(*resender, now_time);
+    InsertResender(*shard, resender);
+    PushResendHeap(*shard, resender);
+  }
+  auto& first_shard = *shards_[0];
+  for (auto message : moved_messages) {
+    auto index = CreateIndex(first_shard);
+    if (index == kInvalidIndex || journal_.AppendMessage(index, message->second.data(), message->second.size()) == 0) {
+      LOG(kError, "fail to replay message queue journal.");
+      journal_.Uninit();
+      return false;
+    }
+    journal_.AppendAck(message->first);
+    auto resender = AllocResender(first_shard);
+    resender->set_index(index);
+    resender->set_size(message->second.size());
+    replayed_bytes += message->second.size();
+    SetPayload(resender, std::move(message->second));
+    ScheduleResend(*resender, now_time);
+    InsertResender(first_shard, resender);
+    PushResendHeap(first_shard, resender);
+  }
+  // the replayed messages are in flight even beyond the limits
+  if (HasWindow()) {
+    window_messages_ += messages.size();
+    window_bytes_ += replayed_bytes;
+  }
+  for (auto& shard : shards_) {
+    ArmResendTimer(*shard);
+  }
+  return true;
+}
+
+void MessageQueue::SetPayload(MessageResender* resender, std::string&& payload) {
+  resender->payload() = std::move(payload);
+  resender->set_journaled(true);
+  resender->sender() = [this, resender](Index index, bool resend) {
+    return payload_sender_(index, resender->payload(), resend);
+  };
+}
+
+size_t MessageQueue::GetThreadShard() {
+  static std::atomic<size_t> next_shard(0);
+  static thread_local size_t thread_shard = next_shard.fetch_add(1, std::memory_order_relaxed);
+  return thread_shard % shards_.size();
+}
+
+MessageQueue::Shard* MessageQueue::FindShard(Index index) {
+  auto shard_number = static_cast<size_t>(static_cast<unsigned long long>(GetSlot(index)) >> shard_index_bits_);
+  if (GetSlot(index) == kInvalidIndex || shard_number >= shards_.size()) {
+    return nullptr;
+  }
+  return shards_[shard_number].get();
+}
+
+bool MessageQueue::CheckTimeout(Shard& shard) {
   while (true) {
-    if (!timer_.Wait()) {
+    if (!shard.timer.Wait()) {
       LOG(kError, "fail to wait message queue timer.");
       return false;
     }
-    auto next_timeout = timeout_;
-    std::vector<Index> to_destroy_index;
-    task_queue_lock_.lock();
-    auto now_time = time(nullptr);
-    auto current_task = task_queue_.begin();
-    while (current_task != task_queue_.end()) {
-      const auto& index = current_task->first;
-      auto& resender = current_task->second;
-      auto current_task_timeout = resender->resend_time() - now_time;
-      if (current_task_timeout > 0) {
-        if (current_task_timeout < next_timeout) {
-          next_timeout = static_cast<int>(current_task_timeout);
-        }
-        ++current_task;
-        continue;
+    ResendTimeout(shard);
+  }
+  return true;
+}
+
+void MessageQueue::ResendTimeout(Shard& shard) {
+  std::vector<MessageResender*> timeout_resenders;
+  std::vector<MessageResender*> expired_resenders;
+  shard.task_queue_lock.lock();
+  // the timer fired, whatever it was armed for
+  shard.armed_time = Timer::Clock::time_point::max();
+  auto now_time = Timer::Clock::now();
+  // only the timed out messages are visited, they leave the heap until resent
+  while (!shard.resend_heap.empty() && shard.resend_heap.front()->resend_time() <= now_time) {
+    auto resender = shard.resend_heap.front();
+    RemoveResendHeap(shard, resender);
+    auto max_attempts = resender->retry_policy().max_attempts;
+    if (max_attempts != 0 && resender->attempts() >= max_attempts) {
+      // the last resend got no answer either, give up
+      expired_resenders.push_back(resender);
+    } else {
+      timeout_resenders.push_back(resender);
+    }
+  }
+  ArmResendTimer(shard);
+  shard.task_queue_lock.unlock();
+  if (!expired_resenders.empty()) {
+    // still queued while the callback runs, so the index is not reused
+    for (auto resender : expired_resenders) {
+      auto& on_expire = resender->retry_policy().on_expire;
+      if (on_expire != nullptr) {
+        on_expire(resender->index());
       }
-      if (resender->resender()(index)) {
-        resender->set_resend_time(now_time + timeout_);
-        ++current_task;
-      } else {
-        current_task = task_queue_.erase(current_task);
-        to_destroy_index.push_back(index);
+    }
+    shard.task_queue_lock.lock();
+    for (auto resender : expired_resenders) {
+      if (FindResender(shard, resender->index()) == resender) {
+        EraseResender(shard, resender->index());
+        if (resender->journaled()) {
+          journal_.AppendAck(resender->index());
+        }
       }
+      FreeResender(shard, resender);
+    }
+    shard.task_queue_lock.unlock();
+    NotifyWindow();
+  }
+  for (auto resender : timeout_resenders) {
+    if (resend_pool_.size() == 0 || !resend_pool_.Post([this, resender] { ResendMessage(resender); })) {
+      ResendMessage(resender);
     }
-    task_queue_lock_.unlock();
-    timer_.ResetTimer(next_timeout);
-    queue_indexer_.DestroyIndex(to_destroy_index);
+  }
+}
+
+void MessageQueue::ResendMessage(MessageResender* resender) {
+  auto index = resender->index();
+  auto resent = resender->sender()(index, true);
+  auto& shard = *FindShard(index);
+  shard.task_queue_lock.lock();
+  if (resent) {
+    resender->set_attempts(resender->attempts() + 1);
+  }
+  RequeueResender(shard, resender, resent);
+  shard.task_queue_lock.unlock();
+  NotifyWindow();
+}
+
+bool MessageQueue::AcquireWindow(size_t messages, size_t bytes) {
+  if (!HasWindow()) {
+    return true;
+  }
+  if ((window_config_.max_messages != 0 && messages > window_config_.max_messages) ||
+      (window_config_.max_bytes != 0 && bytes > window_config_.max_bytes)) {
+    LOG(kError, "message is larger than the message queue window.");
+    return false;
+  }
+  if (TryAcquireWindow(messages, bytes)) {
+    return true;
+  }
+  // set before trying again, so a release after the try sees it
+  window_full_ = true;
+  auto acquired = TryAcquireWindow(messages, bytes);
+  if (!acquired && window_config_.block_timeout > std::chrono::milliseconds::zero()) {
+    ++window_waiters_;
+    std::unique_lock<std::mutex> lock(window_lock_);
+    acquired = window_cond_.wait_for(lock, window_config_.block_timeout, [this, messages, bytes] {
+      return TryAcquireWindow(messages, bytes);
+    });
+    lock.unlock();
+    --window_waiters_;
+  }
+  if (!acquired && window_config_.on_full != nullptr) {
+    window_config_.on_full(window_messages_.load(), window_bytes_.load());
+  }
+  return acquired;
+}
+
+bool MessageQueue::TryAcquireWindow(size_t messages, size_t bytes) {
+  if (!AddBelowLimit(window_messages_, messages, window_config_.max_messages)) {
+    return false;
+  }
+  if (!AddBelowLimit(window_bytes_, bytes, window_config_.max_bytes)) {
+    // a push that saw the messages taken meanwhile is woken without the
+    // lock, at worst it waits for the next release
+    window_messages_ -= messages;
+    if (window_waiters_ != 0) {
+      window_cond_.notify_all();
+    }
+    return false;
   }
   return true;
 }
 
+void MessageQueue::ReleaseWindow(size_t messages, size_t bytes) {
+  if (HasWindow()) {
+    window_messages_ -= messages;
+    window_bytes_ -= bytes;
+  }
+}
+
+void MessageQueue::NotifyWindow() {
+  if (!HasWindow()) {
+    return;
+  }
+  if (window_waiters_ != 0) {
+    // taken so a push between its try and its wait does not miss the release
+    window_lock_.lock();
+    window_lock_.unlock();
+    window_cond_.notify_all();
+  }
+  if (!window_full_) {
+    return;
+  }
+  auto low_messages = static_cast<size_t>(window_config_.max_messages * window_config_.low_watermark);
+  auto low_bytes = static_cast<size_t>(window_config_.max_bytes * window_config_.low_watermark);
+  if (window_messages_ > low_messages && window_config_.max_messages != 0) {
+    return;
+  }
+  if (window_bytes_ > low_bytes && window_config_.max_bytes != 0) {
+    return;
+  }
+  // only one of the threads that drained it calls back
+  if (window_full_.exchange(false) && window_config_.on_low_watermark != nullptr) {
+    window_config_.on_low_watermark();
+  }
+}
+
+Index MessageQueue::CreateIndex(Shard& shard) {
+  if (shard.resender_count > shard.max_index - shard.min_index) {
+    return kInvalidIndex;
+  }
+  // a queued slot is only met again after the counter wrapped, the slots
+  // of the next round have the next round above them
+  do {
+    auto slot = GetSlot(shard.next_index);
+    if (slot == shard.max_index) {
+      shard.next_index = static_cast<Index>(shard.next_index - slot + kIndexRound + shard.min_index);
+    } else {
+      ++shard.next_index;
+    }
+  } while (FindSlot(shard, shard.next_index) != nullptr);
+  return shard.next_index;
+}
+
+MessageQueue::MessageResender* MessageQueue::AllocResender(Shard& shard) {
+  if (shard.free_resender == nullptr) {
+    std::unique_ptr<MessageResender[]> block(new MessageResender[kResenderBlockSize]);
+    for (size_t i = 0; i < kResenderBlockSize; ++i) {
+      block[i].set_next_free(shard.free_resender);
+      shard.free_resender = &block[i];
+    }
+    shard.resender_blocks.push_back(std::move(block));
+  }
+  auto resender = shard.free_resender;
+  shard.free_resender = resender->next_free();
+  return resender;
+}
+
+void MessageQueue::FreeResender(Shard& shard, MessageResender* resender) {
+  // drop the captures now, not when the resender is reused
+  resender->sender() = nullptr;
+  resender->retry_policy().on_expire = nullptr;
+  std::string().swap(resender->payload());
+  ReleaseWindow(1, resender->size());
+  resender->set_size(0);
+  resender->set_journaled(false);
+  resender->set_attempts(0);
+  resender->set_index(kInvalidIndex);
+  resender->set_next_free(shard.free_resender);
+  shard.free_resender = resender;
+}
+
+MessageQueue::MessageResender* MessageQueue::FindResender(Shard& shard, Index index) {
+  auto resender = FindSlot(shard, index);
+  return resender != nullptr && resender->index() == index ? resender : nullptr;
+}
+
+MessageQueue::MessageResender* MessageQueue::FindSlot(Shard& shard, Index index) {
+  auto& table = shard.resender_table;
+  if (table.empty()) {
+    return nullptr;
+  }
+  auto mask = table.size() - 1;
+  for (auto position = HashIndex(index, mask); table[position] != nullptr; position = (position + 1) & mask) {
+    if (GetSlot(table[position]->index()) == GetSlot(index)) {
+      return table[position];
+    }
+  }
+  return nullptr;
+}
+
+// Linear probing, the table is at most half full
+void MessageQueue::InsertResender(Shard& shard, MessageResender* resender) {
+  auto& table = shard.resender_table;
+  if ((shard.resender_count + 1) * 2 > table.size()) {
+    std::vector<MessageResender*> old_table(table.empty() ? kMinResenderTableSize : table.size() * 2, nullptr);
+    old_table.swap(table);
+    for (auto old_resender : old_table) {
+      if (old_resender != nullptr) {
+        auto position = HashIndex(old_resender->index(), table.size() - 1);
+        while (table[position] != nullptr) {
+          position = (position + 1) & (table.size() - 1);
+        }
+        table[position] = old_resender;
+      }
+    }
+  }
+  auto mask = table.size() - 1;
+  auto position = HashIndex(resender->index(), mask);
+  while (table[position] != nullptr) {
+    position = (position + 1) & mask;
+  }
+  table[position] = resender;
+  ++shard.resender_count;
+}
+
+// Move the later entries of the probe run back into the hole, no tombstones
+void MessageQueue::EraseResender(Shard& shard, Index index) {
+  auto& table = shard.resender_table;
+  if (table.empty()) {
+    return;
+  }
+  auto mask = table.size() - 1;
+  auto position = HashIndex(index, mask);
+  while (table[position] != nullptr && table[position]->index() != index) {
+    position = (position + 1) & mask;
+  }
+  if (table[position] == nullptr) {
+    return;
+  }
+  for (auto next = (position + 1) & mask; table[next] != nullptr; next = (next + 1) & mask) {
+    auto home = HashIndex(table[next]->index(), mask);
+    if (((next - home) & mask) >= ((next - position) & mask)) {
+      table[position] = table[next];
+      position = next;
+    }
+  }
+  table[position] = nullptr;
+  --shard.resender_count;
+}
+
+void MessageQueue::PopResender(Shard& shard, MessageResender* resender) {
+  EraseResender(shard, resender->index());
+  if (resender->journaled()) {
+    journal_.AppendAck(resender->index());
+  }
+  if (resender->heap_position() != MessageResender::kNotInHeap) {
+    RemoveResendHeap(shard, resender);
+    FreeResender(shard, resender);
+  }
+}
+
+void MessageQueue::RequeueResender(Shard& shard, MessageResender* resender, bool sent) {
+  // popped while being sent, the index may be another message's by now
+  if (FindResender(shard, resender->index()) != resender) {
+    FreeResender(shard, resender);
+    return;
+  }
+  if (sent) {
+    ScheduleResend(*resender, Timer::Clock::now());
+    PushResendHeap(shard, resender);
+    ArmResendTimer(shard);
+    return;
+  }
+  EraseResender(shard, resender->index());
+  if (resender->journaled()) {
+    journal_.AppendAck(resender->index());
+  }
+  FreeResender(shard, resender);
+}
+
+void MessageQueue::ScheduleResend(MessageResender& resender, const Timer::Clock::time_point& now) {
+  const auto& retry_policy = resender.retry_policy();
+  std::chrono::milliseconds interval;
+  if (resender.attempts() == 0) {
+    interval = retry_policy.initial_delay;
+    if (interval <= std::chrono::milliseconds::zero()) {
+      interval = std::chrono::seconds(timeout_);
+    }
+  } else {
+    // kept far below the overflow of the clock when nothing caps it
+    auto next_interval = std::min(resender.interval().count() * retry_policy.multiplier, 1e12);
+    interval = std::chrono::milliseconds(static_cast<std::chrono::milliseconds::rep>(next_interval));
+  }
+  if (retry_policy.max_interval > std::chrono::milliseconds::zero()) {
+    interval = std::min(interval, retry_policy.max_interval);
+  }
+  resender.set_interval(interval);
+  resender.set_resend_time(now + AddJitter(interval, retry_policy.jitter));
+}
+
+void MessageQueue::ArmResendTimer(Shard& shard) {
+  if (shard.resend_heap.empty()) {
+    return;
+  }
+  // the timer stays armed for an earlier time, waking early finds nothing due
+  auto resend_time = shard.resend_heap.front()->resend_time();
+  if (resend_time < shard.armed_time) {
+    shard.timer.SetDeadline(resend_time);
+    shard.armed_time = resend_time;
+  }
+}
+
+void MessageQueue::PushResendHeap(Shard& shard, MessageResender* resender) {
+  auto& resend_heap = shard.resend_heap;
+  resender->set_heap_position(resend_heap.size());
+  resend_heap.push_back(resender);
+  UpdateResendHeap(shard, resend_heap.size() - 1);
+}
+
+void MessageQueue::RemoveResendHeap(Shard& shard, MessageResender* resender) {
+  auto position = resender->heap_position();
+  if (position == MessageResender::kNotInHeap) {
+    return;
+  }
+  auto& resend_heap = shard.resend_heap;
+  resender->set_heap_position(MessageResender::kNotInHeap);
+  auto last_resender = resend_heap.back();
+  resend_heap.pop_back();
+  if (position < resend_heap.size()) {
+    resend_heap[position] = last_resender;
+    last_resender->set_heap_position(position);
+    UpdateResendHeap(shard, position);
+  }
+}
+
+// Move the resender at position up or down after its resend time changed
+void MessageQueue::UpdateResendHeap(Shard& shard, size_t position) {
+  auto& resend_heap = shard.resend_heap;
+  auto resender = resend_heap[position];
+  while (position > 0) {
+    auto parent = (position - 1) / 2;
+    if (resend_heap[parent]->resend_time() <= resender->resend_time()) {
+      break;
+    }
+    resend_heap[position] = resend_heap[parent];
+    resend_heap[position]->set_heap_position(position);
+    position = parent;
+  }
+  while (true) {
+    auto child = position * 2 + 1;
+    if (child >= resend_heap.size()) {
+      break;
+    }
+    if (child + 1 < resend_heap.size() && resend_heap[child + 1]->resend_time() < resend_heap[child]->resend_time()) {
+      ++child;
+    }
+    if (resender->resend_time() <= resend_heap[child]->resend_time()) {
+      break;
+    }
+    resend_heap[position] = resend_heap[child];
+    resend_heap[position]->set_heap_position(position);
+    position = child;
+  }
+  resend_heap[position] = resender;
+  resender->set_heap_position(position);
+}
+
 } // namespace utility
\ No newline at end of file
@@ -7,50 +7,258 @@
 #ifndef UTILITY_MESSAGE_QUEUE_H_
 #define UTILITY_MESSAGE_QUEUE_H_
 
+#include "event_loop.h"
+#include "thread_pool.h"
 #include "timer.h"
 #include "indexer.h"
+#include "inline_function.h"
+#include "message_journal.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
-#include <unordered_map>
+#include <vector>
 #include <time.h>
 
 namespace utility {
 
+// Called with the index of a message that expired. Captures of up to 32
+// bytes are kept inline, so a push copies it without allocating.
+typedef InlineFunction<void (Index), 32, true> ExpireHandler;
+
+// When a message is resent until it is popped. The first resend is
+// initial_delay after the send, every later interval is the last one times
+// multiplier up to max_interval, and each is moved by a random fraction of
+// up to jitter either way so messages sent together spread out. Push
+// rejects a policy with a negative interval, a multiplier below 1.0 or a
+// jitter out of 0.0 to 1.0.
+struct RetryPolicy {
+  RetryPolicy()
+      : initial_delay(0),
+        multiplier(1.0),
+        max_interval(0),
+        max_attempts(0),
+        jitter(0.0) {}
+
+  std::chrono::milliseconds initial_delay;  // 0 is the timeout of the queue
+  double multiplier;
+  std::chrono::milliseconds max_interval;   // 0 is unlimited
+  unsigned int max_attempts;                // resends before giving up, 0 never gives up
+  double jitter;                            // 0.0 to 1.0
+  // called when the interval after the last resend passed without a pop,
+  // not when a sender returns false
+  ExpireHandler on_expire;
+};
+
+// How many messages and payload bytes may be in flight, from the push
+// until the pop or the expiry. A push that finds no room waits up to
+// block_timeout for a pop, then fails and calls on_full. Once a window
+// that was full drained to low_watermark of both limits, on_low_watermark
+// is called, so a producer can slow down and pick up again.
+struct WindowConfig {
+  WindowConfig()
+      : max_messages(0),
+        max_bytes(0),
+        low_watermark(0.5),
+        block_timeout(0) {}
+
+  size_t max_messages;                      // 0 is unlimited
+  size_t max_bytes;                         // 0 is unlimited
+  double low_watermark;                     // 0.0 to 1.0
+  std::chrono::milliseconds block_timeout;  // 0 fails at once
+  // called with the messages and bytes in flight, never under a lock
+  std::function<void (size_t, size_t)> on_full;
+  std::function<void ()> on_low_watermark;
+};
+
+// Called with the index and false when pushed, with true for every resend.
+// Captures of up to 64 bytes are kept inline, larger ones are allocated.
+typedef InlineFunction<bool (Index, bool), 64> MessageSender;
+// Sends a message pushed as a payload
+typedef std::function<bool (Index, const std::string&, bool)> PayloadSender;
+
 class MessageQueue : public Uncopyable {
  public:
   MessageQueue();
   ~MessageQueue();
 
-  bool Init(int timeout);
-  bool Push(std::function<bool (Index, bool)>&& sender);
+  // Timed out messages are resent on resend_threads threads, 0 resends
+  // them one by one where the timeouts are checked, never under the lock.
+  // The messages are split over shard_number shards with a lock, indices
+  // and a timeout check each, a thread always pushes to the same shard and
+  // the top bits of an index tell which one it is in.
+  bool Init(int timeout, size_t resend_threads = 0, size_t shard_number = 1);
+  // Check the timeouts on event_loop instead of threads of their own
+  bool Init(int timeout, EventLoop& event_loop, size_t resend_threads = 0, size_t shard_number = 1);
+  // Before Init. The messages pushed as payloads are kept in the journal
+  // until popped, Init replays it and the messages left by the last run are
+  // resent after the timeout with the default retry policy, by index when
+  // the shard number is the same.
+  bool SetJournal(const JournalConfig& journal_config, PayloadSender&& payload_sender);
+  // Before Init. Bound the messages in flight, the replayed ones count too.
+  bool SetWindow(const WindowConfig& window_config);
+  // Once the pools of the shard have grown, a push and pop allocate nothing.
+  // size is what the message counts against max_bytes.
+  bool Push(MessageSender&& sender, const RetryPolicy& retry_policy = RetryPolicy(), size_t size = 0);
+  // Queue the batch under one lock and send it in order, false when any
+  // message was not sent, those are popped again. The window must have room
+  // for the whole batch, size is of each message.
+  bool Push(std::vector<MessageSender>&& senders, const RetryPolicy& retry_policy = RetryPolicy(), size_t size = 0);
+  bool Push(std::vector<std::function<bool (Index, bool)>>&& senders, const RetryPolicy& retry_policy = RetryPolicy(), size_t size = 0);
+  // Journal the payload and send it once the journal is on the disk, the
+  // pushes of all threads meanwhile are synced together
+  bool Push(const char* data, size_t length, const RetryPolicy& retry_policy = RetryPolicy());
+  // An index of a message that already left is ignored. Where Index has 64
+  // bits it carries the round of its slot, so it stays ignored after the
+  // slot was reused, with 32 bits only until the slots of the shard wrapped.
   void Pop(Index index);
   void Pop(const std::vector<Index>& batch_index);
   void Uninit();
 
  private:
-  bool CheckTimeout();
+  static const size_t kMaxShardNumber = 256;
+  static const size_t kResenderBlockSize = 256;
+  static const size_t kMinResenderTableSize = 64;
 
- private:
-  class MessageResender {
+  class MessageResender : public Uncopyable {
    public:
-    MessageResender(std::function<bool (Index)>&& resender) : resender_(std::move(resender)) {}
-    const time_t& resend_time() const { return resend_time_; }
-    void set_resend_time(const time_t& resend_time) { resend_time_ = resend_time; }
-    const std::function<bool (Index)>& resender() const { return resender_; }
+    // out of the heap while being resent
+    static const size_t kNotInHeap = static_cast<size_t>(-1);
+
+    MessageResender() : index_(kInvalidIndex), heap_position_(kNotInHeap), attempts_(0), journaled_(false), size_(0), next_free_(nullptr) {}
+    Index index() const { return index_; }
+    void set_index(Index index) { index_ = index; }
+    const Timer::Clock::time_point& resend_time() const { return resend_time_; }
+    void set_resend_time(const Timer::Clock::time_point& resend_time) { resend_time_ = resend_time; }
+    size_t heap_position() const { return heap_position_; }
+    void set_heap_position(size_t heap_position) { heap_position_ = heap_position; }
+    MessageSender& sender() { return sender_; }
+    const RetryPolicy& retry_policy() const { return retry_policy_; }
+    RetryPolicy& retry_policy() { return retry_policy_; }
+    unsigned int attempts() const { return attempts_; }
+    void set_attempts(unsigned int attempts) { attempts_ = attempts; }
+    const std::chrono::milliseconds& interval() const { return interval_; }
+    void set_interval(const std::chrono::milliseconds& interval) { interval_ = interval; }
+    bool journaled() const { return journaled_; }
+    void set_journaled(bool journaled) { journaled_ = journaled; }
+    std::string& payload() { return payload_; }
+    size_t size() const { return size_; }
+    void set_size(size_t size) { size_ = size; }
+    MessageResender* next_free() const { return next_free_; }
+    void set_next_free(MessageResender* next_free) { next_free_ = next_free; }
 
    private:
-    time_t resend_time_;
-    std::function<bool (Index)> resender_;
+    Index index_;
+    Timer::Clock::time_point resend_time_;
+    size_t heap_position_;
+    MessageSender sender_;
+    RetryPolicy retry_policy_;
+    unsigned int attempts_;
+    std::chrono::milliseconds interval_;
+    bool journaled_;
+    std::string payload_;
+    size_t size_;
+    MessageResender* next_free_;
   };
 
+  // Resenders of a shard come from blocks that are kept until Uninit and
+  // are found by index in an open addressing table. A resender out of the
+  // heap belongs to the send, resend or expiry that took it out, Pop only
+  // takes it out of the table then and the owner frees it.
+  struct Shard : public Uncopyable {
+    Shard(Index min_index, Index max_index)
+        : armed_time(Timer::Clock::time_point::max()),
+          min_index(min_index),
+          max_index(max_index),
+          next_index(min_index - 1),
+          resender_count(0),
+          free_resender(nullptr) {}
+
+    Timer timer;
+    Timer::Clock::time_point armed_time;
+    Index min_index;
+    Index max_index;
+    Index next_index;
+    std::vector<MessageResender*> resender_table;
+    size_t resender_count;
+    std::vector<std::unique_ptr<MessageResender[]>> resender_blocks;
+    MessageResender* free_resender;
+    std::vector<MessageResender*> resend_heap;
+    std::mutex task_queue_lock;
+    std::unique_ptr<std::thread> check_thread;
+  };
+
+ private:
+  bool InitShards(size_t shard_number);
+  // Queue the messages the journal kept, called by Init
+  bool ReplayJournal();
+  // Keep the payload in resender and send it with payload_sender_
+  void SetPayload(MessageResender* resender, std::string&& payload);
+  // The shard number of the calling thread
+  size_t GetThreadShard();
+  // nullptr when index is of no shard
+  Shard* FindShard(Index index);
+  bool CheckTimeout(Shard& shard);
+  void ResendTimeout(Shard& shard);
+  // Called with the lock of the shard held. The next index after the last
+  // one that is not queued, kInvalidIndex when every index is.
+  Index CreateIndex(Shard& shard);
+  MessageResender* AllocResender(Shard& shard);
+  void FreeResender(Shard& shard, MessageResender* resender);
+  // nullptr when the index is stale, its slot may hold a later round
+  MessageResender* FindResender(Shard& shard, Index index);
+  // The resender in the slot of index, whatever round it is of
+  MessageResender* FindSlot(Shard& shard, Index index);
+  void InsertResender(Shard& shard, MessageResender* resender);
+  void EraseResender(Shard& shard, Index index);
+  void PopResender(Shard& shard, MessageResender* resender);
+  // Put a message back in the heap after it was sent, free it when it was
+  // popped meanwhile or could not be sent
+  void RequeueResender(Shard& shard, MessageResender* resender, bool sent);
+  // Min heap of the resenders by resend time, so a check only touches the
+  // messages that timed out. Called with the lock of the shard held.
+  void PushResendHeap(Shard& shard, MessageResender* resender);
+  void RemoveResendHeap(Shard& shard, MessageResender* resender);
+  void UpdateResendHeap(Shard& shard, size_t position);
+  // Arm the timer for the top of the heap when it is due before the timer
+  void ArmResendTimer(Shard& shard);
+  // Move the resend time one interval on, the interval grows after a resend
+  void ScheduleResend(MessageResender& resender, const Timer::Clock::time_point& now);
+  // Resend and merge the result back, unless the message was popped meanwhile
+  void ResendMessage(MessageResender* resender);
+  bool HasWindow() const { return window_config_.max_messages != 0 || window_config_.max_bytes != 0; }
+  // Take room for messages of bytes in all, waiting for it as the window
+  // config says. Called without a lock.
+  bool AcquireWindow(size_t messages, size_t bytes);
+  bool TryAcquireWindow(size_t messages, size_t bytes);
+  void ReleaseWindow(size_t messages, size_t bytes);
+  // After the lock of the shard is released, wake the waiting pushes and
+  // tell a window drained to the low watermark
+  void NotifyWindow();
+
  private:
-  Timer timer_;
+  EventLoop* event_loop_;
   int timeout_;
-  Indexer queue_indexer_;
-  std::unordered_map<Index, std::unique_ptr<MessageResender>> task_queue_;
-  std::mutex task_queue_lock_;
-  std::unique_ptr<std::thread> check_thread_;
+  // bits of an index below the shard number
+  size_t shard_index_bits_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  ThreadPool resend_pool_;
+  JournalConfig journal_config_;
+  PayloadSender payload_sender_;
+  MessageJournal journal_;
+  WindowConfig window_config_;
+  std::atomic<size_t> window_messages_;
+  std::atomic<size_t> window_bytes_;
+  // pushes waiting for room, a release only takes window_lock_ for them
+  std::atomic<size_t> window_waiters_;
+  // a push found no room since the last low watermark
+  std::atomic<bool> window_full_;
+  std::mutex window_lock_;
+  std::condition_variable window_cond_;
 };
 
 } // namespace utility
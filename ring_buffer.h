@@ -0,0 +1,122 @@
+/************************************************************************/
+/*  Bounded Lock-free Ring Buffer                                       */
+/*  THREAD: safe                                                        */
+/*  AUTHOR: chen_lu@outlook.com                                         */
+/************************************************************************/
+
+#ifndef UTILITY_RING_BUFFER_H_
+#define UTILITY_RING_BUFFER_H_
+
+#include "uncopyable.h"
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+
+namespace utility {
+
+// Multi-producer multi-consumer bounded queue, every cell carries a sequence
+// number so producers and consumers only contend on one atomic each.
+// Elements are filled and consumed in place, no copy of T is required.
+template <typename T>
+class RingBuffer : public Uncopyable {
+ public:
+  RingBuffer() : mask_(0), push_pos_(0), pop_pos_(0) {}
+
+  // The capacity is rounded up to a power of two
+  bool Init(size_t capacity) {
+    if (capacity < 2 || cells_ != nullptr) {
+      return false;
+    }
+    size_t real_capacity = 1;
+    while (real_capacity < capacity) {
+      real_capacity <<= 1;
+    }
+    cells_.reset(new Cell[real_capacity]);
+    for (size_t i = 0; i < real_capacity; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    mask_ = real_capacity - 1;
+    push_pos_.store(0, std::memory_order_relaxed);
+    pop_pos_.store(0, std::memory_order_relaxed);
+    return true;
+  }
+
+  // fill(T&) is called on the reserved element, returns false when full
+  template <typename Filler>
+  bool TryPush(Filler&& fill) {
+    Cell* cell = nullptr;
+    auto pos = push_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[pos & mask_];
+      auto sequence = cell->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(pos);
+      if (diff == 0) {
+        if (push_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = push_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    fill(cell->data);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // consume(T&) is called on the oldest element, returns false when empty
+  template <typename Consumer>
+  bool TryPop(Consumer&& consume) {
+    Cell* cell = nullptr;
+    auto pos = pop_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[pos & mask_];
+      auto sequence = cell->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(pos + 1);
+      if (diff == 0) {
+        if (pop_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = pop_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    consume(cell->data);
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t capacity() const { return cells_ == nullptr ? 0 : mask_ + 1; }
+
+  // Only a snapshot, other threads may change it at any time
+  size_t size() const {
+    auto push_pos = push_pos_.load(std::memory_order_relaxed);
+    auto pop_pos = pop_pos_.load(std::memory_order_relaxed);
+    return push_pos > pop_pos ? push_pos - pop_pos : 0;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  // keep producers and consumers on different cache lines
+  static const size_t kCacheLineSize = 64;
+
+ private:
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  char push_pad_[kCacheLineSize];
+  std::atomic<size_t> push_pos_;
+  char pop_pad_[kCacheLineSize];
+  std::atomic<size_t> pop_pos_;
+  char end_pad_[kCacheLineSize];
+};
+
+} // namespace utility
+
+#endif // UTILITY_RING_BUFFER_H_
@@ -7,42 +7,105 @@
 #ifndef UTILITY_SINGLETON_H_
 #define UTILITY_SINGLETON_H_
 
+#include <algorithm>
+#include <atomic>
 #include <mutex>
+#include <vector>
 
 namespace utility {
 
+// Singletons in the order they were created, released in reverse order so
+// a singleton that got another one in its constructor is released first
+class SingletonRegistry {
+ public:
+  typedef void (*Releaser)();
+
+  static void Register(Releaser releaser) {
+    std::lock_guard<std::mutex> lock(GetLock());
+    auto& releasers = GetReleasers();
+    releasers.erase(std::remove(releasers.begin(), releasers.end(), releaser), releasers.end());
+    releasers.push_back(releaser);
+  }
+
+  // A singleton created by a destructor on the way is released too
+  static void ReleaseAll() {
+    while (true) {
+      Releaser releaser = nullptr;
+      {
+        std::lock_guard<std::mutex> lock(GetLock());
+        auto& releasers = GetReleasers();
+        if (releasers.empty()) {
+          return;
+        }
+        releaser = releasers.back();
+        releasers.pop_back();
+      }
+      releaser();
+    }
+  }
+
+ private:
+  static std::mutex& GetLock() {
+    static std::mutex lock;
+    return lock;
+  }
+  static std::vector<Releaser>& GetReleasers() {
+    static std::vector<Releaser> releasers;
+    return releasers;
+  }
+};
+
+// Release every singleton, the last created first
+inline void ReleaseSingletons() {
+  SingletonRegistry::ReleaseAll();
+}
+
+// Once the instance exists GetInstance is a single acquire load, the lock
+// is only taken to create it
 template <typename T>
 class Singleton {
  public:
   static T* GetInstance() {
-    std::lock_guard<std::mutex> lock(lock_);
-    if (instance_ == nullptr) {
-      instance_ = new T;
+    auto instance = instance_.load(std::memory_order_acquire);
+    if (instance != nullptr) {
+      return instance;
     }
-    return instance_;
+    return CreateInstance();
   }
+  // Not safe while other threads still use the instance
   static void Release() {
     std::lock_guard<std::mutex> lock(lock_);
-    if (instance_ != nullptr) {
-      delete instance_;
-      instance_ = nullptr;
+    auto instance = instance_.exchange(nullptr, std::memory_order_acq_rel);
+    if (instance != nullptr) {
+      delete instance;
     }
   }
 
  private:
   Singleton() = delete;
 
+  static T* CreateInstance() {
+    std::lock_guard<std::mutex> lock(lock_);
+    auto instance = instance_.load(std::memory_order_relaxed);
+    if (instance == nullptr) {
+      instance = new T;
+      SingletonRegistry::Register(&Singleton<T>::Release);
+      instance_.store(instance, std::memory_order_release);
+    }
+    return instance;
+  }
+
  private:
-  static T* instance_;
+  static std::atomic<T*> instance_;
   static std::mutex lock_;
 };
 
 template <typename T>
-T* Singleton<T>::instance_ = nullptr;
+std::atomic<T*> Singleton<T>::instance_(nullptr);
 
 template <typename T>
 std::mutex Singleton<T>::lock_;
 
 } // namespace utility
 
-#endif	// UTILITY_SINGLETON_H_
\ No newline at end of file
+#endif	// UTILITY_SINGLETON_H_
@@ -0,0 +1,153 @@
+/************************************************************************/
+/*  Slot Map                                                            */
+/*  THREAD: unsafe                                                      */
+/*  AUTHOR: chen_lu@outlook.com                                         */
+/************************************************************************/
+
+#ifndef UTILITY_SLOT_MAP_H_
+#define UTILITY_SLOT_MAP_H_
+
+#include "uncopyable.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+namespace utility {
+
+// A slot and the generation it had when the value was inserted. Erasing a
+// value moves its slot to the next generation, so a stale handle never
+// finds the value inserted into the slot later. Generation 0 is never used.
+struct SlotHandle {
+  uint32_t slot;
+  uint32_t generation;
+
+  // Pack into one integer, to send or to use as a key
+  uint64_t value() const { return static_cast<uint64_t>(generation) << 32 | slot; }
+  static SlotHandle FromValue(uint64_t value) {
+    SlotHandle handle = {static_cast<uint32_t>(value), static_cast<uint32_t>(value >> 32)};
+    return handle;
+  }
+
+  bool operator==(const SlotHandle& other) const { return slot == other.slot && generation == other.generation; }
+  bool operator!=(const SlotHandle& other) const { return !(*this == other); }
+};
+
+const SlotHandle kInvalidSlotHandle = {0, 0};
+
+// Values are stored contiguously and looked up through a slot table,
+// insert, erase and checked lookup are O(1). Erase moves the last value
+// into the hole, so pointers and iterators to values are not stable.
+template <typename T>
+class SlotMap : public Uncopyable {
+ public:
+  typedef typename std::vector<T>::iterator iterator;
+  typedef typename std::vector<T>::const_iterator const_iterator;
+
+  SlotMap() : free_slot_(kNoSlot) {}
+
+  template <typename... Args>
+  SlotHandle Emplace(Args&&... args) {
+    if (free_slot_ == kNoSlot && slots_.size() >= kNoSlot) {
+      return kInvalidSlotHandle;
+    }
+    values_.emplace_back(std::forward<Args>(args)...);
+    uint32_t slot = 0;
+    if (free_slot_ != kNoSlot) {
+      slot = free_slot_;
+      free_slot_ = slots_[slot].position;
+    } else {
+      slot = static_cast<uint32_t>(slots_.size());
+      Slot new_slot = {1, 0};
+      slots_.push_back(new_slot);
+    }
+    slots_[slot].position = static_cast<uint32_t>(values_.size() - 1);
+    value_slots_.push_back(slot);
+    SlotHandle handle = {slot, slots_[slot].generation};
+    return handle;
+  }
+
+  SlotHandle Insert(T&& value) { return Emplace(std::move(value)); }
+  SlotHandle Insert(const T& value) { return Emplace(value); }
+
+  bool Erase(SlotHandle handle) {
+    if (!Contains(handle)) {
+      return false;
+    }
+    auto& slot = slots_[handle.slot];
+    auto position = slot.position;
+    if (position != values_.size() - 1) {
+      values_[position] = std::move(values_.back());
+      value_slots_[position] = value_slots_.back();
+      slots_[value_slots_[position]].position = position;
+    }
+    values_.pop_back();
+    value_slots_.pop_back();
+    slot.generation = slot.generation == kMaxGeneration ? 1 : slot.generation + 1;
+    slot.position = free_slot_;
+    free_slot_ = handle.slot;
+    return true;
+  }
+
+  bool Contains(SlotHandle handle) const {
+    return handle.slot < slots_.size() && handle.generation != 0 &&
+           slots_[handle.slot].generation == handle.generation && IsOccupied(handle.slot);
+  }
+
+  // nullptr when the handle is stale
+  T* Find(SlotHandle handle) { return Contains(handle) ? &values_[slots_[handle.slot].position] : nullptr; }
+  const T* Find(SlotHandle handle) const { return Contains(handle) ? &values_[slots_[handle.slot].position] : nullptr; }
+
+  // Handle of the value at position of the dense storage
+  SlotHandle GetHandle(size_t position) const {
+    auto slot = value_slots_[position];
+    SlotHandle handle = {slot, slots_[slot].generation};
+    return handle;
+  }
+
+  void Reserve(size_t size) {
+    values_.reserve(size);
+    value_slots_.reserve(size);
+    slots_.reserve(size);
+  }
+
+  // Stale handles stay stale, the slots keep their generations
+  void Clear() {
+    while (!values_.empty()) {
+      Erase(GetHandle(values_.size() - 1));
+    }
+  }
+
+  size_t size() const { return values_.size(); }
+  bool empty() const { return values_.empty(); }
+
+  iterator begin() { return values_.begin(); }
+  iterator end() { return values_.end(); }
+  const_iterator begin() const { return values_.begin(); }
+  const_iterator end() const { return values_.end(); }
+
+ private:
+  // position of the value while occupied, next free slot while free
+  struct Slot {
+    uint32_t generation;
+    uint32_t position;
+  };
+
+  static const uint32_t kNoSlot = 0xFFFFFFFF;
+  static const uint32_t kMaxGeneration = 0xFFFFFFFF;
+
+  bool IsOccupied(uint32_t slot) const {
+    auto position = slots_[slot].position;
+    return position < value_slots_.size() && value_slots_[position] == slot;
+  }
+
+ private:
+  std::vector<T> values_;
+  std::vector<uint32_t> value_slots_;
+  std::vector<Slot> slots_;
+  uint32_t free_slot_;
+};
+
+} // namespace utility
+
+#endif // UTILITY_SLOT_MAP_H_
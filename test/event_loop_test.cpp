@@ -0,0 +1,145 @@
+// g++ -std=c++14 -pthread -I.. event_loop_test.cpp ../event_loop.cpp ../log.cpp ../log_format.cpp ../mapped_file.cpp ../timer.cpp ../utility.cpp -lz
+
+#include "test.h"
+#include "../event_loop.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+
+using namespace utility;
+
+// Wait for flag, false on a timeout of a second
+static bool WaitFor(const std::atomic<bool>& flag) {
+  for (int i = 0; i < 1000 && !flag; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return flag;
+}
+
+// Run on the loop thread what was posted before
+static void WaitPosted(EventLoop& event_loop) {
+  std::promise<void> posted_done;
+  auto wait_done = posted_done.get_future();
+  CHECK(event_loop.Post([&posted_done] { posted_done.set_value(); }));
+  wait_done.wait();
+}
+
+// RemoveWatch returns only once a handler running on the loop thread
+// finished, and the handler is not called again
+static void TestRemoveWaitsForHandler() {
+  EventLoop event_loop;
+  CHECK(event_loop.Init());
+  int pipe_fds[2];
+  CHECK(pipe(pipe_fds) == 0);
+  std::atomic<bool> entered(false);
+  std::atomic<bool> finished(false);
+  std::atomic<int> calls(0);
+  CHECK(event_loop.AddWatch(pipe_fds[0], kEventRead, [&](unsigned int events) {
+    CHECK((events & kEventRead) != 0);
+    ++calls;
+    entered = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    finished = true;
+  }));
+  CHECK(!event_loop.AddWatch(pipe_fds[0], kEventRead, [](unsigned int) {}));
+  CHECK(write(pipe_fds[1], "x", 1) == 1);
+  CHECK(WaitFor(entered));
+  CHECK(event_loop.RemoveWatch(pipe_fds[0]));
+  CHECK(finished);
+  // the pipe stays readable, nothing runs for it any more
+  WaitPosted(event_loop);
+  CHECK(calls == 1);
+  CHECK(!event_loop.RemoveWatch(pipe_fds[0]));
+  // removed from its own handler, the later calls stop
+  CHECK(event_loop.AddWatch(pipe_fds[0], kEventRead, [&](unsigned int) {
+    ++calls;
+    event_loop.RemoveWatch(pipe_fds[0]);
+  }));
+  WaitPosted(event_loop);
+  WaitPosted(event_loop);
+  CHECK(calls == 2);
+  event_loop.Uninit();
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+}
+
+// Tasks run on the loop thread in the order posted, from every thread, and
+// what was posted before Uninit still runs
+static void TestPostOrder() {
+  const int kThreads = 4;
+  const int kTasks = 1000;
+  EventLoop event_loop;
+  CHECK(event_loop.Init());
+  std::vector<std::vector<int>> runs(kThreads);
+  std::atomic<bool> in_loop_thread(true);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < kTasks; ++i) {
+        event_loop.Post([&, t, i] {
+          if (!event_loop.IsInLoopThread()) {
+            in_loop_thread = false;
+          }
+          runs[t].push_back(i);
+        });
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  CHECK(!event_loop.IsInLoopThread());
+  event_loop.Uninit();
+  CHECK(in_loop_thread);
+  for (auto& run : runs) {
+    auto in_order = run.size() == kTasks;
+    for (size_t i = 0; in_order && i < run.size(); ++i) {
+      in_order = run[i] == static_cast<int>(i);
+    }
+    CHECK(in_order);
+  }
+  CHECK(!event_loop.Post([] {}));
+}
+
+static bool IsNonBlocking(const Timer& timer) {
+  auto flags = fcntl(timer.handle(), F_GETFL);
+  return flags != -1 && (flags & O_NONBLOCK) != 0;
+}
+
+// AddTimer makes the timer fd non blocking for the loop, RemoveTimer and a
+// failed AddTimer make it block again, so Timer::Wait waits
+static void TestTimerBlocking() {
+  EventLoop event_loop;
+  Timer timer;
+  CHECK(timer.Init());
+  CHECK(!IsNonBlocking(timer));
+  // not running yet
+  CHECK(!event_loop.AddTimer(timer, [] {}));
+  CHECK(!IsNonBlocking(timer));
+  CHECK(event_loop.Init());
+  std::atomic<bool> expired(false);
+  CHECK(event_loop.AddTimer(timer, [&expired] { expired = true; }));
+  CHECK(IsNonBlocking(timer));
+  CHECK(timer.SetOnce(std::chrono::milliseconds(1)));
+  CHECK(WaitFor(expired));
+  CHECK(event_loop.RemoveTimer(timer));
+  CHECK(!IsNonBlocking(timer));
+  CHECK(!event_loop.RemoveTimer(timer));
+  CHECK(timer.SetOnce(std::chrono::milliseconds(20)));
+  auto start = std::chrono::steady_clock::now();
+  CHECK(timer.Wait());
+  CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(10));
+  event_loop.Uninit();
+  timer.Uninit();
+}
+
+int main() {
+  TestRemoveWaitsForHandler();
+  TestPostOrder();
+  TestTimerBlocking();
+  return TEST_RESULT();
+}
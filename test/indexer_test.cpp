@@ -0,0 +1,120 @@
+// g++ -std=c++14 -pthread -I.. indexer_test.cpp ../indexer.cpp
+
+#include "test.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+// the bitmap pages are counted from the inside
+#define private public
+#include "../indexer.h"
+#undef private
+
+using namespace utility;
+
+static size_t CountPages(const Indexer& indexer) {
+  size_t used_pages = 0;
+  for (auto& page : indexer.index_pages_) {
+    if (page != nullptr) {
+      ++used_pages;
+    }
+  }
+  return used_pages;
+}
+
+// A page whose last index is destroyed is given back, the pages follow the
+// live indices and not the indices ever issued
+static void TestPagesFollowLiveIndices() {
+  Indexer indexer;
+  std::vector<Index> indices;
+  for (int i = 0; i < 300000; ++i) {
+    indices.push_back(indexer.CreateIndex());
+  }
+  CHECK(CountPages(indexer) == 5);
+  indexer.DestroyIndex(indices);
+  CHECK(CountPages(indexer) == 0);
+  CHECK(indexer.spare_page_ != nullptr);
+  // 10M indices issued with a few live at a time
+  std::vector<IndexRange> ranges;
+  for (int i = 0; i < 10000; ++i) {
+    ranges.clear();
+    CHECK(indexer.CreateIndices(1000, ranges));
+    indexer.DestroyIndex(ranges);
+  }
+  CHECK(CountPages(indexer) == 0);
+}
+
+// Indices count up and a destroyed one is not reused before the counter
+// wraps, destroying an index that is not live does nothing
+static void TestCreateDestroy() {
+  Indexer indexer;
+  CHECK(indexer.CreateIndex() == 1);
+  CHECK(indexer.CreateIndex() == 2);
+  CHECK(indexer.CreateIndex() == 3);
+  indexer.DestroyIndex(2);
+  indexer.DestroyIndex(2);
+  indexer.DestroyIndex(kInvalidIndex);
+  indexer.DestroyIndex(1000);
+  CHECK(indexer.live_count_ == 2);
+  CHECK(indexer.CreateIndex() == 4);
+  std::vector<IndexRange> ranges;
+  CHECK(indexer.CreateIndices(10, ranges));
+  CHECK(ranges.size() == 1 && ranges[0].first == 5 && ranges[0].count == 10);
+  indexer.DestroyIndex(ranges);
+  CHECK(indexer.live_count_ == 3);
+  indexer.Clear();
+  CHECK(indexer.live_count_ == 0);
+  CHECK(indexer.CreateIndex() == 1);
+}
+
+// Once the counter used the 32 bit range up, the next free index after the
+// last one is taken, and the search goes on from 1 after the last index
+static void TestWraparound() {
+  Indexer indexer;
+  for (int i = 0; i < 100; ++i) {
+    indexer.CreateIndex();
+  }
+  indexer.DestroyIndex(50);
+  indexer.DestroyIndex(60);
+  // as if the rest of the 32 bit range had been used and freed
+  indexer.index_count_ = kMaxIndexNumber;
+  indexer.next_index_ = 55;
+  CHECK(indexer.CreateIndex() == 60);
+  CHECK(indexer.CreateIndex() == 101);
+  indexer.next_index_ = kMaxIndexNumber;
+  CHECK(indexer.CreateIndex() == kMaxIndexNumber);
+  CHECK(indexer.next_index_ == 1);
+  CHECK(indexer.CreateIndex() == 50);
+  indexer.DestroyIndex(50);
+  indexer.DestroyIndex(60);
+  indexer.next_index_ = 1;
+  std::vector<IndexRange> ranges;
+  CHECK(indexer.CreateIndices(3, ranges));
+  CHECK(ranges.size() == 3 && ranges[0].first == 50 && ranges[1].first == 60 && ranges[2].first == 102);
+  indexer.DestroyIndex(kMaxIndexNumber);
+  CHECK(indexer.live_count_ == 102);
+}
+
+// Every index live, creating fails and creates nothing
+static void TestExhaustion() {
+  Indexer indexer;
+  CHECK(indexer.CreateIndex() == 1);
+  // as if every other index were live too
+  indexer.live_count_ = kMaxIndexNumber;
+  CHECK(indexer.CreateIndex() == kInvalidIndex);
+  std::vector<IndexRange> ranges;
+  CHECK(!indexer.CreateIndices(1, ranges));
+  CHECK(ranges.empty());
+  indexer.live_count_ = kMaxIndexNumber - 2;
+  CHECK(!indexer.CreateIndices(3, ranges));
+  CHECK(ranges.empty());
+  CHECK(indexer.CreateIndices(2, ranges));
+  CHECK(ranges.size() == 1 && ranges[0].first == 2 && ranges[0].count == 2);
+}
+
+int main() {
+  TestPagesFollowLiveIndices();
+  TestCreateDestroy();
+  TestWraparound();
+  TestExhaustion();
+  return TEST_RESULT();
+}
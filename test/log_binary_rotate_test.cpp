@@ -0,0 +1,94 @@
+// g++ -std=c++14 -pthread -I.. log_binary_rotate_test.cpp ../log.cpp ../log_format.cpp ../mapped_file.cpp ../event_loop.cpp ../timer.cpp ../utility.cpp -lz
+
+#include "test.h"
+#include "../log.h"
+#include "../log_format.h"
+#include "../utility.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace utility;
+
+// the log files this program wrote, they are under the log directory beside it
+static std::vector<std::string> ListOwnLogFiles() {
+  auto log_dir = WStringToA(GetExeDirectory()) + "/log";
+  auto prefix = WStringToA(GetExeName(L".exe")) + "_";
+  std::vector<std::string> paths;
+  auto dir = opendir(log_dir.c_str());
+  if (dir == nullptr) {
+    return paths;
+  }
+  while (auto entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if (name.compare(0, prefix.size(), prefix) == 0) {
+      paths.push_back(log_dir + "/" + name);
+    }
+  }
+  closedir(dir);
+  return paths;
+}
+
+static size_t CountLines(const std::string& text, const std::string& pattern) {
+  size_t count = 0;
+  for (auto position = text.find(pattern); position != std::string::npos; position = text.find(pattern, position + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+// Every segment a size rotation cuts off a binary log decodes on its own
+static void TestDecodeRotatedSegments() {
+  const int kLines = 3000;
+  LogConfig config;
+  config.encoding = kEncodingBinary;
+  config.max_file_size = 8 * 1024;
+  InitLog("binary rotate test", config);
+  for (int i = 0; i < kLines; ++i) {
+    if (i % 2 == 0) {
+      LOG(kInfo, "even line %d", i);
+    } else {
+      LOG(kWarning, "odd line %d of %s", i, "rotate");
+    }
+    // a batch never spans two files, keep them small so the file rotates often
+    if (i % 100 == 99) {
+      FlushLog();
+    }
+  }
+  UninitLog();
+  auto paths = ListOwnLogFiles();
+  CHECK(paths.size() > 3);
+  size_t even_lines = 0;
+  size_t odd_lines = 0;
+  for (const auto& path : paths) {
+    // the init line goes to a text file before the writer starts
+    if (path.compare(path.size() - 5, 5, ".logb") != 0) {
+      continue;
+    }
+    std::ifstream input(path, std::ios::in | std::ios::binary);
+    std::ostringstream output;
+    auto decoded = DecodeBinaryLog(input, output);
+    if (!decoded) {
+      fprintf(stderr, "fail to decode %s\n", path.c_str());
+    }
+    CHECK(decoded);
+    even_lines += CountLines(output.str(), "even line ");
+    odd_lines += CountLines(output.str(), "odd line ");
+  }
+  CHECK(even_lines == kLines / 2);
+  CHECK(odd_lines == kLines / 2);
+}
+
+int main() {
+  for (const auto& path : ListOwnLogFiles()) {
+    remove(path.c_str());
+  }
+  TestDecodeRotatedSegments();
+  for (const auto& path : ListOwnLogFiles()) {
+    remove(path.c_str());
+  }
+  return TEST_RESULT();
+}
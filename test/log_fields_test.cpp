@@ -0,0 +1,83 @@
+// g++ -std=c++14 -pthread -I.. log_fields_test.cpp ../log.cpp ../log_format.cpp ../mapped_file.cpp ../event_loop.cpp ../timer.cpp ../utility.cpp -lz
+
+#include "test.h"
+#include "../log.h"
+#include "../log_format.h"
+#include <limits>
+#include <string>
+
+using namespace utility;
+
+static std::string Render(const LogFieldWriter& writer, size_t size = 4096) {
+  std::string line(size, '\0');
+  line.resize(RenderLogFields(&line[0], line.size(), 123, 7, kInfo, writer.data(), writer.length()));
+  return line;
+}
+
+// Quotes, backslashes and control characters of keys and strings are
+// escaped, other bytes pass as they are
+static void TestEscaping() {
+  LogFieldWriter writer;
+  writer.Add("msg", "say \"hi\"\\ \n\r\t\x01\x1f end");
+  writer.Add("k\"ey", std::string("nul\0byte", 8));
+  writer.Add("utf8", "\xe4\xbd\xa0\xe5\xa5\xbd");
+  CHECK(Render(writer) ==
+        "{\"ts\":123,\"level\":\"Info\",\"tid\":7,"
+        "\"msg\":\"say \\\"hi\\\"\\\\ \\n\\r\\t\\u0001\\u001f end\","
+        "\"k\\\"ey\":\"nul\\u0000byte\","
+        "\"utf8\":\"\xe4\xbd\xa0\xe5\xa5\xbd\"}\n");
+}
+
+// Numbers as JSON numbers, a double that is not finite as null
+static void TestValues() {
+  LogFieldWriter writer;
+  writer.Add("yes", true);
+  writer.Add("no", false);
+  writer.Add("min", std::numeric_limits<long long>::min());
+  writer.Add("max", std::numeric_limits<unsigned long long>::max());
+  writer.Add("half", 0.5);
+  writer.Add("nan", std::numeric_limits<double>::quiet_NaN());
+  writer.Add("inf", std::numeric_limits<double>::infinity());
+  writer.Add("null", static_cast<const char*>(nullptr));
+  CHECK(Render(writer) ==
+        "{\"ts\":123,\"level\":\"Info\",\"tid\":7,\"yes\":true,\"no\":false,"
+        "\"min\":-9223372036854775808,\"max\":18446744073709551615,"
+        "\"half\":0.5,\"nan\":null,\"inf\":null,\"null\":\"\"}\n");
+}
+
+// A field either fits whole or is left out with the ones after it, the line
+// stays one JSON object, escapes are never cut in half
+static void TestTruncation() {
+  LogFieldWriter writer;
+  writer.Add("a", 1LL);
+  writer.Add("quotes", std::string(40, '"'));
+  writer.Add("b", 2LL);
+  auto prefix = std::string("{\"ts\":123,\"level\":\"Info\",\"tid\":7,\"a\":1");
+  CHECK(Render(writer, prefix.size() + 30) == prefix + "}\n");
+  CHECK(Render(writer, prefix.size() + 2) == prefix + "}\n");
+  // the writer drops what is over its buffer, the string is cut to fit
+  LogFieldWriter long_writer;
+  CHECK(long_writer.Add("long", std::string(LogFieldWriter::kMaxLength, 'x')));
+  CHECK(!long_writer.Add("after", 1LL));
+  CHECK(long_writer.length() == LogFieldWriter::kMaxLength);
+}
+
+// LOGS delivers the escaped line to the sinks
+static void TestLogsMacro() {
+  LogConfig config;
+  config.sinks.emplace_back(kSinkMemory, kInfo);
+  InitLog("fields test", config);
+  std::string user = "a\"b\\c\n";
+  LOGS(kInfo, "request \"done\"", "user", user, "latency_us", 42, "ok", true);
+  auto memory_log = GetMemoryLog();
+  CHECK(memory_log.find("\"msg\":\"request \\\"done\\\"\",\"user\":\"a\\\"b\\\\c\\n\",\"latency_us\":42,\"ok\":true}\n") != std::string::npos);
+  UninitLog();
+}
+
+int main() {
+  TestEscaping();
+  TestValues();
+  TestTruncation();
+  TestLogsMacro();
+  return TEST_RESULT();
+}
@@ -0,0 +1,153 @@
+// g++ -std=c++14 -pthread -I.. log_recorder_test.cpp ../log.cpp ../log_format.cpp ../mapped_file.cpp ../event_loop.cpp ../timer.cpp ../utility.cpp -lz
+
+#include "test.h"
+#include "../log.h"
+#include "../utility.h"
+#include <dirent.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+using namespace utility;
+
+// the text logs this program wrote, they are under the log directory beside it
+static std::string ReadOwnLogs() {
+  auto log_dir = WStringToA(GetExeDirectory()) + "/log";
+  auto prefix = WStringToA(GetExeName(L".exe")) + "_";
+  std::string logs;
+  auto dir = opendir(log_dir.c_str());
+  if (dir == nullptr) {
+    return logs;
+  }
+  while (auto entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if (name.compare(0, prefix.size(), prefix) == 0) {
+      std::ifstream file(log_dir + "/" + name);
+      std::stringstream content;
+      content << file.rdbuf();
+      logs += content.str();
+    }
+  }
+  closedir(dir);
+  return logs;
+}
+
+static size_t CountLines(const std::string& text, const std::string& pattern) {
+  size_t count = 0;
+  for (auto position = text.find(pattern); position != std::string::npos; position = text.find(pattern, position + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+// A fatal signal writes out the lines only kept in the flight recorder
+static void TestDumpOnFatalSignal() {
+  const int kLines = 10;
+  auto logged_before = CountLines(ReadOwnLogs(), "recorded line ");
+  auto pid = fork();
+  if (pid == 0) {
+    LogConfig config;
+    config.recorder_level = kInfo;
+    InitLog("recorder test", config);
+    for (int i = 0; i < kLines; ++i) {
+      LOG(kInfo, "recorded line %d", i);
+    }
+    raise(SIGABRT);
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+  CHECK(CountLines(ReadOwnLogs(), "recorded line ") == logged_before + kLines);
+}
+
+// A mapped log gets the lines past its appended data, not through the window
+static void TestDumpMappedFile() {
+  const int kLines = 10;
+  auto logged_before = CountLines(ReadOwnLogs(), "mapped recorded line ");
+  auto pid = fork();
+  if (pid == 0) {
+    LogConfig config;
+    config.mapped = true;
+    config.recorder_level = kInfo;
+    InitLog("recorder test", config);
+    for (int i = 0; i < kLines; ++i) {
+      LOG(kInfo, "mapped recorded line %d", i);
+    }
+    raise(SIGSEGV);
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+  CHECK(CountLines(ReadOwnLogs(), "mapped recorded line ") == logged_before + kLines);
+}
+
+static void ExitOnAbort(int) {
+  _exit(42);
+}
+
+// The handler installed before InitLog still gets the signal after the dump
+static void TestChainPreviousHandler() {
+  auto logged_before = CountLines(ReadOwnLogs(), "chained recorded line");
+  auto pid = fork();
+  if (pid == 0) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &ExitOnAbort;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGABRT, &action, nullptr);
+    LogConfig config;
+    config.recorder_level = kInfo;
+    InitLog("recorder test", config);
+    LOG(kInfo, "chained recorded line");
+    raise(SIGABRT);
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 42);
+  CHECK(CountLines(ReadOwnLogs(), "chained recorded line") == logged_before + 1);
+}
+
+// never set, so the recursion only ends with the stack
+static volatile bool stop_recursion = false;
+
+static int Recurse(int depth) {
+  if (stop_recursion) {
+    return 0;
+  }
+  volatile char frame[1024];
+  frame[0] = static_cast<char>(depth);
+  return Recurse(depth + 1) + frame[0];
+}
+
+// A stack overflow runs the handler on the alternate stack
+static void TestDumpOnStackOverflow() {
+  auto logged_before = CountLines(ReadOwnLogs(), "overflow recorded line");
+  auto pid = fork();
+  if (pid == 0) {
+    LogConfig config;
+    config.recorder_level = kInfo;
+    InitLog("recorder test", config);
+    LOG(kInfo, "overflow recorded line");
+    Recurse(0);
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+  CHECK(CountLines(ReadOwnLogs(), "overflow recorded line") == logged_before + 1);
+}
+
+int main() {
+  TestDumpOnFatalSignal();
+  TestDumpMappedFile();
+  TestChainPreviousHandler();
+  TestDumpOnStackOverflow();
+  return TEST_RESULT();
+}
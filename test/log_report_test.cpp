@@ -0,0 +1,51 @@
+// g++ -std=c++14 -pthread -I.. log_report_test.cpp ../log.cpp ../log_format.cpp ../mapped_file.cpp ../event_loop.cpp ../timer.cpp ../utility.cpp -lz
+
+#include "test.h"
+#include "../log.h"
+#include <dirent.h>
+#include <string>
+
+using namespace utility;
+
+static int CountThreads() {
+  int count = 0;
+  auto dir = opendir("/proc/self/task");
+  if (dir == nullptr) {
+    return count;
+  }
+  while (auto entry = readdir(dir)) {
+    if (entry->d_name[0] != '.') {
+      ++count;
+    }
+  }
+  closedir(dir);
+  return count;
+}
+
+// The reporter of suppressed lines starts with the first suppression, not
+// with InitLog, and the count is logged before the next line of the site
+static void TestReportStartsOnSuppression() {
+  LogConfig config;
+  config.sinks.emplace_back(kSinkMemory, kInfo);
+  InitLog("report test", config);
+  auto threads = CountThreads();
+  for (int i = 0; i < 10; ++i) {
+    LOG(kInfo, "plain line %d", i);
+  }
+  CHECK(CountThreads() == threads);
+  for (int i = 0; i < 5; ++i) {
+    LOG_EVERY_N(kInfo, 4, "sampled line %d", i);
+  }
+  CHECK(CountThreads() == threads + 1);
+  auto memory_log = GetMemoryLog();
+  CHECK(memory_log.find("sampled line 0") != std::string::npos);
+  CHECK(memory_log.find("sampled line 4") != std::string::npos);
+  CHECK(memory_log.find("3 lines suppressed at") != std::string::npos);
+  UninitLog();
+  CHECK(CountThreads() < threads + 1);
+}
+
+int main() {
+  TestReportStartsOnSuppression();
+  return TEST_RESULT();
+}
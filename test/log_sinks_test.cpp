@@ -0,0 +1,93 @@
+// g++ -std=c++14 -pthread -I.. log_sinks_test.cpp ../log.cpp ../log_format.cpp ../mapped_file.cpp ../event_loop.cpp ../timer.cpp ../utility.cpp -lz
+
+#include "test.h"
+#include "../log.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace utility;
+
+// InitLog swaps the sinks while other threads keep delivering lines to them
+static void TestReinitWhileLogging() {
+  const int kThreads = 4;
+  const int kReinits = 200;
+  LogConfig config;
+  config.sinks.emplace_back(kSinkMemory, kInfo);
+  InitLog("sinks test", config);
+  std::atomic<bool> running(true);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i) {
+    threads.emplace_back([&running, i] {
+      while (running.load(std::memory_order_relaxed)) {
+        LOG(kInfo, "sink line from thread %d", i);
+      }
+    });
+  }
+  for (int i = 0; i < kReinits; ++i) {
+    config.sinks[0].memory_size = (i % 2 + 1) * 64 * 1024;
+    InitLog("sinks test", config);
+  }
+  running = false;
+  for (auto& i : threads) {
+    i.join();
+  }
+  LOG(kInfo, "last sink line");
+  CHECK(GetMemoryLog().find("last sink line") != std::string::npos);
+  UninitLog();
+}
+
+// A sink stuck in its write, here stdout on a full pipe, neither blocks LOG
+// nor a FlushLog waiting for it
+static void TestStalledSink() {
+  const int kLines = 200;
+  int pipe_fds[2] = {-1, -1};
+  CHECK(pipe(pipe_fds) == 0);
+  fcntl(pipe_fds[1], F_SETPIPE_SZ, 4096);
+  fflush(stdout);
+  auto saved_stdout = dup(STDOUT_FILENO);
+  dup2(pipe_fds[1], STDOUT_FILENO);
+  LogConfig config;
+  config.sinks.emplace_back(kSinkConsole, kInfo);
+  config.sinks[0].queue_size = 16;
+  InitLog("sinks test", config);
+  // nobody reads the pipe yet, slow enough for the sink to take every line
+  // until it blocks in fwrite
+  for (int i = 0; i < kLines; ++i) {
+    LOG(kInfo, "stalled sink line %d", i);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  std::thread flush_thread([] { FlushLog(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  std::atomic<bool> logged(false);
+  std::thread log_thread([&logged] {
+    LOG(kInfo, "line beside a stalled sink");
+    logged = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  CHECK(logged);
+  std::thread read_thread([&pipe_fds] {
+    char buffer[4096];
+    while (read(pipe_fds[0], buffer, sizeof(buffer)) > 0) {
+    }
+  });
+  log_thread.join();
+  flush_thread.join();
+  UninitLog();
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+  close(pipe_fds[1]);
+  read_thread.join();
+  close(pipe_fds[0]);
+}
+
+int main() {
+  TestReinitWhileLogging();
+  TestStalledSink();
+  return TEST_RESULT();
+}
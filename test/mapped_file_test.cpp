@@ -0,0 +1,90 @@
+// g++ -std=c++14 -pthread -I.. mapped_file_test.cpp ../mapped_file.cpp ../log_format.cpp ../utility.cpp
+
+#include "test.h"
+#include "../mapped_file.h"
+#include "../log_format.h"
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+using namespace utility;
+
+static const size_t kChunkSize = 64 * 1024;
+
+static std::string ReadFile(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  std::stringstream content;
+  content << file.rdbuf();
+  return content.str();
+}
+
+// append in a child that exits without Close, like a crash after the sync
+static void AppendAndCrash(const std::string& path, const std::string& data) {
+  auto pid = fork();
+  if (pid == 0) {
+    MappedFile file;
+    auto result = file.Open(path, kChunkSize) && file.Append(data.data(), data.size()) && file.Sync();
+    _exit(result ? 0 : 1);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void TestReopenAfterCrash() {
+  std::string path = "mapped_file_test.dat";
+  remove(path.c_str());
+  std::string first = "first line\n";
+  AppendAndCrash(path, first);
+  // the preallocated chunk is still there
+  CHECK(ReadFile(path).size() % kChunkSize == 0);
+
+  MappedFile file;
+  CHECK(file.Open(path, kChunkSize));
+  CHECK(file.size() == first.size());
+  CHECK(ReadFile(path) == first);
+  std::string second = "second line\n";
+  CHECK(file.Append(second.data(), second.size()));
+  CHECK(file.Close());
+  CHECK(ReadFile(path) == first + second);
+
+  // a file closed cleanly is left alone
+  CHECK(file.Open(path, kChunkSize));
+  CHECK(file.size() == first.size() + second.size());
+  CHECK(file.Close());
+  remove(path.c_str());
+}
+
+// binary logs keep the zeros, their decoder skips them
+static void TestBinaryLogAfterCrash() {
+  std::string path = "mapped_file_test.logb";
+  remove(path.c_str());
+  std::string first;
+  AppendBinaryLogSession(first);
+  AppendBinaryLogText(first, "first\n", 6);
+  AppendAndCrash(path, first);
+
+  MappedFile file;
+  CHECK(file.Open(path, kChunkSize, false));
+  CHECK(file.size() == kChunkSize);
+  std::string second;
+  AppendBinaryLogSession(second);
+  AppendBinaryLogText(second, "second\n", 7);
+  CHECK(file.Append(second.data(), second.size()));
+  CHECK(file.Close());
+
+  std::ifstream input(path, std::ios::binary);
+  std::stringstream output;
+  CHECK(DecodeBinaryLog(input, output));
+  CHECK(output.str() == "first\nsecond\n");
+  remove(path.c_str());
+}
+
+int main() {
+  TestReopenAfterCrash();
+  TestBinaryLogAfterCrash();
+  return TEST_RESULT();
+}
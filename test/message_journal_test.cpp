@@ -0,0 +1,165 @@
+// g++ -std=c++14 -pthread -I.. message_journal_test.cpp ../message_journal.cpp ../mapped_file.cpp ../log.cpp ../log_format.cpp ../event_loop.cpp ../timer.cpp ../utility.cpp -lz -ldl
+
+#include "test.h"
+#include "../message_journal.h"
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace utility;
+
+static std::mutex synced_lock;
+// end of the records of a file when fdatasync was last called on it, by inode
+static std::map<ino_t, size_t> synced_ends;
+static std::atomic<int> rotations(0);
+static std::atomic<int> unsynced_rotations(0);
+
+// end of the whole records in the file, the format of message_journal.cpp
+static size_t RecordEnd(int file) {
+  std::string data;
+  char buffer[64 * 1024];
+  ssize_t read_size = 0;
+  off_t offset = 0;
+  while ((read_size = pread(file, buffer, sizeof(buffer), offset)) > 0) {
+    data.append(buffer, read_size);
+    offset += read_size;
+  }
+  size_t position = 0;
+  while (position + 9 <= data.size()) {
+    // an index of 8 bytes instead of 4 sets bit 4 of the type
+    size_t index_size = (data[position] & 4) != 0 ? 8 : 4;
+    auto type = data[position] & ~4;
+    if (type == 2 && position + 5 + index_size <= data.size()) {
+      position += 5 + index_size;
+    } else if (type == 1 && position + 9 + index_size <= data.size()) {
+      uint32_t length = 0;
+      memcpy(&length, data.data() + position + 1 + index_size, sizeof(length));
+      position += 9 + index_size + length;
+    } else {
+      break;
+    }
+  }
+  return position;
+}
+
+// the sync is slowed down, so records are appended while it runs
+extern "C" int fdatasync(int file) {
+  static auto real_fdatasync = reinterpret_cast<int (*)(int)>(dlsym(RTLD_NEXT, "fdatasync"));
+  struct stat file_stat;
+  fstat(file, &file_stat);
+  auto end = RecordEnd(file);
+  usleep(2000);
+  auto result = real_fdatasync(file);
+  std::lock_guard<std::mutex> lock(synced_lock);
+  auto& synced_end = synced_ends[file_stat.st_ino];
+  synced_end = std::max(synced_end, end);
+  return result;
+}
+
+// a journal moved to .old must have been synced up to its last record
+extern "C" int rename(const char* from, const char* to) {
+  static auto real_rename = reinterpret_cast<int (*)(const char*, const char*)>(dlsym(RTLD_NEXT, "rename"));
+  auto to_length = strlen(to);
+  if (to_length > 4 && strcmp(to + to_length - 4, ".old") == 0) {
+    auto file = open(from, O_RDONLY);
+    struct stat file_stat;
+    fstat(file, &file_stat);
+    auto end = RecordEnd(file);
+    close(file);
+    std::lock_guard<std::mutex> lock(synced_lock);
+    ++rotations;
+    if (synced_ends[file_stat.st_ino] < end) {
+      ++unsynced_rotations;
+    }
+  }
+  return real_rename(from, to);
+}
+
+// The indices above 32 bits, of a later round of their slots, come back whole
+static void TestReplay(const JournalConfig& config) {
+  const Index kRound = static_cast<Index>(0x100000000ULL);
+  std::unordered_map<Index, std::string> messages;
+  MessageJournal journal;
+  CHECK(journal.Init(config, messages));
+  CHECK(messages.empty());
+  for (Index i = 1; i <= 100; ++i) {
+    auto payload = "message" + std::to_string(i);
+    CHECK(journal.AppendMessage(i, payload.data(), payload.size()) != 0);
+  }
+  CHECK(journal.AppendMessage(kRound + 1, "round message", 13) != 0);
+  for (Index i = 1; i <= 100; i += 2) {
+    CHECK(journal.AppendAck(i));
+  }
+  journal.Uninit();
+  CHECK(journal.Init(config, messages));
+  CHECK(messages.size() == 51);
+  CHECK(messages[2] == "message2" && messages[100] == "message100");
+  CHECK(messages[kRound + 1] == "round message");
+  for (Index i = 2; i <= 100; i += 2) {
+    CHECK(journal.AppendAck(i));
+  }
+  CHECK(journal.AppendAck(kRound + 1));
+  journal.Uninit();
+  CHECK(journal.Init(config, messages));
+  CHECK(messages.empty());
+  journal.Uninit();
+}
+
+// Records appended while the commit thread syncs without the lock are
+// still in the file when it rotates, the rotation has to sync them
+static void TestRotateWhileSyncing(JournalConfig config) {
+  config.chunk_size = 64 * 1024;
+  config.compact_size = 32 * 1024;
+  std::unordered_map<Index, std::string> messages;
+  MessageJournal journal;
+  CHECK(journal.Init(config, messages));
+  std::atomic<Index> next_index(1);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&journal, &next_index] {
+      std::string payload(200, 'x');
+      for (int j = 0; j < 2000; ++j) {
+        auto index = next_index++;
+        auto position = journal.AppendMessage(index, payload.data(), payload.size());
+        CHECK(position != 0);
+        if (j % 16 == 0) {
+          CHECK(journal.WaitCommit(position));
+        }
+        CHECK(journal.AppendAck(index));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  journal.Uninit();
+  CHECK(rotations > 0);
+  CHECK(unsynced_rotations == 0);
+  CHECK(journal.Init(config, messages));
+  CHECK(messages.empty());
+  journal.Uninit();
+}
+
+int main() {
+  char directory[] = "/tmp/message_journal_testXXXXXX";
+  if (mkdtemp(directory) == nullptr) {
+    return 1;
+  }
+  JournalConfig config;
+  config.path = std::string(directory) + "/queue.journal";
+  TestReplay(config);
+  TestRotateWhileSyncing(config);
+  std::string command = std::string("rm -rf ") + directory;
+  system(command.c_str());
+  return TEST_RESULT();
+}
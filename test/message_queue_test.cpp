@@ -0,0 +1,457 @@
+// g++ -std=c++14 -pthread -I.. message_queue_test.cpp ../message_queue.cpp ../message_journal.cpp ../thread_pool.cpp ../event_loop.cpp ../indexer.cpp ../log.cpp ../log_format.cpp ../mapped_file.cpp ../timer.cpp ../utility.cpp -lz
+
+#include "test.h"
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+// the shards are moved on and looked at from the inside
+#define private public
+#include "../message_queue.h"
+#undef private
+
+using namespace utility;
+
+// allocations of the thread that turned counting on
+static thread_local bool counting_allocations = false;
+static thread_local size_t allocations = 0;
+
+void* operator new(size_t size) {
+  if (counting_allocations) {
+    ++allocations;
+  }
+  auto memory = malloc(size != 0 ? size : 1);
+  if (memory == nullptr) {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+void operator delete(void* memory) noexcept {
+  free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+  free(memory);
+}
+
+static bool PushWith(MessageQueue& queue, const RetryPolicy& retry_policy) {
+  return queue.Push([](Index, bool) { return true; }, retry_policy);
+}
+
+static bool PushBatchWith(MessageQueue& queue, const RetryPolicy& retry_policy) {
+  std::vector<MessageSender> senders;
+  senders.emplace_back([](Index, bool) { return true; });
+  return queue.Push(std::move(senders), retry_policy);
+}
+
+// A policy that would shrink the interval to nothing is turned away
+static void TestInvalidRetryPolicy() {
+  MessageQueue queue;
+  CHECK(queue.Init(60));
+  RetryPolicy shrinking;
+  shrinking.multiplier = 0.5;
+  RetryPolicy zero_multiplier;
+  zero_multiplier.multiplier = 0.0;
+  RetryPolicy negative_delay;
+  negative_delay.initial_delay = std::chrono::milliseconds(-10);
+  RetryPolicy negative_max;
+  negative_max.max_interval = std::chrono::milliseconds(-1);
+  RetryPolicy negative_jitter;
+  negative_jitter.jitter = -0.1;
+  RetryPolicy large_jitter;
+  large_jitter.jitter = 1.5;
+  for (const auto& retry_policy : {shrinking, zero_multiplier, negative_delay, negative_max, negative_jitter, large_jitter}) {
+    CHECK(!PushWith(queue, retry_policy));
+    CHECK(!PushBatchWith(queue, retry_policy));
+  }
+  RetryPolicy valid;
+  valid.multiplier = 1.0;
+  valid.jitter = 1.0;
+  CHECK(PushWith(queue, valid));
+  CHECK(PushBatchWith(queue, valid));
+  queue.Uninit();
+}
+
+// The full jitter of a 1ms interval never resends at once
+static void TestJitterFloor() {
+  MessageQueue queue;
+  CHECK(queue.Init(60));
+  RetryPolicy retry_policy;
+  retry_policy.initial_delay = std::chrono::milliseconds(1);
+  retry_policy.jitter = 1.0;
+  std::atomic<int> resends(0);
+  CHECK(queue.Push([&resends](Index, bool resend) {
+    if (resend) {
+      ++resends;
+    }
+    return true;
+  }, retry_policy));
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  queue.Uninit();
+  CHECK(resends > 0);
+  CHECK(resends <= 200);
+}
+
+// Once the pools have grown, a push with an expiry callback and its pop
+// allocate nothing
+static void TestPushAllocatesNothing() {
+  const int kWarmMessages = 1000;
+  const int kMessages = 10000;
+  MessageQueue queue;
+  CHECK(queue.Init(60));
+  std::atomic<int> expired(0);
+  Index expired_index = kInvalidIndex;
+  RetryPolicy retry_policy;
+  retry_policy.max_attempts = 3;
+  // larger than the small buffer of std::function
+  retry_policy.on_expire = [&expired, &expired_index, &queue](Index index) {
+    ++expired;
+    expired_index = index;
+    queue.Pop(index);
+  };
+  Index pushed_index = kInvalidIndex;
+  auto sender = [&pushed_index](Index index, bool) {
+    pushed_index = index;
+    return true;
+  };
+  std::vector<Index> warm_indices;
+  for (int i = 0; i < kWarmMessages; ++i) {
+    CHECK(queue.Push(sender, retry_policy));
+    warm_indices.push_back(pushed_index);
+  }
+  for (auto index : warm_indices) {
+    queue.Pop(index);
+  }
+  counting_allocations = true;
+  for (int i = 0; i < kMessages; ++i) {
+    queue.Push(sender, retry_policy);
+    queue.Pop(pushed_index);
+  }
+  counting_allocations = false;
+  CHECK(allocations == 0);
+  queue.Uninit();
+  CHECK(expired == 0);
+}
+
+// A late pop of an index whose slot was reused after the counter wrapped
+// leaves the newer message queued
+static void TestStaleIndexAfterWrap() {
+  MessageQueue queue;
+  CHECK(queue.Init(60));
+  Index pushed_index = kInvalidIndex;
+  auto sender = [&pushed_index](Index index, bool) {
+    pushed_index = index;
+    return true;
+  };
+  CHECK(queue.Push(sender));
+  auto stale_index = pushed_index;
+  queue.Pop(stale_index);
+  auto& shard = *queue.shards_[0];
+  shard.next_index = shard.max_index;
+  CHECK(queue.Push(sender));
+  CHECK(pushed_index != stale_index);
+  CHECK((pushed_index & kMaxIndexNumber) == (stale_index & kMaxIndexNumber));
+  queue.Pop(stale_index);
+  CHECK(shard.resender_count == 1);
+  queue.Pop(pushed_index);
+  CHECK(shard.resender_count == 0);
+  queue.Uninit();
+}
+
+// Senders and expiry callbacks larger than the inline storage are allocated,
+// std::function senders push as they did
+static void TestLargeAndStdFunctionSenders() {
+  struct LargeCapture {
+    std::atomic<int>* calls;
+    char data[128];
+  };
+  MessageQueue queue;
+  CHECK(queue.Init(60));
+  std::atomic<int> calls(0);
+  LargeCapture capture = {&calls, "large capture"};
+  CHECK(queue.Push([capture](Index, bool) {
+    ++*capture.calls;
+    return capture.data[0] == 'l';
+  }));
+  std::function<bool (Index, bool)> sender = [&calls](Index, bool) {
+    ++calls;
+    return true;
+  };
+  CHECK(queue.Push(sender));
+  std::vector<std::function<bool (Index, bool)>> senders(3, sender);
+  CHECK(queue.Push(std::move(senders)));
+  CHECK(calls == 5);
+  std::atomic<int> expired(0);
+  RetryPolicy retry_policy;
+  retry_policy.initial_delay = std::chrono::milliseconds(1);
+  retry_policy.max_attempts = 1;
+  retry_policy.on_expire = [capture, &expired](Index) {
+    if (capture.data[0] == 'l') {
+      ++expired;
+    }
+  };
+  // the policy and its callback are copied into the queue
+  RetryPolicy copied_policy = retry_policy;
+  CHECK(queue.Push(sender, copied_policy));
+  for (int i = 0; i < 100 && expired == 0; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  CHECK(expired == 1);
+  queue.Uninit();
+}
+
+// Messages of mixed delays are resent earliest first, the heap keeps its
+// order and positions as messages are pushed and popped out of its middle
+static void TestResendHeapOrder() {
+  MessageQueue queue;
+  CHECK(queue.Init(60));
+  std::mutex resent_lock;
+  std::vector<int> resent;
+  for (int delay : {150, 30, 90, 60, 120}) {
+    RetryPolicy retry_policy;
+    retry_policy.initial_delay = std::chrono::milliseconds(delay);
+    CHECK(queue.Push([&queue, &resent_lock, &resent, delay](Index index, bool resend) {
+      if (resend) {
+        std::lock_guard<std::mutex> lock(resent_lock);
+        resent.push_back(delay);
+        queue.Pop(index);
+      }
+      return true;
+    }, retry_policy));
+  }
+  for (int i = 0; i < 100; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::lock_guard<std::mutex> lock(resent_lock);
+    if (resent.size() == 5) {
+      break;
+    }
+  }
+  resent_lock.lock();
+  CHECK((resent == std::vector<int>{30, 60, 90, 120, 150}));
+  resent_lock.unlock();
+  // none is due before the check
+  auto& shard = *queue.shards_[0];
+  std::vector<Index> indices;
+  for (int i = 0; i < 200; ++i) {
+    RetryPolicy retry_policy;
+    retry_policy.initial_delay = std::chrono::milliseconds(100000 + (i * 7919) % 1000);
+    CHECK(queue.Push([&indices](Index index, bool) {
+      indices.push_back(index);
+      return true;
+    }, retry_policy));
+  }
+  for (size_t i = 0; i < indices.size(); i += 3) {
+    queue.Pop(indices[i]);
+  }
+  shard.task_queue_lock.lock();
+  auto& resend_heap = shard.resend_heap;
+  auto ordered = resend_heap.size() == shard.resender_count;
+  for (size_t i = 0; ordered && i < resend_heap.size(); ++i) {
+    ordered = resend_heap[i]->heap_position() == i &&
+              (i == 0 || resend_heap[(i - 1) / 2]->resend_time() <= resend_heap[i]->resend_time());
+  }
+  shard.task_queue_lock.unlock();
+  CHECK(ordered);
+  CHECK(shard.resender_count == 133);
+  queue.Uninit();
+}
+
+// A pop while the message is being resent takes it out of the table, the
+// resend then frees it instead of putting it back in the heap
+static void TestPopDuringResend() {
+  MessageQueue queue;
+  WindowConfig window_config;
+  window_config.max_messages = 10;
+  CHECK(queue.SetWindow(window_config));
+  CHECK(queue.Init(60, 1));
+  std::atomic<bool> resending(false);
+  std::atomic<bool> popped(false);
+  std::atomic<int> resends(0);
+  Index pushed_index = kInvalidIndex;
+  RetryPolicy retry_policy;
+  retry_policy.initial_delay = std::chrono::milliseconds(10);
+  CHECK(queue.Push([&](Index index, bool resend) {
+    if (!resend) {
+      pushed_index = index;
+      return true;
+    }
+    ++resends;
+    resending = true;
+    for (int i = 0; i < 1000 && !popped; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+  }, retry_policy));
+  for (int i = 0; i < 1000 && !resending; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  CHECK(resending);
+  auto& shard = *queue.shards_[0];
+  queue.Pop(pushed_index);
+  shard.task_queue_lock.lock();
+  CHECK(shard.resender_count == 0);
+  CHECK(shard.resend_heap.empty());
+  shard.task_queue_lock.unlock();
+  // a message pushed meanwhile is left alone by the requeue
+  Index other_index = kInvalidIndex;
+  CHECK(queue.Push([&other_index](Index index, bool) {
+    other_index = index;
+    return true;
+  }));
+  CHECK(other_index != pushed_index);
+  popped = true;
+  for (int i = 0; i < 1000 && queue.window_messages_ != 1; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  CHECK(queue.window_messages_ == 1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  CHECK(resends == 1);
+  shard.task_queue_lock.lock();
+  CHECK(shard.resender_count == 1);
+  CHECK(shard.resend_heap.size() == 1 && shard.resend_heap[0]->index() == other_index);
+  shard.task_queue_lock.unlock();
+  queue.Pop(other_index);
+  CHECK(queue.window_messages_ == 0);
+  queue.Uninit();
+}
+
+// The top bits of an index route a pop from any thread to the shard that
+// queued it, an index of no shard is ignored
+static void TestShardRouting() {
+  const size_t kShards = 3;
+  const int kThreads = 6;
+  const int kMessages = 100;
+  MessageQueue queue;
+  CHECK(queue.Init(60, 0, kShards));
+  CHECK(queue.shard_index_bits_ == 30);
+  std::vector<std::vector<Index>> indices(kThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&queue, &indices, t] {
+      for (int i = 0; i < kMessages; ++i) {
+        queue.Push([&indices, t](Index index, bool) {
+          indices[t].push_back(index);
+          return true;
+        });
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  std::vector<Index> all_indices;
+  std::vector<size_t> queued(kShards);
+  for (auto& thread_indices : indices) {
+    CHECK(thread_indices.size() == kMessages);
+    // a thread pushes to one shard only
+    auto shard = queue.FindShard(thread_indices[0]);
+    for (auto index : thread_indices) {
+      auto slot = index & kMaxIndexNumber;
+      CHECK(queue.FindShard(index) == shard);
+      CHECK(shard != nullptr && slot >= shard->min_index && slot <= shard->max_index);
+      CHECK(shard == queue.shards_[slot >> 30].get());
+      CHECK(queue.FindResender(*shard, index) != nullptr);
+      all_indices.push_back(index);
+    }
+    queued[(thread_indices[0] & kMaxIndexNumber) >> 30] += kMessages;
+  }
+  for (size_t i = 0; i < kShards; ++i) {
+    CHECK(queue.shards_[i]->resender_count == queued[i]);
+    CHECK(queued[i] != 0);
+  }
+  CHECK(queue.FindShard(kInvalidIndex) == nullptr);
+  CHECK(queue.FindShard(static_cast<Index>(3ULL << 30)) == nullptr);
+  queue.Pop(static_cast<Index>(3ULL << 30));
+  queue.Pop(all_indices[0]);
+  CHECK(queue.FindResender(*queue.FindShard(all_indices[0]), all_indices[0]) == nullptr);
+  // the batch from this thread pops in every shard
+  queue.Pop(all_indices);
+  for (auto& shard : queue.shards_) {
+    CHECK(shard->resender_count == 0);
+    CHECK(shard->resend_heap.empty());
+  }
+  queue.Uninit();
+}
+
+// A push into a full window waits up to block_timeout for a pop, then fails
+// and calls on_full, on_low_watermark comes once the window drained
+static void TestWindowBlocking() {
+  const size_t kMaxMessages = 4;
+  MessageQueue queue;
+  WindowConfig window_config;
+  window_config.max_messages = kMaxMessages;
+  window_config.max_bytes = 1000;
+  window_config.low_watermark = 0.5;
+  window_config.block_timeout = std::chrono::milliseconds(200);
+  std::atomic<int> full_calls(0);
+  std::atomic<size_t> full_messages(0);
+  std::atomic<int> low_calls(0);
+  window_config.on_full = [&full_calls, &full_messages](size_t messages, size_t) {
+    ++full_calls;
+    full_messages = messages;
+  };
+  window_config.on_low_watermark = [&low_calls] { ++low_calls; };
+  CHECK(queue.SetWindow(window_config));
+  CHECK(queue.Init(60));
+  std::mutex indices_lock;
+  std::vector<Index> indices;
+  auto sender = [&indices_lock, &indices](Index index, bool) {
+    std::lock_guard<std::mutex> lock(indices_lock);
+    indices.push_back(index);
+    return true;
+  };
+  for (size_t i = 0; i < kMaxMessages; ++i) {
+    CHECK(queue.Push(sender, RetryPolicy(), 10));
+  }
+  // larger than the whole window, fails without waiting
+  CHECK(!queue.Push(sender, RetryPolicy(), 2000));
+  // a pop 50ms in lets the blocked push through
+  std::thread popper([&queue, &indices_lock, &indices] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    std::lock_guard<std::mutex> lock(indices_lock);
+    queue.Pop(indices[0]);
+  });
+  auto start = std::chrono::steady_clock::now();
+  CHECK(queue.Push(sender, RetryPolicy(), 10));
+  auto blocked = std::chrono::steady_clock::now() - start;
+  popper.join();
+  CHECK(blocked >= std::chrono::milliseconds(40) && blocked < std::chrono::milliseconds(200));
+  CHECK(full_calls == 0);
+  // nobody pops, the push gives up after block_timeout
+  start = std::chrono::steady_clock::now();
+  CHECK(!queue.Push(sender, RetryPolicy(), 10));
+  CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(190));
+  CHECK(full_calls == 1);
+  CHECK(full_messages == kMaxMessages);
+  CHECK(queue.window_messages_ == kMaxMessages);
+  // down to 3 is above the watermark, 2 reaches it
+  queue.Pop(indices[1]);
+  CHECK(low_calls == 0);
+  queue.Pop(indices[2]);
+  CHECK(low_calls == 1);
+  queue.Pop(indices[3]);
+  queue.Pop(indices[4]);
+  CHECK(low_calls == 1);
+  CHECK(queue.window_messages_ == 0 && queue.window_bytes_ == 0);
+  queue.Uninit();
+}
+
+int main() {
+  TestInvalidRetryPolicy();
+  TestJitterFloor();
+  TestPushAllocatesNothing();
+  TestStaleIndexAfterWrap();
+  TestLargeAndStdFunctionSenders();
+  TestResendHeapOrder();
+  TestPopDuringResend();
+  TestShardRouting();
+  TestWindowBlocking();
+  return TEST_RESULT();
+}
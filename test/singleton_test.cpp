@@ -0,0 +1,78 @@
+// g++ -std=c++14 -pthread -I.. singleton_test.cpp
+
+#include "test.h"
+#include "../singleton.h"
+#include <string>
+#include <vector>
+
+using namespace utility;
+
+static std::vector<std::string> released;
+
+struct First {
+  ~First() { released.push_back("first"); }
+};
+
+// gets First in its constructor, so it must be released before it
+struct Second {
+  Second() { Singleton<First>::GetInstance(); }
+  ~Second() { released.push_back("second"); }
+};
+
+struct Third {
+  ~Third() { released.push_back("third"); }
+};
+
+struct Late {
+  ~Late() { released.push_back("late"); }
+};
+
+// gets another singleton on its way out
+struct Creator {
+  ~Creator() {
+    released.push_back("creator");
+    Singleton<Late>::GetInstance();
+  }
+};
+
+// Singletons are released the last created first
+static void TestReverseOrder() {
+  released.clear();
+  Singleton<Second>::GetInstance();
+  Singleton<Third>::GetInstance();
+  CHECK(Singleton<First>::GetInstance() != nullptr);
+  ReleaseSingletons();
+  CHECK((released == std::vector<std::string>{"third", "second", "first"}));
+  // nothing is left to release
+  ReleaseSingletons();
+  CHECK(released.size() == 3);
+}
+
+// A singleton created again after its release goes to the end of the order,
+// one released by hand is not released twice
+static void TestRecreate() {
+  released.clear();
+  Singleton<First>::GetInstance();
+  Singleton<Third>::GetInstance();
+  Singleton<First>::Release();
+  Singleton<First>::GetInstance();
+  Singleton<Second>::GetInstance();
+  Singleton<Third>::Release();
+  ReleaseSingletons();
+  CHECK((released == std::vector<std::string>{"first", "third", "second", "first"}));
+}
+
+// A singleton created by a destructor during the release is released too
+static void TestCreatedWhileReleasing() {
+  released.clear();
+  Singleton<Creator>::GetInstance();
+  ReleaseSingletons();
+  CHECK((released == std::vector<std::string>{"creator", "late"}));
+}
+
+int main() {
+  TestReverseOrder();
+  TestRecreate();
+  TestCreatedWhileReleasing();
+  return TEST_RESULT();
+}
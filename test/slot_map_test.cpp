@@ -0,0 +1,81 @@
+// g++ -std=c++14 -I.. slot_map_test.cpp
+
+#include "test.h"
+#include "../slot_map.h"
+#include <string>
+#include <vector>
+
+using namespace utility;
+
+// Erase moves the last value into the hole, the handle of the moved value
+// still finds it
+static void TestInsertErase() {
+  SlotMap<std::string> slot_map;
+  auto first = slot_map.Insert("first");
+  auto second = slot_map.Insert("second");
+  auto third = slot_map.Insert("third");
+  CHECK(slot_map.size() == 3);
+  CHECK(slot_map.Erase(first));
+  CHECK(!slot_map.Erase(first));
+  CHECK(slot_map.size() == 2);
+  CHECK(slot_map.Find(first) == nullptr);
+  CHECK(slot_map.Find(second) != nullptr && *slot_map.Find(second) == "second");
+  CHECK(slot_map.Find(third) != nullptr && *slot_map.Find(third) == "third");
+  CHECK(*slot_map.begin() == "third");
+  CHECK(slot_map.GetHandle(0) == third);
+  CHECK(slot_map.Find(kInvalidSlotHandle) == nullptr);
+}
+
+// A slot is reused with the next generation, the old handle stays stale
+static void TestStaleHandle() {
+  SlotMap<int> slot_map;
+  auto old_handle = slot_map.Insert(1);
+  CHECK(slot_map.Erase(old_handle));
+  auto new_handle = slot_map.Insert(2);
+  CHECK(new_handle.slot == old_handle.slot);
+  CHECK(new_handle.generation != old_handle.generation);
+  CHECK(!slot_map.Contains(old_handle));
+  CHECK(slot_map.Find(old_handle) == nullptr);
+  CHECK(!slot_map.Erase(old_handle));
+  CHECK(slot_map.Find(new_handle) != nullptr && *slot_map.Find(new_handle) == 2);
+  CHECK(SlotHandle::FromValue(new_handle.value()) == new_handle);
+  // a handle of a slot that was never used
+  SlotHandle unknown = {new_handle.slot + 1, 1};
+  CHECK(slot_map.Find(unknown) == nullptr);
+}
+
+// Every erased slot is reused before the table grows, Clear keeps the
+// generations
+static void TestReuse() {
+  const int kValues = 100;
+  SlotMap<int> slot_map;
+  std::vector<SlotHandle> handles;
+  for (int i = 0; i < kValues; ++i) {
+    handles.push_back(slot_map.Insert(i));
+  }
+  for (int i = 0; i < kValues; i += 2) {
+    CHECK(slot_map.Erase(handles[i]));
+  }
+  for (int i = 0; i < kValues / 2; ++i) {
+    CHECK(slot_map.Insert(i).slot < static_cast<uint32_t>(kValues));
+  }
+  CHECK(slot_map.size() == kValues);
+  CHECK(slot_map.Insert(kValues).slot == static_cast<uint32_t>(kValues));
+  for (int i = 1; i < kValues; i += 2) {
+    CHECK(slot_map.Find(handles[i]) != nullptr && *slot_map.Find(handles[i]) == i);
+  }
+  slot_map.Clear();
+  CHECK(slot_map.empty());
+  for (auto handle : handles) {
+    CHECK(slot_map.Find(handle) == nullptr);
+  }
+  auto handle = slot_map.Insert(0);
+  CHECK(handle.generation > 1);
+}
+
+int main() {
+  TestInsertErase();
+  TestStaleHandle();
+  TestReuse();
+  return TEST_RESULT();
+}
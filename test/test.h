@@ -0,0 +1,27 @@
+/************************************************************************/
+/*  Test Checks                                                         */
+/*  THREAD: unsafe                                                      */
+/*  AUTHOR: chen_lu@outlook.com                                         */
+/************************************************************************/
+
+#ifndef UTILITY_TEST_TEST_H_
+#define UTILITY_TEST_TEST_H_
+
+#include <stdio.h>
+
+// Every test is a program of its own that returns TEST_RESULT() from main,
+// a failed check is printed and the program goes on with the next one
+static int test_failures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+      ++test_failures; \
+    } \
+  } while (false)
+
+#define TEST_RESULT() \
+  (test_failures == 0 ? (printf("%s passed\n", __FILE__), 0) : (printf("%s: %d checks failed\n", __FILE__, test_failures), 1))
+
+#endif // UTILITY_TEST_TEST_H_
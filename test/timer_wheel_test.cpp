@@ -0,0 +1,133 @@
+// g++ -std=c++14 -pthread -I.. timer_wheel_test.cpp ../timer_wheel.cpp ../timer.cpp
+
+#include "test.h"
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+// the ticks are run from the inside instead of waiting for them
+#define private public
+#include "../timer_wheel.h"
+#undef private
+
+using namespace utility;
+
+// a tick long enough that the wheel thread never runs one during a test,
+// and short enough that 2^24 ticks still fit in nanoseconds
+static const std::chrono::minutes kTick(1);
+
+// Run the ticks up to tick, the number of callbacks run
+static size_t RunTicks(TimerWheel& wheel, uint64_t tick) {
+  std::vector<std::function<void ()>> callbacks;
+  wheel.wheel_lock_.lock();
+  wheel.Advance(tick, callbacks);
+  wheel.wheel_lock_.unlock();
+  for (auto& callback : callbacks) {
+    callback();
+  }
+  return callbacks.size();
+}
+
+// Timers expire in the order of their deadlines, not of their scheduling,
+// and none before its tick
+static void TestExpiryOrder() {
+  TimerWheel wheel;
+  CHECK(wheel.Init(nullptr, kTick));
+  std::vector<int> expired;
+  for (int ticks : {5, 1, 300, 3}) {
+    CHECK(wheel.Schedule(kTick * ticks, [&expired, ticks] { expired.push_back(ticks); }) != kInvalidTimerId);
+  }
+  CHECK(wheel.size() == 4);
+  // scheduled a moment after the start, so n ticks out expire at tick n + 1
+  CHECK(RunTicks(wheel, 1) == 0);
+  CHECK(RunTicks(wheel, 4) == 2);
+  CHECK(RunTicks(wheel, 300) == 1);
+  CHECK(RunTicks(wheel, 301) == 1);
+  CHECK((expired == std::vector<int>{1, 3, 5, 300}));
+  CHECK(wheel.size() == 0);
+  wheel.Uninit();
+}
+
+// Cancel stops a timer once, the id of a timer that ran or was cancelled is
+// stale even after its node is reused
+static void TestCancelAndStaleIds() {
+  TimerWheel wheel;
+  CHECK(wheel.Init(nullptr, kTick));
+  auto ran = 0;
+  auto cancelled_id = wheel.Schedule(kTick * 2, [&ran] { ++ran; });
+  CHECK(wheel.Cancel(cancelled_id));
+  CHECK(!wheel.Cancel(cancelled_id));
+  // the node of the cancelled timer is reused under a new generation
+  auto reused_id = wheel.Schedule(kTick * 2, [&ran] { ran += 10; });
+  CHECK(reused_id != cancelled_id);
+  CHECK(SlotHandle::FromValue(reused_id).slot == SlotHandle::FromValue(cancelled_id).slot);
+  CHECK(!wheel.Cancel(cancelled_id));
+  CHECK(RunTicks(wheel, 10) == 1);
+  CHECK(ran == 10);
+  CHECK(!wheel.Cancel(reused_id));
+  CHECK(!wheel.Cancel(kInvalidTimerId));
+  CHECK(!wheel.Cancel(SlotHandle{1000, 1}.value()));
+  wheel.Uninit();
+  // the ids of timers left at Uninit stay stale too
+  CHECK(wheel.Init(nullptr, kTick));
+  auto left_id = wheel.Schedule(kTick * 2, [] {});
+  wheel.Uninit();
+  CHECK(wheel.Init(nullptr, kTick));
+  CHECK(!wheel.Cancel(left_id));
+  wheel.Uninit();
+}
+
+// Timers beyond 2^16 and 2^24 ticks cascade down the levels and expire at
+// their tick, not before
+static void TestCascade() {
+  const uint64_t kLevel2Ticks = (1ULL << 16) + 1000;
+  const uint64_t kLevel3Ticks = (1ULL << 24) + 70000;
+  TimerWheel wheel;
+  CHECK(wheel.Init(nullptr, kTick));
+  std::vector<uint64_t> expired;
+  for (auto ticks : {kLevel3Ticks, kLevel2Ticks, static_cast<uint64_t>(300)}) {
+    wheel.Schedule(kTick * ticks, [&expired, ticks] { expired.push_back(ticks); });
+  }
+  auto cancelled_id = wheel.Schedule(kTick * (kLevel3Ticks - 1), [&expired] { expired.push_back(0); });
+  CHECK(RunTicks(wheel, 301) == 1);
+  CHECK(RunTicks(wheel, kLevel2Ticks) == 0);
+  CHECK(RunTicks(wheel, kLevel2Ticks + 1) == 1);
+  CHECK(wheel.Cancel(cancelled_id));
+  CHECK(RunTicks(wheel, kLevel3Ticks) == 0);
+  CHECK(RunTicks(wheel, kLevel3Ticks + 1) == 1);
+  CHECK((expired == std::vector<uint64_t>{300, kLevel2Ticks, kLevel3Ticks}));
+  CHECK(wheel.size() == 0);
+  wheel.Uninit();
+}
+
+// A callback schedules and cancels timers of its own on the wheel thread
+static void TestScheduleFromCallback() {
+  TimerWheel wheel;
+  CHECK(wheel.Init());
+  std::atomic<int> ran(0);
+  std::atomic<bool> cancelled(false);
+  auto cancelled_id = wheel.Schedule(std::chrono::milliseconds(500), [&ran] { ran += 100; });
+  wheel.Schedule(std::chrono::milliseconds(1), [&] {
+    ++ran;
+    cancelled = wheel.Cancel(cancelled_id);
+    wheel.Schedule(std::chrono::milliseconds(1), [&ran] { ++ran; });
+  });
+  for (int i = 0; i < 1000 && ran < 2; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  CHECK(ran == 2);
+  CHECK(cancelled);
+  wheel.Uninit();
+}
+
+int main() {
+  TestExpiryOrder();
+  TestCancelAndStaleIds();
+  TestCascade();
+  TestScheduleFromCallback();
+  return TEST_RESULT();
+}
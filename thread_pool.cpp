@@ -0,0 +1,71 @@
+#include "thread_pool.h"
+
+namespace utility {
+
+ThreadPool::ThreadPool() {
+  running_ = false;
+}
+
+ThreadPool::~ThreadPool() {
+  Uninit();
+}
+
+bool ThreadPool::Init(size_t thread_number) {
+  if (thread_number == 0) {
+    return false;
+  }
+  if (!threads_.empty()) {
+    return true;
+  }
+  task_lock_.lock();
+  running_ = true;
+  task_lock_.unlock();
+  for (size_t i = 0; i < thread_number; ++i) {
+    auto thread_proc = std::bind(&ThreadPool::Loop, this);
+    threads_.emplace_back(new std::thread(thread_proc));
+  }
+  return true;
+}
+
+bool ThreadPool::Post(std::function<void ()>&& task) {
+  {
+    std::lock_guard<std::mutex> lock(task_lock_);
+    if (!running_) {
+      return false;
+    }
+    tasks_.push_back(std::move(task));
+  }
+  task_cond_.notify_one();
+  return true;
+}
+
+void ThreadPool::Uninit() {
+  task_lock_.lock();
+  running_ = false;
+  task_lock_.unlock();
+  task_cond_.notify_all();
+  for (auto& i : threads_) {
+    i->join();
+  }
+  threads_.clear();
+}
+
+bool ThreadPool::Loop() {
+  while (true) {
+    std::function<void ()> task;
+    {
+      std::unique_lock<std::mutex> lock(task_lock_);
+      task_cond_.wait(lock, [this] { return !running_ || !tasks_.empty(); });
+      // the tasks left are run before stopping
+      if (tasks_.empty()) {
+        return true;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+  return true;
+}
+
+} // namespace utility
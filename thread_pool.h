@@ -0,0 +1,46 @@
+/************************************************************************/
+/*  Thread Pool                                                         */
+/*  THREAD: safe                                                        */
+/*  AUTHOR: chen_lu@outlook.com                                         */
+/************************************************************************/
+
+#ifndef UTILITY_THREAD_POOL_H_
+#define UTILITY_THREAD_POOL_H_
+
+#include "uncopyable.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace utility {
+
+// Tasks run on the first idle thread, in the order posted
+class ThreadPool : public Uncopyable {
+ public:
+  ThreadPool();
+  ~ThreadPool();
+
+  bool Init(size_t thread_number);
+  bool Post(std::function<void ()>&& task);
+  // Run what was posted before, then stop the threads
+  void Uninit();
+  size_t size() const { return threads_.size(); }
+
+ private:
+  bool Loop();
+
+ private:
+  bool running_;
+  std::deque<std::function<void ()>> tasks_;
+  std::mutex task_lock_;
+  std::condition_variable task_cond_;
+  std::vector<std::unique_ptr<std::thread>> threads_;
+};
+
+} // namespace utility
+
+#endif // UTILITY_THREAD_POOL_H_
@@ -16,7 +16,7 @@ namespace utility {
 
 Timer::Timer() {
   timer_ = INVALID_TIMER;
-  period_ = 0;
+  slack_ = std::chrono::nanoseconds::zero();
 }
 
 Timer::~Timer() {
@@ -30,12 +30,7 @@ bool Timer::Init(int period) {
   if (timer_ != INVALID_TIMER) {
     return true;
   }
-#ifdef WIN32
-  timer_ = CreateWaitableTimer(NULL, FALSE, NULL);
-#else
-  timer_ = timerfd_create(CLOCK_REALTIME, 0);
-#endif
-  if (timer_ == INVALID_TIMER) {
+  if (!Init()) {
     return false;
   }
   if (!ResetTimer(period)) {
@@ -45,30 +40,99 @@ bool Timer::Init(int period) {
   return true;
 }
 
-#ifdef WIN32
 bool Timer::ResetTimer(int period) {
-  if (period < 0 || timer_ == INVALID_TIMER) {
+  if (period < 0) {
+    return false;
+  }
+  if (period == 0) {
+    return Cancel();
+  }
+  return SetPeriodic(std::chrono::seconds(period));
+}
+
+bool Timer::Init() {
+  if (timer_ != INVALID_TIMER) {
+    return true;
+  }
+#ifdef WIN32
+  timer_ = CreateWaitableTimer(NULL, FALSE, NULL);
+#else
+  timer_ = timerfd_create(CLOCK_MONOTONIC, 0);
+#endif
+  return timer_ != INVALID_TIMER;
+}
+
+bool Timer::SetPeriodic(std::chrono::nanoseconds period) {
+  if (period <= std::chrono::nanoseconds::zero()) {
+    return false;
+  }
+  return Arm(Clock::now() + period, period);
+}
+
+bool Timer::SetOnce(std::chrono::nanoseconds timeout) {
+  return Arm(Clock::now() + timeout, std::chrono::nanoseconds::zero());
+}
+
+bool Timer::SetDeadline(Clock::time_point deadline) {
+  return Arm(deadline, std::chrono::nanoseconds::zero());
+}
+
+#ifdef WIN32
+bool Timer::Cancel() {
+  if (timer_ == INVALID_TIMER) {
+    return false;
+  }
+  return CancelWaitableTimer(timer_) != FALSE;
+}
+
+// the waitable timer coalesces by itself within the tolerable delay
+bool Timer::Arm(Clock::time_point deadline, std::chrono::nanoseconds interval) {
+  if (timer_ == INVALID_TIMER) {
     return false;
   }
-  period_ = period;
   LARGE_INTEGER li = {0};
   const LONGLONG llTimerUnitsPerSecond = 10000000;	// һӦ100170
-  li.QuadPart = -(period_ * llTimerUnitsPerSecond);
-  if (!SetWaitableTimer(timer_, &li, period_ * 1000, NULL, NULL, FALSE)){
+  auto due_time = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - Clock::now()).count() / (1000000000 / llTimerUnitsPerSecond);
+  // relative due times are negative, 0 would mean an absolute time
+  li.QuadPart = -(due_time > 0 ? due_time : 1);
+  auto period = std::chrono::duration_cast<std::chrono::milliseconds>(interval + std::chrono::microseconds(999)).count();
+  auto tolerable_delay = std::chrono::duration_cast<std::chrono::milliseconds>(slack_).count();
+  if (!SetWaitableTimerEx(timer_, &li, static_cast<LONG>(period), NULL, NULL, NULL, static_cast<ULONG>(tolerable_delay))){
     return false;
   }
   return true;
 }
 #else
-bool Timer::ResetTimer(int period) {
-  if (period < 0 || timer_ == INVALID_TIMER) {
+bool Timer::Cancel() {
+  if (timer_ == INVALID_TIMER) {
     return false;
   }
-  period_ = period;
   itimerspec timer_spec = {0};
-  timer_spec.it_value.tv_sec = period_;
-  timer_spec.it_interval.tv_sec = period_;
-  if (timerfd_settime(timer_, 0, &timer_spec, nullptr) == -1){
+  return timerfd_settime(timer_, 0, &timer_spec, nullptr) != -1;
+}
+
+// steady_clock is CLOCK_MONOTONIC, the deadline is set as an absolute time
+// so it does not drift by the time spent getting here
+bool Timer::Arm(Clock::time_point deadline, std::chrono::nanoseconds interval) {
+  if (timer_ == INVALID_TIMER) {
+    return false;
+  }
+  auto expire_time = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+  if (slack_ > std::chrono::nanoseconds::zero()) {
+    // round up to the slack, every timer with this slack expires on the same grid
+    auto slack = slack_.count();
+    expire_time = (expire_time + slack - 1) / slack * slack;
+  }
+  // a zero expiration disarms, a deadline in the past expires at once
+  if (expire_time <= 0) {
+    expire_time = 1;
+  }
+  itimerspec timer_spec = {0};
+  timer_spec.it_value.tv_sec = static_cast<time_t>(expire_time / 1000000000);
+  timer_spec.it_value.tv_nsec = static_cast<long>(expire_time % 1000000000);
+  timer_spec.it_interval.tv_sec = static_cast<time_t>(interval.count() / 1000000000);
+  timer_spec.it_interval.tv_nsec = static_cast<long>(interval.count() % 1000000000);
+  if (timerfd_settime(timer_, TFD_TIMER_ABSTIME, &timer_spec, nullptr) == -1){
     return false;
   }
   return true;
@@ -96,15 +160,24 @@ bool Timer::Wait() {
 
 void Timer::Uninit() {
   if (timer_ != INVALID_TIMER) {
-    ResetTimer(0);
+    // invalid first, so a thread woken below cannot rearm the timer and
+    // wait again, then keep expiring every millisecond, a thread in Wait
+    // returns and then fails on the closed timer
+    auto timer = timer_;
+    timer_ = INVALID_TIMER;
 #ifdef WIN32
-    CloseHandle(timer_);
+    LARGE_INTEGER li = {0};
+    li.QuadPart = -1;
+    SetWaitableTimer(timer, &li, 1, NULL, NULL, FALSE);
+    CloseHandle(timer);
 #else
-    close(timer_);
+    itimerspec timer_spec = {0};
+    timer_spec.it_value.tv_nsec = 1;
+    timer_spec.it_interval.tv_nsec = 1000000;
+    timerfd_settime(timer, 0, &timer_spec, nullptr);
+    close(timer);
 #endif
-    timer_ = INVALID_TIMER;
   }
-  period_ = 0;
 }
 
 } // namespace utility
\ No newline at end of file
@@ -8,6 +8,7 @@
 #define UTILITY_TIMER_H_
 
 #include "uncopyable.h"
+#include <chrono>
 #ifdef WIN32
 #include <Windows.h>
 #else
@@ -15,23 +16,50 @@
 
 namespace utility {
 
+// Runs on the monotonic clock, so stepping the system time moves nothing
 class Timer : public Uncopyable {
  public:
+  typedef std::chrono::steady_clock Clock;
+
   Timer();
   ~Timer();
 
+  // Periodic in seconds, period 0 disarms
   bool Init(int period);
   bool ResetTimer(int period);
+  // Created disarmed
+  bool Init();
+  // Expire every period, the first time one period from now
+  bool SetPeriodic(std::chrono::nanoseconds period);
+  // Expire once after timeout, or once at deadline
+  bool SetOnce(std::chrono::nanoseconds timeout);
+  bool SetDeadline(Clock::time_point deadline);
+  bool Cancel();
   bool Wait();
   void Uninit();
 
+  // Expirations may be put off by up to slack, timers with the same slack
+  // then expire together instead of waking the thread one by one
+  std::chrono::nanoseconds slack() const { return slack_; }
+  void set_slack(std::chrono::nanoseconds slack) { slack_ = slack; }
+
+  // What an event loop waits on
+#ifdef WIN32
+  HANDLE handle() const { return timer_; }
+#else
+  int handle() const { return timer_; }
+#endif
+
+ private:
+  bool Arm(Clock::time_point deadline, std::chrono::nanoseconds interval);
+
  private:
 #ifdef WIN32
   HANDLE timer_;
 #else
   int timer_;
 #endif
-  int period_;
+  std::chrono::nanoseconds slack_;
 };
 
 } // namespace utility
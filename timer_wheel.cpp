@@ -0,0 +1,312 @@
+#include "timer_wheel.h"
+#include <algorithm>
+#include <string.h>
+#ifdef WIN32
+#include <intrin.h>
+#else
+#endif
+
+namespace utility {
+
+#ifdef WIN32
+static size_t CountTrailingZeros(uint64_t bits) {
+  unsigned long position = 0;
+  _BitScanForward64(&position, bits);
+  return position;
+}
+#else
+static size_t CountTrailingZeros(uint64_t bits) {
+  return __builtin_ctzll(bits);
+}
+#endif
+
+TimerWheel::TimerWheel() {
+  tick_ = std::chrono::milliseconds(1);
+  current_tick_ = 0;
+  armed_tick_ = 0;
+  free_node_ = kNoNode;
+  timer_count_ = 0;
+  memset(slots_, 0xFF, sizeof(slots_));
+  memset(occupied_slots_, 0, sizeof(occupied_slots_));
+}
+
+TimerWheel::~TimerWheel() {
+  Uninit();
+}
+
+bool TimerWheel::Init(TimerExecutor&& executor, std::chrono::nanoseconds tick) {
+  if (tick <= std::chrono::nanoseconds::zero()) {
+    return false;
+  }
+  if (wheel_thread_ != nullptr) {
+    return true;
+  }
+  // armed by the first Schedule
+  if (!timer_.Init()) {
+    return false;
+  }
+  executor_ = std::move(executor);
+  tick_ = tick;
+  start_time_ = Timer::Clock::now();
+  current_tick_ = 0;
+  armed_tick_ = 0;
+  auto thread_proc = std::bind(&TimerWheel::Loop, this);
+  wheel_thread_.reset(new std::thread(thread_proc));
+  return true;
+}
+
+TimerId TimerWheel::Schedule(int timeout, std::function<void ()>&& callback) {
+  return Schedule(std::chrono::seconds(timeout), std::move(callback));
+}
+
+TimerId TimerWheel::Schedule(std::chrono::nanoseconds timeout, std::function<void ()>&& callback) {
+  std::lock_guard<std::mutex> lock(wheel_lock_);
+  if (wheel_thread_ == nullptr) {
+    return kInvalidTimerId;
+  }
+  auto position = free_node_;
+  if (position != kNoNode) {
+    free_node_ = nodes_[position].next;
+  } else if (nodes_.size() < kNoNode) {
+    position = static_cast<uint32_t>(nodes_.size());
+    nodes_.emplace_back();
+    nodes_.back().generation = 0;
+  } else {
+    return kInvalidTimerId;
+  }
+  auto elapsed = Timer::Clock::now() - start_time_;
+  auto now_tick = static_cast<uint64_t>(elapsed / tick_);
+  if (timer_count_ == 0) {
+    // nothing to run on the way, skip the idle ticks
+    current_tick_ = std::max(current_tick_, now_tick);
+  }
+  ++timer_count_;
+  auto& node = nodes_[position];
+  ++node.generation;
+  // the first tick that starts at or after the timeout
+  auto expire_time = elapsed + std::max(timeout, std::chrono::nanoseconds::zero());
+  node.expire_tick = std::max<uint64_t>((expire_time + tick_ - std::chrono::nanoseconds(1)) / tick_, current_tick_ + 1);
+  node.callback = std::move(callback);
+  Link(position);
+  if (armed_tick_ == 0 || node.expire_tick < armed_tick_) {
+    Arm();
+  }
+  SlotHandle handle = {position, node.generation};
+  return handle.value();
+}
+
+bool TimerWheel::Cancel(TimerId timer_id) {
+  std::lock_guard<std::mutex> lock(wheel_lock_);
+  if (FindNode(timer_id) == nullptr) {
+    return false;
+  }
+  // the timer may wake for nothing, it is not worth rearming here
+  auto position = SlotHandle::FromValue(timer_id).slot;
+  Unlink(position);
+  FreeNode(position);
+  return true;
+}
+
+size_t TimerWheel::size() {
+  std::lock_guard<std::mutex> lock(wheel_lock_);
+  return timer_count_;
+}
+
+void TimerWheel::Uninit() {
+  wheel_lock_.lock();
+  timer_.Uninit();
+  wheel_lock_.unlock();
+  if (wheel_thread_ != nullptr) {
+    wheel_thread_->join();
+    wheel_thread_ = nullptr;
+  }
+  wheel_lock_.lock();
+  // keep the nodes and their generations, so old ids stay stale
+  for (uint32_t position = 0; position < nodes_.size(); ++position) {
+    if (nodes_[position].generation % 2 != 0) {
+      FreeNode(position);
+    }
+  }
+  memset(slots_, 0xFF, sizeof(slots_));
+  memset(occupied_slots_, 0, sizeof(occupied_slots_));
+  current_tick_ = 0;
+  armed_tick_ = 0;
+  wheel_lock_.unlock();
+  executor_ = nullptr;
+}
+
+bool TimerWheel::Loop() {
+  std::vector<std::function<void ()>> callbacks;
+  while (timer_.Wait()) {
+    wheel_lock_.lock();
+    auto now_tick = GetCurrentTick();
+    Advance(now_tick, callbacks);
+    armed_tick_ = 0;
+    Arm();
+    wheel_lock_.unlock();
+    // callbacks may schedule and cancel, run them without the lock
+    for (auto& callback : callbacks) {
+      if (executor_ != nullptr) {
+        executor_(std::move(callback));
+      } else {
+        callback();
+      }
+    }
+    callbacks.clear();
+  }
+  return true;
+}
+
+uint64_t TimerWheel::GetCurrentTick() const {
+  return static_cast<uint64_t>((Timer::Clock::now() - start_time_) / tick_);
+}
+
+void TimerWheel::Advance(uint64_t now_tick, std::vector<std::function<void ()>>& callbacks) {
+  // ticks without anything to expire or cascade are skipped
+  while (true) {
+    auto next_tick = GetNextTick();
+    if (next_tick == 0 || next_tick > now_tick) {
+      break;
+    }
+    ExpireTick(next_tick, callbacks);
+  }
+  current_tick_ = std::max(current_tick_, now_tick);
+}
+
+void TimerWheel::ExpireTick(uint64_t tick, std::vector<std::function<void ()>>& callbacks) {
+  current_tick_ = tick;
+  // move the timers of higher levels down when the lower level wraps, the
+  // highest first so a timer falls through every level in one tick
+  for (auto level = kLevelNumber - 1; level > 0; --level) {
+    if ((tick & ((1ULL << (level * kLevelBits)) - 1)) != 0) {
+      continue;
+    }
+    auto position = TakeSlot(level, (tick >> (level * kLevelBits)) % kSlotNumber);
+    while (position != kNoNode) {
+      auto next_position = nodes_[position].next;
+      Link(position);
+      position = next_position;
+    }
+  }
+  auto position = TakeSlot(0, tick % kSlotNumber);
+  while (position != kNoNode) {
+    auto next_position = nodes_[position].next;
+    callbacks.push_back(std::move(nodes_[position].callback));
+    FreeNode(position);
+    position = next_position;
+  }
+}
+
+uint64_t TimerWheel::GetNextTick() const {
+  if (timer_count_ == 0) {
+    return 0;
+  }
+  uint64_t next_tick = 0;
+  for (size_t level = 0; level < kLevelNumber; ++level) {
+    auto shift = level * kLevelBits;
+    auto level_tick = current_tick_ >> shift;
+    auto distance = FindOccupiedSlot(occupied_slots_[level], (level_tick + 1) % kSlotNumber);
+    if (distance == kSlotNumber) {
+      continue;
+    }
+    // level 0 slots expire, the others cascade when their span starts
+    auto tick = (level_tick + 1 + distance) << shift;
+    if (next_tick == 0 || tick < next_tick) {
+      next_tick = tick;
+    }
+  }
+  return next_tick;
+}
+
+void TimerWheel::Arm() {
+  auto next_tick = GetNextTick();
+  if (next_tick == 0) {
+    timer_.Cancel();
+    armed_tick_ = 0;
+    return;
+  }
+  // a deadline already passed expires at once
+  timer_.SetDeadline(start_time_ + tick_ * next_tick);
+  armed_tick_ = next_tick;
+}
+
+TimerWheel::TimerNode* TimerWheel::FindNode(TimerId timer_id) {
+  auto handle = SlotHandle::FromValue(timer_id);
+  if (handle.slot >= nodes_.size() || handle.generation % 2 == 0) {
+    return nullptr;
+  }
+  auto& node = nodes_[handle.slot];
+  return node.generation == handle.generation ? &node : nullptr;
+}
+
+void TimerWheel::FreeNode(uint32_t position) {
+  auto& node = nodes_[position];
+  ++node.generation;
+  node.callback = nullptr;
+  node.next = free_node_;
+  free_node_ = position;
+  --timer_count_;
+}
+
+void TimerWheel::Link(uint32_t position) {
+  auto& node = nodes_[position];
+  auto delay = node.expire_tick > current_tick_ ? node.expire_tick - current_tick_ : 0;
+  size_t level = 0;
+  while (level < kLevelNumber - 1 && delay >= 1ULL << ((level + 1) * kLevelBits)) {
+    ++level;
+  }
+  size_t slot = (node.expire_tick >> (level * kLevelBits)) % kSlotNumber;
+  node.level = static_cast<uint8_t>(level);
+  node.slot = static_cast<uint8_t>(slot);
+  node.prev = kNoNode;
+  node.next = slots_[level][slot];
+  if (node.next != kNoNode) {
+    nodes_[node.next].prev = position;
+  }
+  slots_[level][slot] = position;
+  occupied_slots_[level][slot / 64] |= 1ULL << (slot % 64);
+}
+
+void TimerWheel::Unlink(uint32_t position) {
+  auto& node = nodes_[position];
+  if (node.prev != kNoNode) {
+    nodes_[node.prev].next = node.next;
+  } else {
+    slots_[node.level][node.slot] = node.next;
+    if (node.next == kNoNode) {
+      occupied_slots_[node.level][node.slot / 64] &= ~(1ULL << (node.slot % 64));
+    }
+  }
+  if (node.next != kNoNode) {
+    nodes_[node.next].prev = node.prev;
+  }
+}
+
+uint32_t TimerWheel::TakeSlot(size_t level, size_t slot) {
+  auto position = slots_[level][slot];
+  slots_[level][slot] = kNoNode;
+  occupied_slots_[level][slot / 64] &= ~(1ULL << (slot % 64));
+  return position;
+}
+
+// Distance from from to the first occupied slot going round the level,
+// kSlotNumber when the level is empty
+size_t TimerWheel::FindOccupiedSlot(const uint64_t* occupied, size_t from) {
+  for (size_t i = 0; i <= kSlotWordNumber; ++i) {
+    auto word = (from / 64 + i) % kSlotWordNumber;
+    auto bits = occupied[word];
+    if (i == 0) {
+      bits &= ~0ULL << (from % 64);
+    } else if (i == kSlotWordNumber) {
+      // back at the first word, the bits below from
+      bits &= (1ULL << (from % 64)) - 1;
+    }
+    if (bits != 0) {
+      auto slot = word * 64 + CountTrailingZeros(bits);
+      return (slot + kSlotNumber - from) % kSlotNumber;
+    }
+  }
+  return kSlotNumber;
+}
+
+} // namespace utility
@@ -0,0 +1,102 @@
+/************************************************************************/
+/*  Timer Wheel                                                         */
+/*  THREAD: safe                                                        */
+/*  AUTHOR: chen_lu@outlook.com                                         */
+/************************************************************************/
+
+#ifndef UTILITY_TIMER_WHEEL_H_
+#define UTILITY_TIMER_WHEEL_H_
+
+#include "slot_map.h"
+#include "timer.h"
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+namespace utility {
+
+typedef uint64_t TimerId;
+const TimerId kInvalidTimerId = 0;
+
+// Runs an expired callback somewhere, the wheel thread when not given
+typedef std::function<void (std::function<void ()>&&)> TimerExecutor;
+
+// Hierarchical timing wheel of 4 levels with 256 slots each. Schedule and
+// Cancel are O(1), one Timer is armed to the deadline of the next tick that
+// has work and a single thread waits on it.
+class TimerWheel : public Uncopyable {
+ public:
+  TimerWheel();
+  ~TimerWheel();
+
+  // timers run at most one tick late
+  bool Init(TimerExecutor&& executor = nullptr, std::chrono::nanoseconds tick = std::chrono::milliseconds(1));
+  // callback runs once, not before timeout from now
+  TimerId Schedule(std::chrono::nanoseconds timeout, std::function<void ()>&& callback);
+  // timeout in seconds
+  TimerId Schedule(int timeout, std::function<void ()>&& callback);
+  // false when the timer already ran or was cancelled
+  bool Cancel(TimerId timer_id);
+  size_t size();
+  void Uninit();
+
+ private:
+  static const size_t kLevelNumber = 4;
+  static const size_t kLevelBits = 8;
+  static const size_t kSlotNumber = 1 << kLevelBits;
+  static const size_t kSlotWordNumber = kSlotNumber / 64;
+
+  static const uint32_t kNoNode = 0xFFFFFFFF;
+
+  // nodes stay where they are, the slot lists link them by position
+  struct TimerNode {
+    uint64_t expire_tick;
+    uint32_t prev;
+    // next free node while free
+    uint32_t next;
+    // odd while scheduled
+    uint32_t generation;
+    uint8_t level;
+    uint8_t slot;
+    std::function<void ()> callback;
+  };
+
+  bool Loop();
+  uint64_t GetCurrentTick() const;
+  // Run the ticks up to now_tick, expired callbacks are moved into callbacks
+  void Advance(uint64_t now_tick, std::vector<std::function<void ()>>& callbacks);
+  void ExpireTick(uint64_t tick, std::vector<std::function<void ()>>& callbacks);
+  // First tick after current_tick_ that expires or cascades a timer, 0 when empty
+  uint64_t GetNextTick() const;
+  void Arm();
+  TimerNode* FindNode(TimerId timer_id);
+  void FreeNode(uint32_t position);
+  void Link(uint32_t position);
+  void Unlink(uint32_t position);
+  uint32_t TakeSlot(size_t level, size_t slot);
+  static size_t FindOccupiedSlot(const uint64_t* occupied, size_t from);
+
+ private:
+  Timer timer_;
+  TimerExecutor executor_;
+  std::chrono::nanoseconds tick_;
+  Timer::Clock::time_point start_time_;
+  uint64_t current_tick_;
+  // tick the timer is armed for, 0 when disarmed
+  uint64_t armed_tick_;
+  std::vector<TimerNode> nodes_;
+  uint32_t free_node_;
+  size_t timer_count_;
+  uint32_t slots_[kLevelNumber][kSlotNumber];
+  uint64_t occupied_slots_[kLevelNumber][kSlotWordNumber];
+  std::mutex wheel_lock_;
+  std::unique_ptr<std::thread> wheel_thread_;
+};
+
+} // namespace utility
+
+#endif // UTILITY_TIMER_WHEEL_H_
@@ -0,0 +1,32 @@
+// Convert binary log files written with kEncodingBinary into text logs
+// USAGE: log_decoder <file.logb> [output.log]
+
+#include "../log_format.h"
+#include <fstream>
+#include <iostream>
+
+int main(int argc, char* argv[]) {
+  if (argc < 2 || argc > 3) {
+    std::cerr << "usage: " << argv[0] << " <file.logb> [output.log]" << std::endl;
+    return 1;
+  }
+  std::ifstream input(argv[1], std::ios::in | std::ios::binary);
+  if (!input.is_open()) {
+    std::cerr << "fail to open " << argv[1] << std::endl;
+    return 1;
+  }
+  std::ofstream output_file;
+  if (argc == 3) {
+    output_file.open(argv[2], std::ios::out | std::ios::trunc);
+    if (!output_file.is_open()) {
+      std::cerr << "fail to open " << argv[2] << std::endl;
+      return 1;
+    }
+  }
+  std::ostream& output = argc == 3 ? output_file : std::cout;
+  if (!utility::DecodeBinaryLog(input, output)) {
+    std::cerr << "broken binary log " << argv[1] << std::endl;
+    return 1;
+  }
+  return 0;
+}
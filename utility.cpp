@@ -1,4 +1,5 @@
 #include "utility.h"
+#include <chrono>
 #include <memory>
 #ifdef WIN32
 #include <time.h>
@@ -158,6 +159,33 @@ void GetSpecialDayTime(DayTime& now, int due) {
   now.day = now_tm.tm_mday;
 }
 
+long long GetCurrentMicroseconds() {
+  auto now = std::chrono::system_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+long long GetCurrentNanoseconds() {
+  auto now = std::chrono::system_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+void GetSpecialAccurateTime(AccurateTime& time, long long microseconds) {
+  auto seconds = static_cast<time_t>(microseconds / 1000000);
+  tm time_tm = {0};
+#ifdef WIN32
+  localtime_s(&time_tm, &seconds);
+#else
+  localtime_r(&seconds, &time_tm);
+#endif
+  time.year = time_tm.tm_year + 1900;
+  time.month = time_tm.tm_mon + 1;
+  time.day = time_tm.tm_mday;
+  time.hour = time_tm.tm_hour;
+  time.minute = time_tm.tm_min;
+  time.second = time_tm.tm_sec;
+  time.milliseconds = microseconds % 1000000 / 1000;
+}
+
 unsigned int GetCurrentThreadId() {
 #ifdef WIN32
   return ::GetCurrentThreadId();
@@ -61,6 +61,15 @@ void GetCurrentAccurateTime(AccurateTime& now);
 // Get special day time
 void GetSpecialDayTime(DayTime& now, int due);
 
+// Get microseconds since epoch
+long long GetCurrentMicroseconds();
+
+// Get nanoseconds since epoch
+long long GetCurrentNanoseconds();
+
+// Get accurate time of microseconds since epoch
+void GetSpecialAccurateTime(AccurateTime& time, long long microseconds);
+
 // Get current thread id
 unsigned int GetCurrentThreadId();
 